@@ -0,0 +1,841 @@
+/**
+ * Example of one-sided RDMA atomics. If you have no RDMA hardware, see
+ * https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * Primitives built on IBV_WR_ATOMIC_FETCH_AND_ADD and IBV_WR_ATOMIC_CMP_AND_SWP
+ * against 8 byte aligned words in a region registered with
+ * IBV_ACCESS_REMOTE_ATOMIC:
+ * - atomic_qp: posts up to `depth` atomics back to back, the initiator and
+ *   responder depth (max_rd_atomic/max_dest_rd_atomic) come from the device
+ *   instead of 1, otherwise the HCA serializes every atomic on a round trip.
+ * - sharded_counter: one counter spread over cache line sized shards, adds
+ *   are pipelined, a read sums the shards with RDMA READ.
+ * - sequencer: a global id generator, each client leases `lease` ids with one
+ *   FETCH_AND_ADD and hands them out locally.
+ * - rw_lock: one word, bit 63 is the writer, the low bits count readers.
+ *   Readers FETCH_AND_ADD 1 and back out if a writer holds it, the writer
+ *   CMP_AND_SWPs 0 to the writer bit, both back off exponentially.
+ *
+ * The benchmark runs each primitive with 1..threads clients, each with its
+ * own qp, against one loopback responder and checks the results.
+ *
+ * g++ -O2 atomics.cpp -libverbs -lpthread -o atomics
+ * ./atomics [-t threads] [-n ops] [-d depth] [-l lease] [-w write_pct]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define MAX_SHARDS 64
+#define WRITER_BIT (1ull << 63)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+
+struct qp_params
+{
+    int max_rd_atomic;
+    int max_dest_rd_atomic;
+    port_path path;
+    union ibv_gid gid;
+    uint16_t lid;
+};
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = depth;
+    init_attr.cap.max_recv_wr = 1;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = 16;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE |
+                           IBV_ACCESS_REMOTE_ATOMIC;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const qp_params &p, uint32_t r_qpn, uint32_t r_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.path.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = p.max_dest_rd_atomic;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = p.gid;
+    attr.ah_attr.grh.sgid_index = p.path.gid_index;
+    attr.ah_attr.dlid = p.lid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, const qp_params &p, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = p.max_rd_atomic;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+// a remote region, every word that atomics touch must be 8 byte aligned
+struct remote_ref
+{
+    uint64_t addr;
+    uint32_t rkey;
+
+    remote_ref at(uint64_t offset) const { return {addr + offset, rkey}; }
+};
+
+struct atomic_result
+{
+    uint64_t ctx;
+    uint64_t old; // the remote value before the atomic, or the first word read
+};
+
+/**
+ * An initiator qp with `depth` result slots. Completions of one RC qp come
+ * back in order, so slot `seq % depth` is free again once `depth` newer
+ * operations are not outstanding.
+ */
+class atomic_qp
+{
+public:
+    atomic_qp(struct ibv_context *ctx, struct ibv_pd *pd, int depth)
+        : depth_(depth), ctxs_(depth), wcs_(depth)
+    {
+        cq_ = ibv_create_cq(ctx, depth, nullptr, nullptr, 0);
+        CHECK(cq_, "ibv_create_cq fail");
+        qp_ = create_qp(pd, cq_, depth);
+        slots_ = (uint64_t *)aligned_alloc(64, depth * 16);
+        CHECK(slots_, "aligned_alloc fail");
+        memset(slots_, 0, depth * 16);
+        mr_ = ibv_reg_mr(pd, slots_, depth * 16, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(mr_, "ibv_reg_mr fail");
+    }
+    ~atomic_qp()
+    {
+        ibv_destroy_qp(qp_);
+        ibv_destroy_cq(cq_);
+        ibv_dereg_mr(mr_);
+        free(slots_);
+    }
+
+    struct ibv_qp *qp() { return qp_; }
+    int depth() const { return depth_; }
+    int inflight() const { return inflight_; }
+
+    void post_faa(remote_ref r, uint64_t add, uint64_t ctx, bool fence = false)
+    {
+        struct ibv_send_wr wr = make_wr(r, ctx, 8, fence);
+        wr.opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+        wr.wr.atomic.compare_add = add;
+        post(wr);
+    }
+    void post_cas(remote_ref r, uint64_t compare, uint64_t swap, uint64_t ctx)
+    {
+        struct ibv_send_wr wr = make_wr(r, ctx, 8, false);
+        wr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+        wr.wr.atomic.compare_add = compare;
+        wr.wr.atomic.swap = swap;
+        post(wr);
+    }
+    // len is 8 or 16, the words land in the result slot
+    void post_read(remote_ref r, uint32_t len, uint64_t ctx)
+    {
+        struct ibv_send_wr wr = make_wr(r, ctx, len, false);
+        wr.opcode = IBV_WR_RDMA_READ;
+        wr.wr.rdma.remote_addr = r.addr;
+        wr.wr.rdma.rkey = r.rkey;
+        post(wr);
+    }
+    void post_write(remote_ref r, const uint64_t *words, uint32_t len, uint64_t ctx)
+    {
+        struct ibv_sge sge = {(uint64_t)words, len, 0};
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = seq_;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+        wr.wr.rdma.remote_addr = r.addr;
+        wr.wr.rdma.rkey = r.rkey;
+        ctxs_[seq_ % depth_] = ctx;
+        post(wr);
+    }
+
+    // reap completions into out, at most `max`, returns how many
+    int poll(atomic_result *out, int max)
+    {
+        int n = ibv_poll_cq(cq_, std::min(max, depth_), wcs_.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            if (wcs_[i].status != IBV_WC_SUCCESS)
+            {
+                printf("atomic wr %lu failed, %s\n", wcs_[i].wr_id, ibv_wc_status_str(wcs_[i].status));
+                CHECK(false, "bad wc");
+            }
+            const uint64_t slot = wcs_[i].wr_id % depth_;
+            out[i].ctx = ctxs_[slot];
+            out[i].old = slots_[slot * 2];
+        }
+        inflight_ -= n;
+        return n;
+    }
+
+    // make room for one more post, completions reaped on the way go to on_result
+    template <typename F>
+    void wait_slot(F &&on_result)
+    {
+        atomic_result res[16];
+        while (inflight_ >= depth_)
+        {
+            int n = poll(res, 16);
+            for (int i = 0; i < n; i++)
+            {
+                on_result(res[i]);
+            }
+        }
+    }
+
+    template <typename F>
+    void drain(F &&on_result)
+    {
+        atomic_result res[16];
+        while (inflight_ > 0)
+        {
+            int n = poll(res, 16);
+            for (int i = 0; i < n; i++)
+            {
+                on_result(res[i]);
+            }
+        }
+    }
+
+    // blocking versions, only valid with nothing else outstanding
+    uint64_t faa(remote_ref r, uint64_t add, bool fence = false)
+    {
+        post_faa(r, add, 0, fence);
+        return wait_one().old;
+    }
+    uint64_t cas(remote_ref r, uint64_t compare, uint64_t swap)
+    {
+        post_cas(r, compare, swap, 0);
+        return wait_one().old;
+    }
+    uint64_t read(remote_ref r)
+    {
+        post_read(r, 8, 0);
+        return wait_one().old;
+    }
+    void read16(remote_ref r, uint64_t *out)
+    {
+        post_read(r, 16, 0);
+        const uint64_t slot = (seq_ - 1) % depth_;
+        wait_one();
+        out[0] = slots_[slot * 2];
+        out[1] = slots_[slot * 2 + 1];
+    }
+    void write16(remote_ref r, const uint64_t *words)
+    {
+        post_write(r, words, 16, 0);
+        wait_one();
+    }
+
+private:
+    struct ibv_send_wr make_wr(remote_ref r, uint64_t ctx, uint32_t len, bool fence)
+    {
+        CHECK(r.addr % 8 == 0, "unaligned remote word");
+        const uint64_t slot = seq_ % depth_;
+        ctxs_[slot] = ctx;
+        sge_ = {(uint64_t)&slots_[slot * 2], len, mr_->lkey};
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = seq_;
+        wr.sg_list = &sge_;
+        wr.num_sge = 1;
+        // a fence keeps the op behind earlier reads and atomics, e.g. an unlock
+        wr.send_flags = IBV_SEND_SIGNALED | (fence ? IBV_SEND_FENCE : 0);
+        wr.wr.atomic.remote_addr = r.addr;
+        wr.wr.atomic.rkey = r.rkey;
+        return wr;
+    }
+
+    void post(struct ibv_send_wr &wr)
+    {
+        CHECK(inflight_ < depth_, "atomic_qp full");
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+        seq_++;
+        inflight_++;
+    }
+
+    atomic_result wait_one()
+    {
+        CHECK(inflight_ == 1, "blocking op with others outstanding");
+        atomic_result res;
+        while (poll(&res, 1) == 0)
+        {
+        }
+        return res;
+    }
+
+    const int depth_;
+    struct ibv_cq *cq_;
+    struct ibv_qp *qp_;
+    struct ibv_mr *mr_;
+    uint64_t *slots_; // 16 bytes per slot
+    struct ibv_sge sge_;
+    uint64_t seq_ = 0;
+    int inflight_ = 0;
+    std::vector<uint64_t> ctxs_;
+    std::vector<struct ibv_wc> wcs_;
+};
+
+// exponential backoff with jitter, spins on the clock
+class backoff
+{
+public:
+    backoff(uint64_t min_ns = 200, uint64_t max_ns = 100000, uint32_t seed = 1)
+        : min_(min_ns), max_(max_ns), cur_(min_ns), rng_(seed) {}
+
+    void wait()
+    {
+        const uint64_t until = now_ns() + cur_ / 2 + rng_() % (cur_ / 2 + 1);
+        while (now_ns() < until)
+        {
+        }
+        cur_ = std::min(cur_ * 2, max_);
+        waits_++;
+    }
+    void reset() { cur_ = min_; }
+    uint64_t waits() const { return waits_; }
+
+private:
+    const uint64_t min_;
+    const uint64_t max_;
+    uint64_t cur_;
+    std::minstd_rand rng_;
+    uint64_t waits_ = 0;
+};
+
+/**
+ * A counter over `shards` words one cache line apart, client i adds to shard
+ * i % shards so clients rarely hit the same word. Adds don't wait for the old
+ * value, up to depth of them are in flight.
+ */
+class sharded_counter
+{
+public:
+    sharded_counter(atomic_qp &q, remote_ref base, int shards, int id)
+        : q_(q), base_(base), shards_(shards), mine_(base.at(64 * (id % shards))) {}
+
+    void add(uint64_t n)
+    {
+        q_.wait_slot([](const atomic_result &) {});
+        q_.post_faa(mine_, n, 0);
+    }
+    void flush()
+    {
+        q_.drain([](const atomic_result &) {});
+    }
+    uint64_t read()
+    {
+        flush();
+        uint64_t sum = 0;
+        for (int i = 0; i < shards_; i++)
+        {
+            sum += q_.read(base_.at(64 * i));
+        }
+        return sum;
+    }
+
+private:
+    atomic_qp &q_;
+    const remote_ref base_;
+    const int shards_;
+    const remote_ref mine_;
+};
+
+// globally unique, per client increasing ids, one FETCH_AND_ADD per lease
+class sequencer
+{
+public:
+    sequencer(atomic_qp &q, remote_ref word, uint64_t lease) : q_(q), word_(word), lease_(lease) {}
+
+    uint64_t next()
+    {
+        if (cur_ == end_)
+        {
+            cur_ = q_.faa(word_, lease_);
+            end_ = cur_ + lease_;
+            leases_++;
+        }
+        return cur_++;
+    }
+    uint64_t leases() const { return leases_; }
+
+private:
+    atomic_qp &q_;
+    const remote_ref word_;
+    const uint64_t lease_;
+    uint64_t cur_ = 0;
+    uint64_t end_ = 0;
+    uint64_t leases_ = 0;
+};
+
+class rw_lock
+{
+public:
+    rw_lock(atomic_qp &q, remote_ref word, uint32_t seed) : q_(q), word_(word), backoff_(200, 100000, seed) {}
+
+    void lock_shared()
+    {
+        backoff_.reset();
+        while (true)
+        {
+            const uint64_t old = q_.faa(word_, 1);
+            if (!(old & WRITER_BIT))
+            {
+                return;
+            }
+            // a writer holds it, back out and wait by reading, not by adding
+            q_.faa(word_, (uint64_t)-1);
+            do
+            {
+                backoff_.wait();
+            } while (q_.read(word_) & WRITER_BIT);
+        }
+    }
+    void unlock_shared()
+    {
+        q_.faa(word_, (uint64_t)-1, true);
+    }
+    void lock()
+    {
+        backoff_.reset();
+        while (q_.cas(word_, 0, WRITER_BIT) != 0)
+        {
+            backoff_.wait();
+        }
+    }
+    void unlock()
+    {
+        // subtract rather than swap to 0, readers backing out may still count
+        q_.faa(word_, (uint64_t)-WRITER_BIT, true);
+    }
+    uint64_t backoffs() const { return backoff_.waits(); }
+
+private:
+    atomic_qp &q_;
+    const remote_ref word_;
+    backoff backoff_;
+};
+
+// the responder side, in this loopback demo it's local memory
+struct alignas(64) remote_area
+{
+    uint64_t hot;
+    uint64_t pad0[7];
+    uint64_t cas;
+    uint64_t pad1[7];
+    uint64_t seq;
+    uint64_t pad2[7];
+    uint64_t lock;
+    uint64_t pad3[7];
+    uint64_t data[2]; // protected by lock, a reader must see both words equal
+    uint64_t pad4[6];
+    uint64_t shards[MAX_SHARDS * 8];
+};
+
+struct options
+{
+    int threads = 8;
+    int ops = 100000;
+    int depth = 16;
+    uint64_t lease = 64;
+    int write_pct = 10;
+};
+
+struct bench
+{
+    const options &o;
+    remote_area *area;
+    remote_ref ref;
+    std::vector<atomic_qp *> clients;
+
+    // run fn(client id) on n threads, return ops/s given total ops
+    double run(int n, uint64_t total_ops, const std::function<void(int)> &fn)
+    {
+        memset(area, 0, sizeof(*area));
+        std::atomic<int> ready{0};
+        std::atomic<bool> go{false};
+        std::vector<std::thread> ths;
+        for (int i = 0; i < n; i++)
+        {
+            ths.emplace_back([&, i]() {
+                ready++;
+                while (!go)
+                {
+                }
+                fn(i);
+            });
+        }
+        while (ready < n)
+        {
+        }
+        const uint64_t start = now_ns();
+        go = true;
+        for (auto &t : ths)
+        {
+            t.join();
+        }
+        return total_ops / ((now_ns() - start) / 1e9);
+    }
+
+    void faa_hot(int n, int depth)
+    {
+        const uint64_t total = (uint64_t)n * o.ops;
+        double rate = run(n, total, [&](int id) {
+            atomic_qp &q = *clients[id];
+            for (int i = 0; i < o.ops; i++)
+            {
+                if (depth == 1)
+                {
+                    q.faa(ref.at(offsetof(remote_area, hot)), 1);
+                    continue;
+                }
+                q.wait_slot([](const atomic_result &) {});
+                q.post_faa(ref.at(offsetof(remote_area, hot)), 1, 0);
+            }
+            q.drain([](const atomic_result &) {});
+        });
+        CHECK(area->hot == total, "hot counter lost adds");
+        printf("faa one word     depth=%-3d threads=%-2d %10.0f ops/s\n", depth, n, rate);
+    }
+
+    void faa_sharded(int n)
+    {
+        const int shards = std::min(n, MAX_SHARDS);
+        const uint64_t total = (uint64_t)n * o.ops;
+        uint64_t sum = 0;
+        double rate = run(n, total, [&](int id) {
+            sharded_counter c(*clients[id], ref.at(offsetof(remote_area, shards)), shards, id);
+            for (int i = 0; i < o.ops; i++)
+            {
+                c.add(1);
+            }
+            c.flush();
+        });
+        sharded_counter reader(*clients[0], ref.at(offsetof(remote_area, shards)), shards, 0);
+        sum = reader.read();
+        CHECK(sum == total, "sharded counter lost adds");
+        printf("faa %2d shards    depth=%-3d threads=%-2d %10.0f ops/s\n", shards, clients[0]->depth(), n, rate);
+    }
+
+    // increment with a CAS retry loop, what a naive lock free counter does
+    void cas_counter(int n)
+    {
+        const uint64_t total = (uint64_t)n * o.ops;
+        std::atomic<uint64_t> retries{0};
+        double rate = run(n, total, [&](int id) {
+            atomic_qp &q = *clients[id];
+            const remote_ref word = ref.at(offsetof(remote_area, cas));
+            uint64_t expect = 0, mine = 0;
+            for (int i = 0; i < o.ops; i++)
+            {
+                uint64_t old;
+                while ((old = q.cas(word, expect, expect + 1)) != expect)
+                {
+                    expect = old;
+                    mine++;
+                }
+                expect++;
+            }
+            retries += mine;
+        });
+        CHECK(area->cas == total, "cas counter lost increments");
+        printf("cas retry loop   depth=1   threads=%-2d %10.0f ops/s, %.2f retries/op\n",
+               n, rate, (double)retries / total);
+    }
+
+    void sequence(int n)
+    {
+        const uint64_t total = (uint64_t)n * o.ops;
+        std::vector<std::vector<uint64_t>> ids(n);
+        std::atomic<uint64_t> leases{0};
+        double rate = run(n, total, [&](int id) {
+            sequencer s(*clients[id], ref.at(offsetof(remote_area, seq)), o.lease);
+            ids[id].reserve(o.ops);
+            for (int i = 0; i < o.ops; i++)
+            {
+                ids[id].push_back(s.next());
+            }
+            leases += s.leases();
+        });
+        std::vector<uint64_t> all;
+        for (auto &v : ids)
+        {
+            CHECK(std::is_sorted(v.begin(), v.end()), "ids not increasing per client");
+            all.insert(all.end(), v.begin(), v.end());
+        }
+        std::sort(all.begin(), all.end());
+        CHECK(std::adjacent_find(all.begin(), all.end()) == all.end(), "duplicate ids");
+        printf("sequencer        lease=%-3lu threads=%-2d %10.0f ids/s, %lu faa\n",
+               o.lease, n, rate, (uint64_t)leases);
+    }
+
+    void lock(int n)
+    {
+        const uint64_t total = (uint64_t)n * o.ops / 10;
+        std::atomic<uint64_t> writes{0}, backoffs{0};
+        double rate = run(n, total, [&](int id) {
+            atomic_qp &q = *clients[id];
+            rw_lock l(q, ref.at(offsetof(remote_area, lock)), id + 1);
+            const remote_ref data = ref.at(offsetof(remote_area, data));
+            std::minstd_rand rng(id + 1);
+            uint64_t words[2], mine = 0;
+            for (int i = 0; i < o.ops / 10; i++)
+            {
+                if ((int)(rng() % 100) < o.write_pct)
+                {
+                    l.lock();
+                    q.read16(data, words);
+                    CHECK(words[0] == words[1], "torn data under write lock");
+                    words[0]++;
+                    words[1]++;
+                    q.write16(data, words);
+                    l.unlock();
+                    mine++;
+                }
+                else
+                {
+                    l.lock_shared();
+                    q.read16(data, words);
+                    CHECK(words[0] == words[1], "torn data under read lock");
+                    l.unlock_shared();
+                }
+            }
+            writes += mine;
+            backoffs += l.backoffs();
+        });
+        CHECK(area->data[0] == writes && area->data[1] == writes && area->lock == 0,
+              "rw lock lost updates");
+        printf("rw lock %3d%% wr  depth=1   threads=%-2d %10.0f acq/s, %lu backoffs\n",
+               o.write_pct, n, rate, (uint64_t)backoffs);
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    options o;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:d:l:w:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            o.threads = atoi(optarg);
+            break;
+        case 'n':
+            o.ops = atoi(optarg);
+            break;
+        case 'd':
+            o.depth = atoi(optarg);
+            break;
+        case 'l':
+            o.lease = strtoull(optarg, nullptr, 10);
+            break;
+        case 'w':
+            o.write_pct = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-t threads] [-n ops] [-d depth] [-l lease] [-w write_pct]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(o.threads > 0 && o.ops >= 10 && o.depth > 0 && o.lease > 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_device_attr dev_attr;
+    int ret = ibv_query_device(ctx, &dev_attr);
+    CHECK(ret == 0, "ibv_query_device fail");
+    CHECK(dev_attr.atomic_cap != IBV_ATOMIC_NONE, "device has no atomic support");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    qp_params p;
+    p.max_rd_atomic = std::max(1, std::min(dev_attr.max_qp_init_rd_atom, 255));
+    p.max_dest_rd_atomic = std::max(1, std::min(dev_attr.max_qp_rd_atom, 255));
+    p.lid = port_attr.lid;
+    p.path = probe_path(ctx, PORT_NUM);
+    ret = ibv_query_gid(ctx, PORT_NUM, p.path.gid_index, &p.gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    // outstanding atomics beyond max_rd_atomic only wait in the send queue
+    o.depth = std::min(o.depth, dev_attr.max_qp_wr);
+    printf("device=%s, atomic_cap=%s, max_rd_atomic=%d, max_dest_rd_atomic=%d, depth=%d\n",
+           ibv_get_device_name(devs[0]),
+           dev_attr.atomic_cap == IBV_ATOMIC_HCA ? "hca" : "glob",
+           p.max_rd_atomic, p.max_dest_rd_atomic, o.depth);
+
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    remote_area *area = (remote_area *)aligned_alloc(64, sizeof(remote_area));
+    CHECK(area, "aligned_alloc fail");
+    memset(area, 0, sizeof(*area));
+    struct ibv_mr *area_mr = ibv_reg_mr(pd, area, sizeof(*area),
+                                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+                                            IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC);
+    CHECK(area_mr, "ibv_reg_mr fail");
+
+    // one responder qp per client qp, all on one cq that never gets an entry
+    struct ibv_cq *server_cq = ibv_create_cq(ctx, 1, nullptr, nullptr, 0);
+    CHECK(server_cq, "ibv_create_cq fail");
+    bench b{o, area, {(uint64_t)area, area_mr->rkey}, {}};
+    std::vector<struct ibv_qp *> server_qps;
+    for (int i = 0; i < o.threads; i++)
+    {
+        atomic_qp *c = new atomic_qp(ctx, pd, o.depth);
+        struct ibv_qp *s = create_qp(pd, server_cq, 1);
+        init_qp(c->qp());
+        init_qp(s);
+        modify_to_rtr(c->qp(), p, s->qp_num, 0);
+        modify_to_rtr(s, p, c->qp()->qp_num, 0);
+        modify_to_rts(c->qp(), p, 0);
+        modify_to_rts(s, p, 0);
+        b.clients.push_back(c);
+        server_qps.push_back(s);
+    }
+
+    for (int n = 1; n <= o.threads; n *= 2)
+    {
+        b.faa_hot(n, 1);
+        b.faa_hot(n, o.depth);
+        b.faa_sharded(n);
+        b.cas_counter(n);
+        b.sequence(n);
+        b.lock(n);
+    }
+
+    for (int i = 0; i < o.threads; i++)
+    {
+        delete b.clients[i];
+        ibv_destroy_qp(server_qps[i]);
+    }
+    ibv_destroy_cq(server_cq);
+    ibv_dereg_mr(area_mr);
+    free(area);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
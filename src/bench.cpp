@@ -0,0 +1,601 @@
+/**
+ * perftest style bandwidth/latency benchmark. Every thread connects its own
+ * pair of RC qps back-to-back on the first device (same setup as poll_cq.cpp),
+ * then sweeps message sizes for SEND, RDMA WRITE and RDMA READ.
+ * If you have no RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181
+ * to config Soft-RoCE(RXE), the benchmark runs fine on rxe loopback.
+ *
+ * g++ -O2 bench.cpp -libverbs -lpthread -o bench
+ * ./bench [-o send|write|read|all] [-d depth] [-t threads] [-n iters]
+ *         [-s min_size] [-S max_size] [-g gid_index] [-H]
+ *
+ * -o: operation, default all
+ * -d: outstanding work requests per qp, default 32
+ * -t: number of threads, each with its own cq and qp pair, default 1
+ * -n: iterations per size per thread, default 5000. Large messages are capped
+ *     so that one thread moves at most 1GiB per size
+ * -s/-S: message size range, sizes are powers of 2, default 2B~8MiB
+ * -g: gid index, default the first RoCEv2 gid of the port, 0 on IB
+ * -H: also dump the non-empty latency histogram buckets
+ *
+ * One JSON object per line is written to stdout for every (op, size), e.g.
+ * {"op":"write","size":4096,"threads":1,"depth":32,"iters":5000,
+ *  "msgs_per_sec":...,"gb_per_sec":...,"lat_ns":{"p50":...,"p99":...,"p999":...,"max":...}}
+ * Progress and setup logs go to stderr.
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include <thread>
+
+#define CHECK(c, fmt, ...)                                                 \
+    do                                                                     \
+    {                                                                      \
+        if (!(c))                                                          \
+        {                                                                  \
+            fprintf(stderr, "%s:%d, %s, errno=%d, %s\n", __FILE__,         \
+                    __LINE__, fmt, ##__VA_ARGS__, errno, strerror(errno)); \
+            exit(-1);                                                      \
+        }                                                                  \
+    } while (0)
+
+#define PORT_NUM 1
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Log-linear latency histogram, HDR style: values are grouped by their
+ * highest set bit, and every power of 2 is split into SUB_BUCKETS linear
+ * sub buckets, so the relative error is below 1/SUB_BUCKETS.
+ */
+struct histogram
+{
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    histogram() : counts(BUCKETS, 0) {}
+
+    static int index(uint64_t v)
+    {
+        if (v < SUB_BUCKETS)
+        {
+            return v;
+        }
+        int msb = 63 - __builtin_clzll(v);
+        int sub = (v >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+    // the largest value falls into bucket i
+    static uint64_t upper(int i)
+    {
+        if (i < SUB_BUCKETS)
+        {
+            return i;
+        }
+        int msb = i / SUB_BUCKETS + SUB_BITS - 1;
+        uint64_t sub = i % SUB_BUCKETS;
+        uint64_t low = (1ull << msb) | (sub << (msb - SUB_BITS));
+        return low + (1ull << (msb - SUB_BITS)) - 1;
+    }
+    void add(uint64_t v)
+    {
+        counts[index(v)]++;
+        total++;
+        max = std::max(max, v);
+    }
+    void merge(const histogram &o)
+    {
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            counts[i] += o.counts[i];
+        }
+        total += o.total;
+        max = std::max(max, o.max);
+    }
+    uint64_t percentile(double p) const
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(p / 100.0 * total);
+        if (rank >= total)
+        {
+            rank = total - 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++)
+        {
+            seen += counts[i];
+            if (seen > rank)
+            {
+                return std::min(upper(i), max);
+            }
+        }
+        return max;
+    }
+};
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int io_depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    // twice the send depth, the receiver reposts only after it reaps the wc
+    init_attr.cap.max_recv_wr = io_depth * 2;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid,
+                   union ibv_gid gid, int rd_atomic)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = rd_atomic;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn, int rd_atomic)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = rd_atomic;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+enum bench_op
+{
+    OP_SEND,
+    OP_WRITE,
+    OP_READ,
+};
+const char *op_to_str(bench_op op)
+{
+    switch (op)
+    {
+    case OP_SEND:
+        return "send";
+    case OP_WRITE:
+        return "write";
+    case OP_READ:
+        return "read";
+    default:
+        return "unknown";
+    }
+}
+
+struct config
+{
+    std::vector<bench_op> ops;
+    int depth = 32;
+    int threads = 1;
+    int iters = 5000;
+    uint64_t min_size = 2;
+    uint64_t max_size = 8 * 1024 * 1024;
+    int gid_index = -1; // -1 picks it from the port
+    bool dump_hist = false;
+};
+
+struct device
+{
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    union ibv_gid gid;
+    struct ibv_port_attr port_attr;
+    struct ibv_device_attr dev_attr;
+    port_path path;
+};
+
+// one thread: a cq, a sender qp, a receiver qp and their buffers
+struct worker
+{
+    struct ibv_cq *cq;
+    struct ibv_qp *sqp; // posts SEND/WRITE/READ
+    struct ibv_qp *rqp; // target of the operations
+    char *local_buf;
+    char *remote_buf;
+    struct ibv_mr *local_mr;
+    struct ibv_mr *remote_mr;
+    std::vector<uint64_t> post_ts;
+    std::vector<struct ibv_wc> wcs;
+    // result of the last run
+    histogram hist;
+    uint64_t elapsed_ns;
+    uint64_t msgs;
+};
+
+void worker_setup(worker &w, device &dev, const config &cfg)
+{
+    // reads in flight: as requester bounded by max_qp_init_rd_atom, as responder by max_qp_rd_atom
+    const int init_rd_atomic = std::max(1, std::min(cfg.depth, dev.dev_attr.max_qp_init_rd_atom));
+    const int dest_rd_atomic = std::max(1, std::min(cfg.depth, dev.dev_attr.max_qp_rd_atom));
+    w.cq = ibv_create_cq(dev.ctx, cfg.depth * 4, nullptr, nullptr, 0);
+    CHECK(w.cq, "ibv_create_cq fail");
+    w.sqp = create_qp(dev.pd, w.cq, cfg.depth);
+    w.rqp = create_qp(dev.pd, w.cq, cfg.depth);
+    init_qp(w.sqp);
+    init_qp(w.rqp);
+    const uint32_t psn = 0;
+    modify_to_rtr(w.sqp, dev.path, w.rqp->qp_num, psn, dev.port_attr.lid, dev.gid, dest_rd_atomic);
+    modify_to_rtr(w.rqp, dev.path, w.sqp->qp_num, psn, dev.port_attr.lid, dev.gid, dest_rd_atomic);
+    modify_to_rts(w.sqp, psn, init_rd_atomic);
+    modify_to_rts(w.rqp, psn, init_rd_atomic);
+
+    const int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+    w.local_buf = (char *)aligned_alloc(4096, cfg.max_size);
+    CHECK(w.local_buf, "aligned_alloc fail");
+    w.remote_buf = (char *)aligned_alloc(4096, cfg.max_size);
+    CHECK(w.remote_buf, "aligned_alloc fail");
+    memset(w.local_buf, 'a', cfg.max_size);
+    memset(w.remote_buf, 'b', cfg.max_size);
+    w.local_mr = ibv_reg_mr(dev.pd, w.local_buf, cfg.max_size, access);
+    CHECK(w.local_mr, "ibv_reg_mr fail");
+    w.remote_mr = ibv_reg_mr(dev.pd, w.remote_buf, cfg.max_size, access);
+    CHECK(w.remote_mr, "ibv_reg_mr fail");
+    w.post_ts.resize(cfg.depth);
+    w.wcs.resize(cfg.depth * 2);
+}
+
+void post_recv(worker &w, uint64_t size)
+{
+    struct ibv_sge sge;
+    sge.addr = (uint64_t)w.remote_buf;
+    sge.length = size;
+    sge.lkey = w.remote_mr->lkey;
+    struct ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = 0;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    struct ibv_recv_wr *bad_wr = nullptr;
+    int ret = ibv_post_recv(w.rqp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_recv fail");
+}
+
+void post_one(worker &w, bench_op op, uint64_t size, uint64_t seq)
+{
+    struct ibv_sge sge;
+    sge.addr = (uint64_t)w.local_buf;
+    sge.length = size;
+    sge.lkey = w.local_mr->lkey;
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = seq;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    if (op == OP_SEND)
+    {
+        wr.opcode = IBV_WR_SEND;
+    }
+    else
+    {
+        wr.opcode = op == OP_WRITE ? IBV_WR_RDMA_WRITE : IBV_WR_RDMA_READ;
+        wr.wr.rdma.remote_addr = (uint64_t)w.remote_buf;
+        wr.wr.rdma.rkey = w.remote_mr->rkey;
+    }
+    struct ibv_send_wr *bad_wr = nullptr;
+    int ret = ibv_post_send(w.sqp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_send fail");
+}
+
+/**
+ * Keep `depth` work requests in flight until `iters` of them complete.
+ * RC completes the send queue in order, so the post timestamp of a wr is
+ * found by wr_id % depth. Receive completions are reposted right away.
+ */
+void worker_run(worker &w, const config &cfg, bench_op op, uint64_t size, int iters)
+{
+    w.hist = histogram();
+    uint64_t posted = 0, completed = 0;
+    int outstanding = 0;
+    const uint64_t start = now_ns();
+    while (completed < (uint64_t)iters)
+    {
+        while (outstanding < cfg.depth && posted < (uint64_t)iters)
+        {
+            w.post_ts[posted % cfg.depth] = now_ns();
+            post_one(w, op, size, posted);
+            posted++;
+            outstanding++;
+        }
+        int n = ibv_poll_cq(w.cq, w.wcs.size(), w.wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        const uint64_t now = now_ns();
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = w.wcs[i];
+            if (wc.status != IBV_WC_SUCCESS)
+            {
+                fprintf(stderr, "bad wc, status=%s, wr_id=%lu\n", ibv_wc_status_str(wc.status), wc.wr_id);
+            }
+            CHECK(wc.status == IBV_WC_SUCCESS, "bad wc");
+            if (wc.opcode == IBV_WC_RECV)
+            {
+                post_recv(w, cfg.max_size);
+                continue;
+            }
+            w.hist.add(now - w.post_ts[wc.wr_id % cfg.depth]);
+            completed++;
+            outstanding--;
+        }
+    }
+    w.elapsed_ns = now_ns() - start;
+    w.msgs = completed;
+}
+
+void print_result(const config &cfg, bench_op op, uint64_t size, int iters,
+                  std::vector<worker> &workers)
+{
+    histogram hist;
+    uint64_t msgs = 0, elapsed = 0;
+    for (auto &w : workers)
+    {
+        hist.merge(w.hist);
+        msgs += w.msgs;
+        elapsed = std::max(elapsed, w.elapsed_ns);
+    }
+    const double secs = elapsed / 1e9;
+    printf("{\"op\":\"%s\",\"size\":%lu,\"threads\":%d,\"depth\":%d,\"iters\":%d,"
+           "\"msgs_per_sec\":%.1f,\"gb_per_sec\":%.4f,"
+           "\"lat_ns\":{\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}",
+           op_to_str(op), size, cfg.threads, cfg.depth, iters,
+           msgs / secs, msgs * size / secs / 1e9,
+           hist.percentile(50), hist.percentile(99), hist.percentile(99.9), hist.max);
+    if (cfg.dump_hist)
+    {
+        printf(",\"hist\":[");
+        bool first = true;
+        for (int i = 0; i < histogram::BUCKETS; i++)
+        {
+            if (hist.counts[i] == 0)
+            {
+                continue;
+            }
+            printf("%s[%lu,%lu]", first ? "" : ",", histogram::upper(i), hist.counts[i]);
+            first = false;
+        }
+        printf("]");
+    }
+    printf("}\n");
+    fflush(stdout);
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-o send|write|read|all] [-d depth] [-t threads] [-n iters] "
+                    "[-s min_size] [-S max_size] [-g gid_index] [-H]\n",
+            prog);
+    exit(-1);
+}
+
+int main(int argc, char *argv[])
+{
+    config cfg;
+    const char *ops = "all";
+    int opt;
+    while ((opt = getopt(argc, argv, "o:d:t:n:s:S:g:H")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            ops = optarg;
+            break;
+        case 'd':
+            cfg.depth = atoi(optarg);
+            break;
+        case 't':
+            cfg.threads = atoi(optarg);
+            break;
+        case 'n':
+            cfg.iters = atoi(optarg);
+            break;
+        case 's':
+            cfg.min_size = strtoull(optarg, nullptr, 10);
+            break;
+        case 'S':
+            cfg.max_size = strtoull(optarg, nullptr, 10);
+            break;
+        case 'g':
+            cfg.gid_index = atoi(optarg);
+            break;
+        case 'H':
+            cfg.dump_hist = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (strcmp(ops, "send") == 0 || strcmp(ops, "all") == 0)
+    {
+        cfg.ops.push_back(OP_SEND);
+    }
+    if (strcmp(ops, "write") == 0 || strcmp(ops, "all") == 0)
+    {
+        cfg.ops.push_back(OP_WRITE);
+    }
+    if (strcmp(ops, "read") == 0 || strcmp(ops, "all") == 0)
+    {
+        cfg.ops.push_back(OP_READ);
+    }
+    if (cfg.ops.empty() || cfg.depth <= 0 || cfg.threads <= 0 || cfg.iters <= 0 ||
+        cfg.min_size == 0 || cfg.min_size > cfg.max_size)
+    {
+        usage(argv[0]);
+    }
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    device dev;
+    dev.ctx = ibv_open_device(devs[0]);
+    CHECK(dev.ctx, "ibv_open_device fail");
+    dev.pd = ibv_alloc_pd(dev.ctx);
+    CHECK(dev.pd, "ibv_alloc_pd fail");
+    dev.path = probe_path(dev.ctx, PORT_NUM);
+    if (cfg.gid_index >= 0)
+    {
+        dev.path.gid_index = cfg.gid_index;
+    }
+    int ret = ibv_query_gid(dev.ctx, PORT_NUM, dev.path.gid_index, &dev.gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    ret = ibv_query_port(dev.ctx, PORT_NUM, &dev.port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    ret = ibv_query_device(dev.ctx, &dev.dev_attr);
+    CHECK(ret == 0, "ibv_query_device fail");
+    CHECK(cfg.depth <= dev.dev_attr.max_qp_wr, "depth exceeds max_qp_wr");
+    fprintf(stderr, "device=%s, gid_index=%d, active_mtu=%d, max_qp_init_rd_atom=%d, max_qp_rd_atom=%d, threads=%d, depth=%d\n",
+            ibv_get_device_name(devs[0]), dev.path.gid_index, 128 << dev.path.mtu,
+            dev.dev_attr.max_qp_init_rd_atom, dev.dev_attr.max_qp_rd_atom, cfg.threads, cfg.depth);
+
+    std::vector<worker> workers(cfg.threads);
+    for (auto &w : workers)
+    {
+        worker_setup(w, dev, cfg);
+        for (int i = 0; i < cfg.depth * 2; i++)
+        {
+            post_recv(w, cfg.max_size);
+        }
+    }
+
+    for (bench_op op : cfg.ops)
+    {
+        for (uint64_t size = cfg.min_size; size <= cfg.max_size; size *= 2)
+        {
+            // about 1GB per size keeps large sizes short, but never below 100 iters or above -n
+            const uint64_t cap = std::max<uint64_t>(100, (1ull << 30) / size);
+            const int iters = std::min<uint64_t>(cfg.iters, cap);
+            fprintf(stderr, "running op=%s, size=%lu, iters=%d\n", op_to_str(op), size, iters);
+            pthread_barrier_t barrier;
+            pthread_barrier_init(&barrier, nullptr, cfg.threads);
+            std::vector<std::thread> threads;
+            for (auto &w : workers)
+            {
+                threads.emplace_back([&, op, size, iters]() {
+                    pthread_barrier_wait(&barrier);
+                    worker_run(w, cfg, op, size, iters);
+                });
+            }
+            for (auto &t : threads)
+            {
+                t.join();
+            }
+            pthread_barrier_destroy(&barrier);
+            print_result(cfg, op, size, iters, workers);
+        }
+    }
+
+    for (auto &w : workers)
+    {
+        ibv_destroy_qp(w.sqp);
+        ibv_destroy_qp(w.rqp);
+        ibv_destroy_cq(w.cq);
+        ibv_dereg_mr(w.local_mr);
+        ibv_dereg_mr(w.remote_mr);
+        free(w.local_buf);
+        free(w.remote_buf);
+    }
+    ibv_dealloc_pd(dev.pd);
+    ibv_close_device(dev.ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,631 @@
+/**
+ * Example of a TCP out-of-band connection manager. If you have no RDMA
+ * hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE), both sides can run on localhost.
+ *
+ * modify_qp_simple.cpp exchanges meta by copying strings through the
+ * console. Here the metas of all qps are exchanged in a compact binary
+ * format over a TCP connection, and hundreds of qps are brought up
+ * create -> INIT -> RTR -> RTS by a group of threads without any
+ * interactive step. Time spent in every phase is measured per qp.
+ *
+ * g++ -O2 conn_mgr.cpp -libverbs -lpthread -o conn_mgr
+ *
+ * server:
+ * ./conn_mgr -s [-p port]
+ *
+ * client:
+ * ./conn_mgr -c 127.0.0.1 [-p port] [-n qps] [-j threads] [-m]
+ *
+ * -n: number of qps to the peer, default 256
+ * -j: threads bringing up qps, default 8
+ * -m: also register a buffer and exchange its addr/rkey
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <endian.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <vector>
+#include <thread>
+
+#define IB_PORT_NUM 1
+#define META_MAGIC 0x52434d31 // "RCM1"
+#define MAX_QPS 16384          // per connection, bounds what a peer can ask for
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 建联过程需要交换的信息，按网络字节序在TCP上传输
+struct __attribute__((packed)) wire_meta
+{
+    uint32_t qpn;
+    uint32_t psn;
+    uint16_t lid; // 主要用于ib，RoCE v2中该字段始终为0
+    uint8_t gid[16];
+    uint8_t mtu; // active mtu of the sender port
+    uint8_t has_mr;
+    uint64_t addr; // valid if has_mr
+    uint32_t rkey; // valid if has_mr
+};
+
+// sent once by each side before the metas
+struct __attribute__((packed)) wire_hdr
+{
+    uint32_t magic;
+    uint32_t num_qps;
+};
+
+struct meta
+{
+    uint32_t qpn;
+    uint32_t psn;
+    uint16_t lid;
+    union ibv_gid gid;
+    enum ibv_mtu mtu;
+    bool has_mr;
+    uint64_t addr;
+    uint32_t rkey;
+
+    wire_meta encode() const
+    {
+        wire_meta w;
+        w.qpn = htobe32(qpn);
+        w.psn = htobe32(psn);
+        w.lid = htobe16(lid);
+        memcpy(w.gid, gid.raw, sizeof(w.gid));
+        w.mtu = mtu;
+        w.has_mr = has_mr;
+        w.addr = htobe64(has_mr ? addr : 0);
+        w.rkey = htobe32(has_mr ? rkey : 0);
+        return w;
+    }
+    static meta decode(const wire_meta &w)
+    {
+        meta m;
+        m.qpn = be32toh(w.qpn);
+        m.psn = be32toh(w.psn);
+        m.lid = be16toh(w.lid);
+        memcpy(m.gid.raw, w.gid, sizeof(w.gid));
+        m.mtu = (enum ibv_mtu)w.mtu;
+        m.has_mr = w.has_mr;
+        m.addr = be64toh(w.addr);
+        m.rkey = be32toh(w.rkey);
+        return m;
+    }
+};
+
+bool write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        // a peer that hung up must not raise SIGPIPE
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+bool read_full(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    const int io_depth = 32;
+    const int max_sge = 30;
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    init_attr.cap.max_recv_wr = io_depth;
+    init_attr.cap.max_send_sge = max_sge;
+    init_attr.cap.max_recv_sge = max_sge;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = IB_PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid r_gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = r_gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = IB_PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+struct rdma_dev
+{
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    union ibv_gid gid;
+    struct ibv_port_attr port_attr;
+    port_path path;
+};
+
+// one side of a connection to a peer: n qps sharing one cq
+struct peer_conn
+{
+    struct ibv_cq *cq = nullptr;
+    std::vector<struct ibv_qp *> qps;
+    std::vector<meta> local;
+    std::vector<meta> remote;
+    char *buf = nullptr;
+    struct ibv_mr *mr = nullptr;
+    // per qp phase cost in ns
+    std::vector<uint64_t> t_create, t_init, t_rtr, t_rts;
+};
+
+// run fn(i) for i in [0, n) on `threads` threads
+template <typename F>
+void parallel_for(int n, int threads, F fn)
+{
+    std::vector<std::thread> ts;
+    for (int t = 0; t < threads; t++)
+    {
+        ts.emplace_back([=, &fn]() {
+            for (int i = t; i < n; i += threads)
+            {
+                fn(i);
+            }
+        });
+    }
+    for (auto &t : ts)
+    {
+        t.join();
+    }
+}
+
+// create the qps, move them to INIT and fill in the local metas
+void conn_prepare(peer_conn &c, rdma_dev &dev, int n, int threads, bool with_mr)
+{
+    c.cq = ibv_create_cq(dev.ctx, std::min(n * 64, 65536), nullptr, nullptr, 0);
+    CHECK(c.cq, "ibv_create_cq fail");
+    c.qps.resize(n);
+    c.local.resize(n);
+    c.t_create.resize(n);
+    c.t_init.resize(n);
+    c.t_rtr.resize(n);
+    c.t_rts.resize(n);
+    if (with_mr)
+    {
+        const size_t size = 1024 * 1024;
+        c.buf = (char *)malloc(size);
+        CHECK(c.buf, "malloc fail");
+        c.mr = ibv_reg_mr(dev.pd, c.buf, size,
+                          IBV_ACCESS_LOCAL_WRITE |
+                              IBV_ACCESS_REMOTE_WRITE |
+                              IBV_ACCESS_REMOTE_READ);
+        CHECK(c.mr, "ibv_reg_mr fail");
+    }
+    const uint32_t base_psn = lrand48();
+    parallel_for(n, threads, [&](int i) {
+        uint64_t t0 = now_ns();
+        c.qps[i] = create_qp(dev.pd, c.cq);
+        uint64_t t1 = now_ns();
+        init_qp(c.qps[i]);
+        uint64_t t2 = now_ns();
+        c.t_create[i] = t1 - t0;
+        c.t_init[i] = t2 - t1;
+
+        meta &m = c.local[i];
+        m.qpn = c.qps[i]->qp_num;
+        m.psn = (base_psn + i * 2654435761u) & 0xffffff;
+        m.lid = dev.port_attr.lid;
+        m.gid = dev.gid;
+        m.mtu = dev.path.mtu;
+        m.has_mr = c.mr != nullptr;
+        m.addr = c.mr ? (uint64_t)c.buf : 0;
+        m.rkey = c.mr ? c.mr->rkey : 0;
+    });
+}
+
+// RTR/RTS with the peer metas
+void conn_establish(peer_conn &c, rdma_dev &dev, int threads)
+{
+    parallel_for(c.qps.size(), threads, [&](int i) {
+        const meta &r = c.remote[i];
+        // the path mtu must fit both ports
+        port_path p = dev.path;
+        p.mtu = std::min(p.mtu, r.mtu);
+        uint64_t t0 = now_ns();
+        modify_to_rtr(c.qps[i], p, r.qpn, r.psn, r.lid, r.gid);
+        uint64_t t1 = now_ns();
+        modify_to_rts(c.qps[i], c.local[i].psn);
+        uint64_t t2 = now_ns();
+        c.t_rtr[i] = t1 - t0;
+        c.t_rts[i] = t2 - t1;
+    });
+}
+
+void conn_destroy(peer_conn &c)
+{
+    for (auto qp : c.qps)
+    {
+        ibv_destroy_qp(qp);
+    }
+    ibv_destroy_cq(c.cq);
+    if (c.mr)
+    {
+        ibv_dereg_mr(c.mr);
+        free(c.buf);
+    }
+}
+
+bool send_metas(int fd, const std::vector<meta> &metas)
+{
+    wire_hdr hdr;
+    hdr.magic = htobe32(META_MAGIC);
+    hdr.num_qps = htobe32(metas.size());
+    std::vector<wire_meta> w;
+    for (auto &m : metas)
+    {
+        w.push_back(m.encode());
+    }
+    return write_full(fd, &hdr, sizeof(hdr)) &&
+           write_full(fd, w.data(), w.size() * sizeof(wire_meta));
+}
+bool recv_metas(int fd, std::vector<meta> &metas)
+{
+    wire_hdr hdr;
+    if (!read_full(fd, &hdr, sizeof(hdr)) || be32toh(hdr.magic) != META_MAGIC)
+    {
+        return false;
+    }
+    // the count comes from the peer, never size anything by it unchecked
+    const uint32_t num_qps = be32toh(hdr.num_qps);
+    if (num_qps == 0 || num_qps > MAX_QPS)
+    {
+        printf("peer announced %u qps, expect 1..%d\n", num_qps, MAX_QPS);
+        return false;
+    }
+    std::vector<wire_meta> w(num_qps);
+    if (!read_full(fd, w.data(), w.size() * sizeof(wire_meta)))
+    {
+        return false;
+    }
+    metas.clear();
+    for (auto &x : w)
+    {
+        metas.push_back(meta::decode(x));
+    }
+    return true;
+}
+
+void print_phase(const char *name, std::vector<uint64_t> v)
+{
+    std::sort(v.begin(), v.end());
+    uint64_t sum = 0;
+    for (auto x : v)
+    {
+        sum += x;
+    }
+    printf("  %-7s avg=%8.1fus p50=%8.1fus p99=%8.1fus max=%8.1fus\n", name,
+           sum / 1e3 / v.size(), v[v.size() / 2] / 1e3,
+           v[v.size() * 99 / 100] / 1e3, v.back() / 1e3);
+}
+
+void print_report(peer_conn &c, uint64_t wall_ns, uint64_t exchange_ns)
+{
+    const int n = c.qps.size();
+    std::vector<uint64_t> total(n);
+    for (int i = 0; i < n; i++)
+    {
+        total[i] = c.t_create[i] + c.t_init[i] + c.t_rtr[i] + c.t_rts[i];
+    }
+    printf("%d qps established, wall=%.2fms, meta exchange=%.2fms, %.0f qps/s\n",
+           n, wall_ns / 1e6, exchange_ns / 1e6, n / (wall_ns / 1e9));
+    print_phase("create", c.t_create);
+    print_phase("init", c.t_init);
+    print_phase("rtr", c.t_rtr);
+    print_phase("rts", c.t_rts);
+    print_phase("total", total);
+    if (c.remote[0].has_mr)
+    {
+        printf("  peer mr: addr=0x%lx, rkey=%u\n", c.remote[0].addr, c.remote[0].rkey);
+    }
+}
+
+void serve_client(int fd, rdma_dev &dev, int threads, bool with_mr)
+{
+    peer_conn c;
+    uint64_t start = now_ns();
+    // the client speaks first, its meta count decides how many qps we create
+    if (!recv_metas(fd, c.remote))
+    {
+        printf("bad client meta\n");
+        close(fd);
+        return;
+    }
+    conn_prepare(c, dev, c.remote.size(), threads, with_mr);
+    // from here on a client that goes away only costs its own qps
+    char ready = 1;
+    if (!send_metas(fd, c.local))
+    {
+        printf("send metas to client fail, errno=%d\n", errno);
+        close(fd);
+        conn_destroy(c);
+        return;
+    }
+    conn_establish(c, dev, threads);
+    // barrier: both sides are RTS
+    if (!write_full(fd, &ready, 1) || !read_full(fd, &ready, 1))
+    {
+        printf("client left before the barrier, errno=%d\n", errno);
+        close(fd);
+        conn_destroy(c);
+        return;
+    }
+    print_report(c, now_ns() - start, 0);
+
+    // keep the qps until the client hangs up
+    while (read(fd, &ready, 1) > 0)
+    {
+    }
+    close(fd);
+    conn_destroy(c);
+    printf("client gone, %zu qps destroyed\n", c.qps.size());
+}
+
+void run_server(rdma_dev &dev, int port, int threads, bool with_mr)
+{
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(lfd >= 0, "socket fail");
+    int on = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    CHECK(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "bind fail");
+    CHECK(listen(lfd, 128) == 0, "listen fail");
+    printf("listening on port %d\n", port);
+    while (1)
+    {
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        std::thread(serve_client, fd, std::ref(dev), threads, with_mr).detach();
+    }
+}
+
+void run_client(rdma_dev &dev, const char *host, int port, int n, int threads, bool with_mr)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    CHECK(getaddrinfo(host, port_str, &hints, &res) == 0, "getaddrinfo fail");
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    CHECK(fd >= 0, "socket fail");
+    CHECK(connect(fd, res->ai_addr, res->ai_addrlen) == 0, "connect fail");
+    freeaddrinfo(res);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    peer_conn c;
+    uint64_t start = now_ns();
+    conn_prepare(c, dev, n, threads, with_mr);
+    uint64_t t_exchange = now_ns();
+    CHECK(send_metas(fd, c.local), "send metas fail");
+    CHECK(recv_metas(fd, c.remote), "recv metas fail");
+    CHECK(c.remote.size() == c.local.size(), "peer qp count mismatch");
+    t_exchange = now_ns() - t_exchange;
+    conn_establish(c, dev, threads);
+    char ready = 1;
+    CHECK(write_full(fd, &ready, 1) && read_full(fd, &ready, 1), "barrier fail");
+    print_report(c, now_ns() - start, t_exchange);
+
+    close(fd);
+    conn_destroy(c);
+}
+
+int main(int argc, char *argv[])
+{
+    bool server = false;
+    const char *host = nullptr;
+    int port = 18515;
+    int n = 256;
+    int threads = 8;
+    bool with_mr = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "sc:p:n:j:m")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            server = true;
+            break;
+        case 'c':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'm':
+            with_mr = true;
+            break;
+        default:
+            printf("usage: %s -s | -c host [-p port] [-n qps] [-j threads] [-m]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(server || host, "either -s or -c host is required");
+    CHECK(n > 0 && n <= MAX_QPS && threads > 0, "invalid -n or -j");
+    srand48(getpid() ^ time(nullptr));
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    rdma_dev dev;
+    dev.ctx = ibv_open_device(devs[0]);
+    CHECK(dev.ctx, "ibv_open_device fail");
+    dev.pd = ibv_alloc_pd(dev.ctx);
+    CHECK(dev.pd, "ibv_alloc_pd fail");
+    dev.path = probe_path(dev.ctx, IB_PORT_NUM);
+    int ret = ibv_query_gid(dev.ctx, IB_PORT_NUM, dev.path.gid_index, &dev.gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    ret = ibv_query_port(dev.ctx, IB_PORT_NUM, &dev.port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    if (server)
+    {
+        run_server(dev, port, threads, with_mr);
+    }
+    else
+    {
+        run_client(dev, host, port, n, threads, with_mr);
+    }
+
+    ibv_dealloc_pd(dev.pd);
+    ibv_close_device(dev.ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,587 @@
+/**
+ * Example of a C++20 coroutine API over verbs. If you have no RDMA hardware, see
+ * https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * Every operation is an awaitable `op` that is posted when it is created,
+ * its address is the wr_id. The cq poller turns the wc back into the op,
+ * stores status and byte_len and resumes the coroutine waiting on it, so the
+ * code handling a completion sits right after the code posting the wr:
+ *
+ *     ibv_wc_status s = co_await qp.send(buf, len);
+ *
+ *     auto resp = qp.recv(resp_buf, len); // posted now
+ *     co_await qp.send(req_buf, len);
+ *     co_await resp;                      // may have completed already
+ *
+ * Coroutine frames come from a per-thread pool of fixed size blocks, after
+ * warm up no operation allocates. The demo runs `-c` client coroutines doing
+ * echo requests over a loopback pair, all driven by one thread polling one cq.
+ *
+ * g++ -O2 -std=c++20 coro.cpp -libverbs -o coro
+ * ./coro [-c coroutines] [-n requests per coroutine] [-s size]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <coroutine>
+#include <exception>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define FRAME_BLOCK 1024
+#define FRAMES_PER_CHUNK 64
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = depth;
+    init_attr.cap.max_recv_wr = depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+/**
+ * Fixed size blocks for coroutine frames, one pool per thread since a
+ * coroutine is created and destroyed on the thread polling its cq. Frames
+ * larger than a block go to the heap and are counted.
+ */
+class frame_pool
+{
+public:
+    static frame_pool &local()
+    {
+        static thread_local frame_pool pool;
+        return pool;
+    }
+
+    void *alloc(size_t n)
+    {
+        if (n > FRAME_BLOCK)
+        {
+            oversize_++;
+            return ::operator new(n);
+        }
+        if (!free_)
+        {
+            grow();
+        }
+        block *b = free_;
+        free_ = b->next;
+        frames_++;
+        return b;
+    }
+    void free(void *p, size_t n)
+    {
+        if (n > FRAME_BLOCK)
+        {
+            ::operator delete(p);
+            return;
+        }
+        block *b = (block *)p;
+        b->next = free_;
+        free_ = b;
+    }
+
+    uint64_t frames() const { return frames_; }
+    uint64_t chunks() const { return chunks_.size(); }
+    uint64_t oversize() const { return oversize_; }
+
+    ~frame_pool()
+    {
+        for (char *c : chunks_)
+        {
+            ::operator delete(c);
+        }
+    }
+
+private:
+    struct block
+    {
+        block *next;
+    };
+
+    void grow()
+    {
+        char *c = (char *)::operator new((size_t)FRAME_BLOCK * FRAMES_PER_CHUNK);
+        chunks_.push_back(c);
+        for (int i = 0; i < FRAMES_PER_CHUNK; i++)
+        {
+            block *b = (block *)(c + (size_t)i * FRAME_BLOCK);
+            b->next = free_;
+            free_ = b;
+        }
+    }
+
+    block *free_ = nullptr;
+    std::vector<char *> chunks_;
+    uint64_t frames_ = 0;
+    uint64_t oversize_ = 0;
+};
+
+// a detached coroutine, it runs until its first co_await and frees itself at the end
+struct task
+{
+    struct promise_type
+    {
+        task get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        static void *operator new(size_t n) { return frame_pool::local().alloc(n); }
+        static void operator delete(void *p, size_t n) { frame_pool::local().free(p, n); }
+    };
+};
+
+/**
+ * One posted work request. It must not move once posted, copy and move are
+ * deleted and the factories in coro_qp return it as a prvalue, so it's built
+ * in place in the awaiting coroutine's frame.
+ */
+class op
+{
+public:
+    op(const op &) = delete;
+    op &operator=(const op &) = delete;
+
+    bool await_ready() const noexcept { return done_; }
+    void await_suspend(std::coroutine_handle<> h) noexcept { waiter_ = h; }
+    ibv_wc_status await_resume() const noexcept { return status_; }
+
+    uint32_t byte_len() const { return byte_len_; }
+
+    // called by the poller
+    static void complete(const struct ibv_wc &wc)
+    {
+        op *o = (op *)wc.wr_id;
+        o->status_ = wc.status;
+        o->byte_len_ = wc.byte_len;
+        o->done_ = true;
+        if (o->waiter_)
+        {
+            o->waiter_.resume();
+        }
+    }
+
+private:
+    friend class coro_qp;
+
+    op(struct ibv_qp *qp, struct ibv_send_wr &wr)
+    {
+        wr.wr_id = (uint64_t)this;
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+    }
+    op(struct ibv_qp *qp, struct ibv_recv_wr &wr)
+    {
+        wr.wr_id = (uint64_t)this;
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_recv(qp, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+    }
+
+    std::coroutine_handle<> waiter_;
+    ibv_wc_status status_ = IBV_WC_SUCCESS;
+    uint32_t byte_len_ = 0;
+    bool done_ = false;
+};
+
+struct remote_buf
+{
+    uint64_t addr;
+    uint32_t rkey;
+};
+
+class coro_qp
+{
+public:
+    coro_qp(struct ibv_qp *qp, struct ibv_mr *mr) : qp_(qp), mr_(mr) {}
+
+    struct ibv_qp *qp() { return qp_; }
+
+    op send(void *buf, uint32_t len)
+    {
+        struct ibv_sge sge = {(uint64_t)buf, len, mr_->lkey};
+        struct ibv_send_wr wr = make_wr(&sge, len);
+        wr.opcode = IBV_WR_SEND;
+        return op(qp_, wr);
+    }
+    op recv(void *buf, uint32_t len)
+    {
+        struct ibv_sge sge = {(uint64_t)buf, len, mr_->lkey};
+        struct ibv_recv_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        return op(qp_, wr);
+    }
+    op read(remote_buf remote, void *local, uint32_t len)
+    {
+        struct ibv_sge sge = {(uint64_t)local, len, mr_->lkey};
+        struct ibv_send_wr wr = make_wr(&sge, len);
+        wr.opcode = IBV_WR_RDMA_READ;
+        wr.wr.rdma.remote_addr = remote.addr;
+        wr.wr.rdma.rkey = remote.rkey;
+        return op(qp_, wr);
+    }
+    op write(remote_buf remote, void *local, uint32_t len)
+    {
+        struct ibv_sge sge = {(uint64_t)local, len, mr_->lkey};
+        struct ibv_send_wr wr = make_wr(&sge, len);
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        wr.wr.rdma.remote_addr = remote.addr;
+        wr.wr.rdma.rkey = remote.rkey;
+        return op(qp_, wr);
+    }
+
+private:
+    static struct ibv_send_wr make_wr(struct ibv_sge *sge, uint32_t len)
+    {
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.sg_list = len ? sge : nullptr;
+        wr.num_sge = len ? 1 : 0;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        return wr;
+    }
+
+    struct ibv_qp *qp_;
+    struct ibv_mr *mr_;
+};
+
+// poll one cq and resume whoever waits on each completion, returns completions handled
+int poll_and_resume(struct ibv_cq *cq)
+{
+    struct ibv_wc wcs[32];
+    int n = ibv_poll_cq(cq, 32, wcs);
+    CHECK(n >= 0, "ibv_poll_cq fail");
+    for (int i = 0; i < n; i++)
+    {
+        op::complete(wcs[i]);
+    }
+    return n;
+}
+
+struct stats
+{
+    int live = 0;
+    uint64_t requests = 0;
+    uint64_t errors = 0;
+    std::vector<uint64_t> lat;
+};
+
+// echo every message back, exits on a zero length message
+task serve(coro_qp &qp, char *buf, uint32_t size, uint64_t *served, stats &st)
+{
+    st.live++;
+    while (true)
+    {
+        op r = qp.recv(buf, size);
+        if (co_await r != IBV_WC_SUCCESS)
+        {
+            st.errors++;
+            break;
+        }
+        if (r.byte_len() == 0)
+        {
+            break;
+        }
+        (*served)++;
+        if (co_await qp.send(buf, r.byte_len()) != IBV_WC_SUCCESS)
+        {
+            st.errors++;
+            break;
+        }
+    }
+    st.live--;
+}
+
+task client(coro_qp &qp, int id, char *req, char *resp, uint32_t size, int n, stats &st)
+{
+    st.live++;
+    for (int i = 0; i < n; i++)
+    {
+        snprintf(req, size, "coroutine %d request %d", id, i);
+        const uint64_t start = now_ns();
+        // the response buffer is posted before the request goes out
+        op r = qp.recv(resp, size);
+        ibv_wc_status s = co_await qp.send(req, size);
+        if (s == IBV_WC_SUCCESS)
+        {
+            s = co_await r;
+        }
+        else
+        {
+            // a failed send moves the qp to error, r gets flushed
+            co_await r;
+        }
+        if (s != IBV_WC_SUCCESS || memcmp(req, resp, size) != 0)
+        {
+            st.errors++;
+            break;
+        }
+        st.lat.push_back(now_ns() - start);
+        st.requests++;
+    }
+    st.live--;
+}
+
+// stop the servers, then check the served counter with an RDMA read
+task finish(coro_qp &qp, int servers, remote_buf served, uint64_t *local, uint64_t expect, stats &st)
+{
+    st.live++;
+    for (int i = 0; i < servers; i++)
+    {
+        if (co_await qp.send(nullptr, 0) != IBV_WC_SUCCESS)
+        {
+            st.errors++;
+        }
+    }
+    if (co_await qp.read(served, local, sizeof(*local)) != IBV_WC_SUCCESS || *local != expect)
+    {
+        printf("served %lu, expected %lu\n", *local, expect);
+        st.errors++;
+    }
+    st.live--;
+}
+
+int main(int argc, char *argv[])
+{
+    int coroutines = 16;
+    int requests = 10000;
+    uint32_t size = 64;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            coroutines = atoi(optarg);
+            break;
+        case 'n':
+            requests = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-c coroutines] [-n requests per coroutine] [-s size]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(coroutines > 0 && requests > 0 && size >= 32, "invalid args");
+    // two server coroutines per client keep receives posted while half of them send
+    const int servers = 2 * coroutines;
+    const int depth = servers + 1;
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    struct ibv_cq *cq = ibv_create_cq(ctx, 4 * depth, nullptr, nullptr, 0);
+    CHECK(cq, "ibv_create_cq fail");
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    // client req/resp per coroutine, one buffer per server, the served counter
+    const size_t buf_size = (size_t)(2 * coroutines + servers) * size + sizeof(uint64_t) * 2;
+    char *buf = (char *)aligned_alloc(64, (buf_size + 63) / 64 * 64);
+    CHECK(buf, "aligned_alloc fail");
+    memset(buf, 0, buf_size);
+    struct ibv_mr *mr = ibv_reg_mr(pd, buf, buf_size,
+                                   IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+    CHECK(mr, "ibv_reg_mr fail");
+    char *client_bufs = buf;
+    char *server_bufs = buf + (size_t)2 * coroutines * size;
+    uint64_t *served = (uint64_t *)(server_bufs + (size_t)servers * size);
+    uint64_t *served_copy = served + 1;
+
+    struct ibv_qp *cqp = create_qp(pd, cq, depth);
+    struct ibv_qp *sqp = create_qp(pd, cq, depth);
+    init_qp(cqp);
+    init_qp(sqp);
+    modify_to_rtr(cqp, path, sqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rtr(sqp, path, cqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rts(cqp, 0);
+    modify_to_rts(sqp, 0);
+    coro_qp cq_client(cqp, mr);
+    coro_qp cq_server(sqp, mr);
+
+    stats st;
+    st.lat.reserve((size_t)coroutines * requests);
+    for (int i = 0; i < servers; i++)
+    {
+        serve(cq_server, server_bufs + (size_t)i * size, size, served, st);
+    }
+    const uint64_t start = now_ns();
+    for (int i = 0; i < coroutines; i++)
+    {
+        char *b = client_bufs + (size_t)2 * i * size;
+        client(cq_client, i, b, b + size, size, requests, st);
+    }
+    const uint64_t chunks_warm = frame_pool::local().chunks();
+    while (st.live > servers)
+    {
+        poll_and_resume(cq);
+    }
+    const double secs = (now_ns() - start) / 1e9;
+    finish(cq_client, servers, {(uint64_t)served, mr->rkey}, served_copy, st.requests, st);
+    while (st.live > 0)
+    {
+        poll_and_resume(cq);
+    }
+
+    std::sort(st.lat.begin(), st.lat.end());
+    printf("coroutines=%d, requests=%lu, errors=%lu, %.0f req/s\n",
+           coroutines, st.requests, st.errors, st.requests / secs);
+    if (!st.lat.empty())
+    {
+        printf("latency us p50=%.1f p99=%.1f max=%.1f\n", st.lat[st.lat.size() / 2] / 1e3,
+               st.lat[st.lat.size() * 99 / 100] / 1e3, st.lat.back() / 1e3);
+    }
+    frame_pool &pool = frame_pool::local();
+    printf("frames=%lu, pool chunks=%lu (%lu while running), oversize frames=%lu\n",
+           pool.frames(), pool.chunks(), pool.chunks() - chunks_warm, pool.oversize());
+
+    ibv_destroy_qp(cqp);
+    ibv_destroy_qp(sqp);
+    ibv_destroy_cq(cq);
+    ibv_dereg_mr(mr);
+    free(buf);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return st.errors ? -1 : 0;
+}
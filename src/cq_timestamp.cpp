@@ -0,0 +1,525 @@
+/**
+ * Example of hardware completion timestamps with extended cqs. If you have
+ * no RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE).
+ *
+ * poll_cq.cpp reads struct ibv_wc from ibv_poll_cq, so latency can only be
+ * measured with host clocks around the polling loop. Here ts_cq creates the
+ * cq with ibv_create_cq_ex and IBV_WC_EX_WITH_COMPLETION_TIMESTAMP, and
+ * walks it with ibv_start_poll/ibv_next_poll/ibv_end_poll, which reads
+ * only the fields asked for instead of filling a whole ibv_wc. The raw
+ * device ticks are mapped to host CLOCK_MONOTONIC with dev_clock, which
+ * pairs ibv_query_rt_values_ex with the host clock and scales by
+ * hca_core_clock. If the device reports no core clock or the provider
+ * rejects the extended cq, ts_cq falls back to ibv_create_cq
+ * and ibv_poll_cq, hw_ts is then 0.
+ *
+ * The demo sends `iters` messages one at a time over a loopback qp pair
+ * and breaks the latency down into post -> data placed (recv cqe), data
+ * placed -> ACK back (send cqe) and recv cqe -> seen by the poller, then
+ * compares the cost per cqe of both poll APIs.
+ *
+ * g++ -O2 cq_timestamp.cpp -libverbs -o cq_timestamp
+ * ./cq_timestamp [-n iters] [-s size] [-P]
+ *
+ * -P: force the plain ibv_poll_cq path
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Maps raw completion timestamps to host CLOCK_MONOTONIC ns. A reference
+ * pair (device ticks, host ns) is taken by calibrate(), the host time is
+ * the middle of the ibv_query_rt_values_ex call. The device counter wraps
+ * at completion_timestamp_mask, the oscillators drift, so calibrate again
+ * from time to time.
+ */
+class dev_clock
+{
+public:
+    bool init(struct ibv_context *ctx)
+    {
+        ctx_ = ctx;
+        struct ibv_device_attr_ex attr;
+        memset(&attr, 0, sizeof(attr));
+        if (ibv_query_device_ex(ctx, nullptr, &attr) != 0)
+        {
+            return false;
+        }
+        khz_ = attr.hca_core_clock;
+        mask_ = attr.completion_timestamp_mask;
+        if (khz_ == 0 || mask_ == 0)
+        {
+            return false;
+        }
+        return calibrate();
+    }
+
+    bool calibrate()
+    {
+        struct ibv_values_ex values;
+        memset(&values, 0, sizeof(values));
+        values.comp_mask = IBV_VALUES_MASK_RAW_CLOCK;
+        const uint64_t t0 = now_ns();
+        if (ibv_query_rt_values_ex(ctx_, &values) != 0)
+        {
+            return false;
+        }
+        const uint64_t t1 = now_ns();
+        ref_ticks_ = (values.raw_clock.tv_sec * 1000000000ull + values.raw_clock.tv_nsec) & mask_;
+        ref_host_ = t0 + (t1 - t0) / 2;
+        return true;
+    }
+
+    uint64_t to_host_ns(uint64_t ticks) const
+    {
+        // ticks may be a bit before the reference, take the nearest
+        const uint64_t delta = (ticks - ref_ticks_) & mask_;
+        if (delta > mask_ / 2)
+        {
+            return ref_host_ - ticks_to_ns(((ref_ticks_ - ticks) & mask_));
+        }
+        return ref_host_ + ticks_to_ns(delta);
+    }
+
+    uint64_t ticks_to_ns(uint64_t ticks) const
+    {
+        return (unsigned __int128)ticks * 1000000 / khz_;
+    }
+
+    // device time between two raw timestamps
+    uint64_t elapsed_ns(uint64_t from, uint64_t to) const
+    {
+        return ticks_to_ns((to - from) & mask_);
+    }
+
+    uint64_t khz() const { return khz_; }
+
+private:
+    struct ibv_context *ctx_ = nullptr;
+    uint64_t khz_ = 0;
+    uint64_t mask_ = 0;
+    uint64_t ref_ticks_ = 0;
+    uint64_t ref_host_ = 0;
+};
+
+// what ts_cq hands to the handler, hw_ts is 0 without timestamps
+struct cqe
+{
+    uint64_t wr_id;
+    enum ibv_wc_status status;
+    enum ibv_wc_opcode opcode;
+    uint32_t byte_len;
+    uint32_t qp_num;
+    uint64_t hw_ts; // raw device ticks
+};
+
+class ts_cq
+{
+public:
+    ts_cq(struct ibv_context *ctx, int cqe_num, bool want_ts) : wcs_(64)
+    {
+        if (want_ts && !clock_.init(ctx))
+        {
+            printf("no hca_core_clock or ibv_query_rt_values_ex, fall back to ibv_poll_cq\n");
+            want_ts = false;
+        }
+        if (want_ts)
+        {
+            struct ibv_cq_init_attr_ex attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.cqe = cqe_num;
+            attr.wc_flags = IBV_WC_STANDARD_FLAGS | IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
+            cq_ex_ = ibv_create_cq_ex(ctx, &attr);
+            if (!cq_ex_)
+            {
+                printf("ibv_create_cq_ex with timestamps fail, errno=%d, fall back to ibv_poll_cq\n", errno);
+            }
+        }
+        if (cq_ex_)
+        {
+            cq_ = ibv_cq_ex_to_cq(cq_ex_);
+            printf("extended cq with completion timestamps, hca_core_clock=%lu kHz\n", clock_.khz());
+        }
+        else
+        {
+            cq_ = ibv_create_cq(ctx, cqe_num, nullptr, nullptr, 0);
+            CHECK(cq_, "ibv_create_cq fail");
+        }
+    }
+
+    ~ts_cq()
+    {
+        ibv_destroy_cq(cq_);
+    }
+
+    struct ibv_cq *cq() const { return cq_; }
+    bool has_ts() const { return cq_ex_ != nullptr; }
+    dev_clock &clock() { return clock_; }
+
+    // call f(const cqe &) for up to max cqes, return how many
+    template <typename F>
+    int poll(int max, F &&f)
+    {
+        if (!cq_ex_)
+        {
+            int n = ibv_poll_cq(cq_, std::min<int>(max, wcs_.size()), wcs_.data());
+            CHECK(n >= 0, "ibv_poll_cq fail");
+            for (int i = 0; i < n; i++)
+            {
+                const struct ibv_wc &wc = wcs_[i];
+                f(cqe{wc.wr_id, wc.status, wc.opcode, wc.byte_len, wc.qp_num, 0});
+            }
+            return n;
+        }
+        struct ibv_poll_cq_attr attr = {0};
+        int ret = ibv_start_poll(cq_ex_, &attr);
+        if (ret == ENOENT)
+        {
+            return 0; // nothing to end
+        }
+        CHECK(ret == 0, "ibv_start_poll fail");
+        int n = 0;
+        do
+        {
+            cqe c = {};
+            c.wr_id = cq_ex_->wr_id;
+            c.status = cq_ex_->status;
+            c.qp_num = ibv_wc_read_qp_num(cq_ex_);
+            // only wr_id, status, qp_num and vendor_err are valid on error
+            if (c.status == IBV_WC_SUCCESS)
+            {
+                c.opcode = ibv_wc_read_opcode(cq_ex_);
+                c.byte_len = ibv_wc_read_byte_len(cq_ex_);
+                c.hw_ts = ibv_wc_read_completion_ts(cq_ex_);
+            }
+            f(c);
+            n++;
+        } while (n < max && (ret = ibv_next_poll(cq_ex_)) == 0);
+        CHECK(ret == 0 || ret == ENOENT, "ibv_next_poll fail");
+        ibv_end_poll(cq_ex_);
+        return n;
+    }
+
+private:
+    struct ibv_cq_ex *cq_ex_ = nullptr;
+    struct ibv_cq *cq_ = nullptr;
+    dev_clock clock_;
+    std::vector<struct ibv_wc> wcs_;
+};
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int io_depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    init_attr.cap.max_recv_wr = io_depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+struct samples
+{
+    const char *name;
+    std::vector<uint64_t> v;
+    void add(int64_t ns) { v.push_back(ns > 0 ? ns : 0); }
+    void report()
+    {
+        if (v.empty())
+        {
+            return;
+        }
+        std::sort(v.begin(), v.end());
+        printf("  %-28s p50=%6lu ns, p99=%6lu ns, max=%6lu ns\n", name,
+               v[v.size() / 2], v[v.size() * 99 / 100], v.back());
+    }
+};
+
+/**
+ * Send iters messages one by one and reap both cqes of each. With
+ * timestamps the latency is split at the two NIC events, without only the
+ * host side total is known.
+ */
+bool run(struct ibv_context *ctx, struct ibv_pd *pd, bool want_ts, int iters, uint32_t size)
+{
+    ts_cq tcq(ctx, 64, want_ts);
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    struct ibv_qp *sqp = create_qp(pd, tcq.cq(), 16);
+    struct ibv_qp *rqp = create_qp(pd, tcq.cq(), 16);
+    init_qp(sqp);
+    init_qp(rqp);
+    modify_to_rtr(sqp, path, rqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rtr(rqp, path, sqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rts(sqp, 0);
+    modify_to_rts(rqp, 0);
+
+    char *buf = (char *)malloc(2 * size);
+    CHECK(buf, "malloc fail");
+    memset(buf, 't', 2 * size);
+    struct ibv_mr *mr = ibv_reg_mr(pd, buf, 2 * size, IBV_ACCESS_LOCAL_WRITE);
+    CHECK(mr, "ibv_reg_mr fail");
+
+    samples total{"post -> recv seen (host)", {}};
+    samples to_recv{"post -> data placed", {}};
+    samples ack{"data placed -> ack (send cqe)", {}};
+    samples delivery{"recv cqe -> seen by poller", {}};
+    uint64_t poll_ns = 0, polled = 0;
+    uint64_t last_cal = now_ns();
+
+    for (int i = 0; i < iters; i++)
+    {
+        struct ibv_sge rsge = {(uint64_t)buf + size, size, mr->lkey};
+        struct ibv_recv_wr rwr;
+        memset(&rwr, 0, sizeof(rwr));
+        rwr.wr_id = i;
+        rwr.sg_list = &rsge;
+        rwr.num_sge = 1;
+        struct ibv_recv_wr *bad_rwr = nullptr;
+        ret = ibv_post_recv(rqp, &rwr, &bad_rwr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+
+        struct ibv_sge ssge = {(uint64_t)buf, size, mr->lkey};
+        struct ibv_send_wr swr;
+        memset(&swr, 0, sizeof(swr));
+        swr.wr_id = i;
+        swr.sg_list = &ssge;
+        swr.num_sge = 1;
+        swr.opcode = IBV_WR_SEND;
+        swr.send_flags = IBV_SEND_SIGNALED;
+        struct ibv_send_wr *bad_swr = nullptr;
+        const uint64_t t_post = now_ns();
+        ret = ibv_post_send(sqp, &swr, &bad_swr);
+        CHECK(ret == 0, "ibv_post_send fail");
+
+        uint64_t send_ts = 0, recv_ts = 0, recv_seen = 0;
+        int got = 0;
+        while (got < 2)
+        {
+            const uint64_t p0 = now_ns();
+            int n = tcq.poll(16, [&](const cqe &c) {
+                CHECK(c.status == IBV_WC_SUCCESS, "bad cqe");
+                if (c.opcode == IBV_WC_RECV)
+                {
+                    recv_ts = c.hw_ts;
+                    recv_seen = now_ns();
+                }
+                else
+                {
+                    send_ts = c.hw_ts;
+                }
+            });
+            if (n > 0)
+            {
+                poll_ns += now_ns() - p0;
+                polled += n;
+            }
+            got += n;
+        }
+
+        total.add(recv_seen - t_post);
+        if (tcq.has_ts())
+        {
+            const dev_clock &clk = tcq.clock();
+            to_recv.add(clk.to_host_ns(recv_ts) - t_post);
+            ack.add(clk.elapsed_ns(recv_ts, send_ts));
+            delivery.add(recv_seen - clk.to_host_ns(recv_ts));
+        }
+        if (tcq.has_ts() && now_ns() - last_cal > 1000000000ull)
+        {
+            tcq.clock().calibrate();
+            last_cal = now_ns();
+        }
+    }
+
+    printf("%s, %d msgs of %u bytes, %.1f ns per cqe in non-empty polls\n",
+           tcq.has_ts() ? "ibv_start_poll/ibv_next_poll" : "ibv_poll_cq", iters, size,
+           polled ? (double)poll_ns / polled : 0.0);
+    total.report();
+    to_recv.report();
+    ack.report();
+    delivery.report();
+
+    ibv_destroy_qp(sqp);
+    ibv_destroy_qp(rqp);
+    ibv_dereg_mr(mr);
+    free(buf);
+    return tcq.has_ts();
+}
+
+int main(int argc, char *argv[])
+{
+    int iters = 10000;
+    uint32_t size = 64;
+    bool plain = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:P")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'P':
+            plain = true;
+            break;
+        default:
+            printf("usage: %s [-n iters] [-s size] [-P]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(iters > 0 && size > 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+
+    // timestamps first, then the plain path for comparison, unless the
+    // first run already fell back to it
+    if (plain || run(ctx, pd, true, iters, size))
+    {
+        run(ctx, pd, false, iters, size);
+    }
+
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,501 @@
+/**
+ * Example of credit based flow control. If you have no RDMA hardware, see
+ * https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * With rnr_retry and min_rnr_timer a SEND that finds no posted receive is
+ * NAKed and retried by the HCA after the RNR timer, the qp stalls for
+ * milliseconds (or breaks once the retries are used up). Here a sender
+ * only posts a SEND when it holds a credit, one credit is one receive
+ * buffer posted by the peer. The receiver grants credits as it reposts
+ * buffers, the grant is the cumulative number of reposted buffers, so a
+ * lost or reordered update is harmless:
+ * - piggybacked in the immediate data of every SEND_WITH_IMM going back,
+ * - otherwise batched, every `grant_batch` reposts an inline 8 byte RDMA
+ *   WRITE puts it into the sender's credit word, which consumes no receive
+ *   buffer and so needs no credit itself.
+ * Without credits messages wait in a local backlog instead of in the HCA.
+ *
+ * The benchmark sends bursts to a receiver doing `work_ns` per message,
+ * with a small receive queue, and reports the message latency (submit to
+ * receive) and throughput with and without flow control.
+ *
+ * g++ -O2 credit_flow.cpp -libverbs -lpthread -o credit_flow
+ * ./credit_flow [-n msgs] [-b burst] [-g gap_us] [-w work_ns] [-r rq_depth] [-B]
+ *
+ * -B: bidirectional traffic, credits ride on the data going back
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define SQ_DEPTH 128
+#define MSG_SIZE 256
+#define CREDIT_WR_ID (~0ull)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int rq_depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = SQ_DEPTH;
+    init_attr.cap.max_recv_wr = rq_depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = sizeof(uint64_t);
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+/**
+ * One end of a connection, driven by one thread. Memory layout of buf:
+ * [credit word, written by the peer][SQ_DEPTH send slots][rq_depth recv slots]
+ */
+class endpoint
+{
+public:
+    endpoint(struct ibv_context *ctx, struct ibv_pd *pd, int rq_depth, bool flow_control)
+        : rq_depth_(rq_depth), flow_control_(flow_control), grant_batch_(std::max(1, rq_depth / 4)),
+          wcs_(64)
+    {
+        cq_ = ibv_create_cq(ctx, SQ_DEPTH + rq_depth, nullptr, nullptr, 0);
+        CHECK(cq_, "ibv_create_cq fail");
+        qp_ = create_qp(pd, cq_, rq_depth);
+        buf_size_ = 64 + (uint64_t)(SQ_DEPTH + rq_depth) * MSG_SIZE;
+        buf_ = (char *)aligned_alloc(64, buf_size_);
+        CHECK(buf_, "aligned_alloc fail");
+        memset(buf_, 0, buf_size_);
+        mr_ = ibv_reg_mr(pd, buf_, buf_size_, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+        CHECK(mr_, "ibv_reg_mr fail");
+        lat_.reserve(1 << 20);
+    }
+    ~endpoint()
+    {
+        ibv_destroy_qp(qp_);
+        ibv_destroy_cq(cq_);
+        ibv_dereg_mr(mr_);
+        free(buf_);
+    }
+
+    struct ibv_qp *qp() { return qp_; }
+
+    // the peer's credit word, call after both qps are RTS
+    void connect(endpoint &peer)
+    {
+        peer_credit_addr_ = (uint64_t)peer.buf_;
+        peer_rkey_ = peer.mr_->rkey;
+        for (int i = 0; i < rq_depth_; i++)
+        {
+            post_recv(i);
+        }
+        // the initial receives are the initial credits, only reposts are granted
+        reposted_ = 0;
+    }
+
+    // queue a message, it is posted as soon as a credit and a send slot are free
+    void submit()
+    {
+        backlog_.push_back(now_ns());
+        drain();
+    }
+
+    // reap completions, handle received messages, return messages received
+    int progress(uint64_t work_ns)
+    {
+        int n = ibv_poll_cq(cq_, wcs_.size(), wcs_.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        int received = 0;
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs_[i];
+            CHECK(wc.status == IBV_WC_SUCCESS, "bad wc");
+            if (!(wc.opcode & IBV_WC_RECV))
+            {
+                sq_inflight_--;
+                continue;
+            }
+            char *slot = recv_slot(wc.wr_id);
+            uint64_t ts;
+            memcpy(&ts, slot, sizeof(ts));
+            lat_.push_back(now_ns() - ts);
+            on_grant(ntohl(wc.imm_data));
+            // pretend to process the message, then give the buffer back
+            const uint64_t until = now_ns() + work_ns;
+            while (now_ns() < until)
+            {
+            }
+            post_recv(wc.wr_id);
+            received++;
+        }
+        // the batched update, when no data going back carried the grant
+        if (flow_control_ && reposted_ - announced_ >= (uint64_t)grant_batch_ && sq_inflight_ < SQ_DEPTH)
+        {
+            write_credit();
+        }
+        // the peer may have written our credit word
+        on_grant(*(volatile uint64_t *)buf_);
+        drain();
+        return received;
+    }
+
+    bool idle() const { return backlog_.empty() && sq_inflight_ == 0; }
+
+    std::vector<uint64_t> &latencies() { return lat_; }
+    uint64_t credit_writes() const { return credit_writes_; }
+    uint64_t piggybacked() const { return piggybacked_; }
+    uint64_t credit_stalls() const { return credit_stalls_; }
+
+private:
+    char *send_slot(uint64_t i) { return buf_ + 64 + (i % SQ_DEPTH) * MSG_SIZE; }
+    char *recv_slot(uint64_t i) { return buf_ + 64 + (SQ_DEPTH + i) * MSG_SIZE; }
+
+    uint64_t credits() const { return rq_depth_ + peer_granted_ - sent_; }
+
+    // grants are cumulative, a 32 bit imm only carries the low bits
+    void on_grant(uint64_t granted)
+    {
+        const int32_t diff = (uint32_t)granted - (uint32_t)peer_granted_;
+        if (diff > 0)
+        {
+            peer_granted_ += diff;
+        }
+    }
+
+    void drain()
+    {
+        while (!backlog_.empty() && sq_inflight_ < SQ_DEPTH)
+        {
+            if (flow_control_ && credits() == 0)
+            {
+                credit_stalls_++;
+                return;
+            }
+            post_send(backlog_.front());
+            backlog_.pop_front();
+        }
+    }
+
+    void post_send(uint64_t submit_ts)
+    {
+        char *slot = send_slot(sent_);
+        memcpy(slot, &submit_ts, sizeof(submit_ts));
+        struct ibv_sge sge = {(uint64_t)slot, MSG_SIZE, mr_->lkey};
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = sent_;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND_WITH_IMM;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.imm_data = htonl((uint32_t)reposted_);
+        if (flow_control_ && reposted_ != announced_)
+        {
+            piggybacked_++;
+        }
+        announced_ = reposted_;
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+        sent_++;
+        sq_inflight_++;
+    }
+
+    void write_credit()
+    {
+        uint64_t granted = reposted_;
+        struct ibv_sge sge = {(uint64_t)&granted, sizeof(granted), 0};
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = CREDIT_WR_ID;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+        wr.wr.rdma.remote_addr = peer_credit_addr_;
+        wr.wr.rdma.rkey = peer_rkey_;
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send credit fail");
+        announced_ = reposted_;
+        sq_inflight_++;
+        credit_writes_++;
+    }
+
+    void post_recv(uint64_t slot)
+    {
+        struct ibv_sge sge = {(uint64_t)recv_slot(slot), MSG_SIZE, mr_->lkey};
+        struct ibv_recv_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = slot;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_recv(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+        reposted_++;
+    }
+
+    const int rq_depth_;
+    const bool flow_control_;
+    const int grant_batch_;
+    struct ibv_cq *cq_;
+    struct ibv_qp *qp_;
+    struct ibv_mr *mr_;
+    char *buf_;
+    uint64_t buf_size_;
+    uint64_t peer_credit_addr_ = 0;
+    uint32_t peer_rkey_ = 0;
+    std::vector<struct ibv_wc> wcs_;
+
+    // sender side
+    std::deque<uint64_t> backlog_; // submit time of waiting messages
+    uint64_t sent_ = 0;
+    uint64_t peer_granted_ = 0; // buffers the peer reposted, excluding the initial ones
+    int sq_inflight_ = 0;
+
+    // receiver side
+    uint64_t reposted_ = 0;
+    uint64_t announced_ = 0;
+
+    std::vector<uint64_t> lat_;
+    uint64_t credit_writes_ = 0;
+    uint64_t piggybacked_ = 0;
+    uint64_t credit_stalls_ = 0;
+};
+
+struct options
+{
+    int msgs = 200000;
+    int burst = 256;
+    int gap_us = 200;
+    uint64_t work_ns = 500;
+    int rq_depth = 32;
+    bool bidir = false;
+};
+
+void run(struct ibv_context *ctx, struct ibv_pd *pd, const options &o, bool flow_control)
+{
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    endpoint a(ctx, pd, o.rq_depth, flow_control);
+    endpoint b(ctx, pd, o.rq_depth, flow_control);
+    init_qp(a.qp());
+    init_qp(b.qp());
+    modify_to_rtr(a.qp(), path, b.qp()->qp_num, 0, port_attr.lid, gid);
+    modify_to_rtr(b.qp(), path, a.qp()->qp_num, 0, port_attr.lid, gid);
+    modify_to_rts(a.qp(), 0);
+    modify_to_rts(b.qp(), 0);
+    // post the initial receives before either side sends
+    a.connect(b);
+    b.connect(a);
+
+    const uint64_t start = now_ns();
+    auto drive = [&](endpoint &self, bool sends, int expect) {
+        int submitted = 0, received = 0;
+        uint64_t next_burst = now_ns();
+        while (received < expect || !self.idle() || (sends && submitted < o.msgs))
+        {
+            if (sends && submitted < o.msgs && now_ns() >= next_burst)
+            {
+                for (int i = 0; i < o.burst && submitted < o.msgs; i++, submitted++)
+                {
+                    self.submit();
+                }
+                next_burst = now_ns() + o.gap_us * 1000ull;
+            }
+            received += self.progress(o.work_ns);
+        }
+    };
+    std::thread tb([&]() { drive(b, o.bidir, o.msgs); });
+    drive(a, true, o.bidir ? o.msgs : 0);
+    tb.join();
+    const double secs = (now_ns() - start) / 1e9;
+
+    std::vector<uint64_t> &lat = b.latencies();
+    std::sort(lat.begin(), lat.end());
+    printf("%-12s msgs=%d, %.0f msgs/s, latency us p50=%.1f p99=%.1f p999=%.1f max=%.1f, "
+           "credit stalls=%lu, credit writes=%lu, piggybacked grants=%lu\n",
+           flow_control ? "credits" : "rnr retry", o.msgs, o.msgs / secs,
+           lat[lat.size() / 2] / 1e3, lat[lat.size() * 99 / 100] / 1e3,
+           lat[lat.size() * 999 / 1000] / 1e3, lat.back() / 1e3,
+           a.credit_stalls(), b.credit_writes(), b.piggybacked());
+}
+
+int main(int argc, char *argv[])
+{
+    options o;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:b:g:w:r:B")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            o.msgs = atoi(optarg);
+            break;
+        case 'b':
+            o.burst = atoi(optarg);
+            break;
+        case 'g':
+            o.gap_us = atoi(optarg);
+            break;
+        case 'w':
+            o.work_ns = strtoull(optarg, nullptr, 10);
+            break;
+        case 'r':
+            o.rq_depth = atoi(optarg);
+            break;
+        case 'B':
+            o.bidir = true;
+            break;
+        default:
+            printf("usage: %s [-n msgs] [-b burst] [-g gap_us] [-w work_ns] [-r rq_depth] [-B]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(o.msgs > 0 && o.burst > 0 && o.gap_us >= 0 && o.rq_depth > 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+
+    run(ctx, pd, o, false);
+    run(ctx, pd, o, true);
+
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
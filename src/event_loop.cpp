@@ -0,0 +1,676 @@
+/**
+ * Example of an epoll event loop over many completion channels. If you have
+ * no RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE).
+ *
+ * For many mostly idle connections one thread sleeps in epoll_wait on:
+ * - the completion channel fd of every cq, made non-blocking. On an event
+ *   ibv_get_cq_event is called until EAGAIN, the events are acked in batches
+ *   of `ack_batch` with ibv_ack_cq_events (it takes a lock, once per event
+ *   is wasteful), then the cq is drained, re-armed and polled once more so a
+ *   wc arriving before the arm is not missed.
+ * - timerfds, here a once a second stats line with the loop thread's cpu.
+ * - TCP sockets, here a listener that writes the stats to whoever connects.
+ * - an eventfd to stop the loop from another thread.
+ * Where the device supports it, ibv_modify_cq sets cq moderation: one event
+ * per `count` completions or after `period` us, whichever comes first.
+ *
+ * The demo serves `-n` echo connections, each with its own cq and channel,
+ * while a client thread sends `-r` requests per second to random ones.
+ *
+ * g++ -O2 event_loop.cpp -libverbs -lpthread -o event_loop
+ * ./event_loop [-n conns] [-r req_per_sec] [-t seconds] [-m count,period_us] [-a ack_batch] [-p stats_port]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define MSG_SIZE 64
+#define CONN_DEPTH 4
+#define SEND_TAG (1ull << 63)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = CONN_DEPTH;
+    init_attr.cap.max_recv_wr = CONN_DEPTH;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+static void set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    CHECK(flags >= 0, "fcntl F_GETFL fail");
+    int ret = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    CHECK(ret == 0, "fcntl F_SETFL fail");
+}
+
+/**
+ * Dispatches epoll events to per fd handlers. The handler is owned by the
+ * loop and reached through epoll_event.data.ptr, no lookup per event.
+ */
+class event_loop
+{
+public:
+    typedef std::function<void(uint32_t events)> handler;
+
+    event_loop()
+    {
+        epfd_ = epoll_create1(EPOLL_CLOEXEC);
+        CHECK(epfd_ >= 0, "epoll_create1 fail");
+        stop_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        CHECK(stop_fd_ >= 0, "eventfd fail");
+        add(stop_fd_, EPOLLIN, [this](uint32_t) { stopped_ = true; });
+    }
+    ~event_loop()
+    {
+        for (watch *w : watches_)
+        {
+            delete w;
+        }
+        for (int fd : timers_)
+        {
+            close(fd);
+        }
+        close(stop_fd_);
+        close(epfd_);
+    }
+
+    void add(int fd, uint32_t events, handler h)
+    {
+        watch *w = new watch{fd, h};
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = w;
+        int ret = epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+        CHECK(ret == 0, "epoll_ctl add fail");
+        watches_.push_back(w);
+    }
+
+    void add_timer(uint64_t interval_ms, std::function<void()> cb)
+    {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        CHECK(fd >= 0, "timerfd_create fail");
+        struct itimerspec its;
+        its.it_interval.tv_sec = interval_ms / 1000;
+        its.it_interval.tv_nsec = interval_ms % 1000 * 1000000;
+        its.it_value = its.it_interval;
+        int ret = timerfd_settime(fd, 0, &its, nullptr);
+        CHECK(ret == 0, "timerfd_settime fail");
+        timers_.push_back(fd);
+        add(fd, EPOLLIN, [fd, cb](uint32_t) {
+            uint64_t expirations;
+            if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+                cb();
+            }
+        });
+    }
+
+    // safe to call from any thread
+    void stop()
+    {
+        uint64_t one = 1;
+        ssize_t n = write(stop_fd_, &one, sizeof(one));
+        CHECK(n == sizeof(one), "eventfd write fail");
+    }
+
+    void run()
+    {
+        struct epoll_event evs[256];
+        while (!stopped_)
+        {
+            int n = epoll_wait(epfd_, evs, 256, -1);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            CHECK(n >= 0, "epoll_wait fail");
+            wakeups_++;
+            for (int i = 0; i < n; i++)
+            {
+                watch *w = (watch *)evs[i].data.ptr;
+                w->h(evs[i].events);
+            }
+        }
+    }
+
+    uint64_t wakeups() const { return wakeups_; }
+
+private:
+    struct watch
+    {
+        int fd;
+        handler h;
+    };
+
+    int epfd_;
+    int stop_fd_;
+    bool stopped_ = false;
+    std::vector<watch *> watches_;
+    std::vector<int> timers_;
+    uint64_t wakeups_ = 0;
+};
+
+struct loop_stats
+{
+    uint64_t cq_events = 0;
+    uint64_t acks = 0; // ibv_ack_cq_events calls
+    uint64_t wcs = 0;
+};
+
+/**
+ * A cq on its own completion channel, registered in the loop. Events are
+ * acked in batches, all of them must be acked before the cq is destroyed.
+ */
+class cq_watcher
+{
+public:
+    typedef std::function<void(const struct ibv_wc &wc)> wc_fn;
+
+    cq_watcher(struct ibv_context *ctx, event_loop &loop, int cqe, uint16_t mod_count, uint16_t mod_period,
+               int ack_batch, loop_stats &st, wc_fn on_wc)
+        : ack_batch_(ack_batch), st_(st), on_wc_(on_wc)
+    {
+        ch_ = ibv_create_comp_channel(ctx);
+        CHECK(ch_, "ibv_create_comp_channel fail");
+        set_nonblock(ch_->fd);
+        cq_ = ibv_create_cq(ctx, cqe, nullptr, ch_, 0);
+        CHECK(cq_, "ibv_create_cq fail");
+        if (mod_count > 0 && moderation_ok_)
+        {
+            struct ibv_modify_cq_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.attr_mask = IBV_CQ_ATTR_MODERATE;
+            attr.moderate.cq_count = mod_count;
+            attr.moderate.cq_period = mod_period;
+            int ret = ibv_modify_cq(cq_, &attr);
+            if (ret != 0)
+            {
+                printf("cq moderation not supported by the device (%s), one event per arm\n", strerror(ret));
+                moderation_ok_ = false;
+            }
+        }
+        int ret = ibv_req_notify_cq(cq_, 0);
+        CHECK(ret == 0, "ibv_req_notify_cq fail");
+        loop.add(ch_->fd, EPOLLIN, [this](uint32_t) { on_event(); });
+    }
+    ~cq_watcher()
+    {
+        if (unacked_ > 0)
+        {
+            ibv_ack_cq_events(cq_, unacked_);
+        }
+        ibv_destroy_cq(cq_);
+        ibv_destroy_comp_channel(ch_);
+    }
+
+    struct ibv_cq *cq() { return cq_; }
+
+private:
+    void on_event()
+    {
+        struct ibv_cq *ev_cq;
+        void *ev_ctx;
+        while (ibv_get_cq_event(ch_, &ev_cq, &ev_ctx) == 0)
+        {
+            unacked_++;
+            st_.cq_events++;
+        }
+        CHECK(errno == EAGAIN, "ibv_get_cq_event fail");
+        if (unacked_ >= ack_batch_)
+        {
+            ibv_ack_cq_events(cq_, unacked_);
+            unacked_ = 0;
+            st_.acks++;
+        }
+        // drain, arm, then poll again, a wc that came in before the arm
+        // raised no event
+        drain();
+        int ret = ibv_req_notify_cq(cq_, 0);
+        CHECK(ret == 0, "ibv_req_notify_cq fail");
+        drain();
+    }
+
+    void drain()
+    {
+        struct ibv_wc wcs[16];
+        int n;
+        do
+        {
+            n = ibv_poll_cq(cq_, 16, wcs);
+            CHECK(n >= 0, "ibv_poll_cq fail");
+            for (int i = 0; i < n; i++)
+            {
+                on_wc_(wcs[i]);
+            }
+            st_.wcs += n;
+        } while (n == 16);
+    }
+
+    static bool moderation_ok_;
+    const unsigned int ack_batch_;
+    loop_stats &st_;
+    wc_fn on_wc_;
+    struct ibv_comp_channel *ch_;
+    struct ibv_cq *cq_;
+    unsigned int unacked_ = 0;
+};
+bool cq_watcher::moderation_ok_ = true;
+
+// registered memory for all connections, a recv and a send slot per side
+struct conn_mem
+{
+    char *buf;
+    struct ibv_mr *mr;
+
+    char *slot(int conn, int which) { return buf + ((size_t)conn * 4 + which) * MSG_SIZE; }
+};
+
+void post_recv(struct ibv_qp *qp, conn_mem &m, int conn, int which)
+{
+    struct ibv_sge sge = {(uint64_t)m.slot(conn, which), MSG_SIZE, m.mr->lkey};
+    struct ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = conn;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    struct ibv_recv_wr *bad_wr = nullptr;
+    int ret = ibv_post_recv(qp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_recv fail");
+}
+
+void post_send(struct ibv_qp *qp, conn_mem &m, int conn, int which, uint32_t len)
+{
+    struct ibv_sge sge = {(uint64_t)m.slot(conn, which), len, m.mr->lkey};
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = SEND_TAG | conn;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    struct ibv_send_wr *bad_wr = nullptr;
+    int ret = ibv_post_send(qp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_send fail");
+}
+
+int main(int argc, char *argv[])
+{
+    int conns = 512;
+    int rate = 1000;
+    int seconds = 5;
+    int mod_count = 0, mod_period = 0;
+    int ack_batch = 16;
+    int stats_port = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:t:m:a:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            conns = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'm':
+            CHECK(sscanf(optarg, "%d,%d", &mod_count, &mod_period) == 2, "-m count,period_us");
+            break;
+        case 'a':
+            ack_batch = atoi(optarg);
+            break;
+        case 'p':
+            stats_port = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-n conns] [-r req_per_sec] [-t seconds] [-m count,period_us] [-a ack_batch] [-p stats_port]\n",
+                   argv[0]);
+            return -1;
+        }
+    }
+    CHECK(conns > 0 && rate > 0 && seconds > 0 && ack_batch > 0 &&
+              mod_count >= 0 && mod_count < 65536 && mod_period >= 0 && mod_period < 65536,
+          "invalid args");
+
+    // one fd per completion channel
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)conns + 64)
+    {
+        rl.rlim_cur = std::min(rl.rlim_max, (rlim_t)conns + 64);
+        setrlimit(RLIMIT_NOFILE, &rl);
+        CHECK(rl.rlim_cur >= (rlim_t)conns + 64, "RLIMIT_NOFILE too low for that many channels");
+    }
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    // slots 0/1 are the server's recv/send, 2/3 the client's
+    conn_mem mem;
+    const size_t mem_size = (size_t)conns * 4 * MSG_SIZE;
+    mem.buf = (char *)malloc(mem_size);
+    CHECK(mem.buf, "malloc fail");
+    memset(mem.buf, 0, mem_size);
+    mem.mr = ibv_reg_mr(pd, mem.buf, mem_size, IBV_ACCESS_LOCAL_WRITE);
+    CHECK(mem.mr, "ibv_reg_mr fail");
+
+    event_loop loop;
+    loop_stats st;
+    uint64_t served = 0;
+    std::vector<struct ibv_qp *> sqps(conns), cqps(conns);
+    std::vector<cq_watcher *> watchers(conns);
+    struct ibv_cq *client_cq = ibv_create_cq(ctx, 2 * conns + 16, nullptr, nullptr, 0);
+    CHECK(client_cq, "ibv_create_cq fail");
+    for (int i = 0; i < conns; i++)
+    {
+        // the server side echoes every request back from the loop thread
+        watchers[i] = new cq_watcher(ctx, loop, 2 * CONN_DEPTH, mod_count, mod_period, ack_batch, st,
+                                     [&, i](const struct ibv_wc &wc) {
+                                         CHECK(wc.status == IBV_WC_SUCCESS, "server wc fail");
+                                         if (wc.wr_id & SEND_TAG)
+                                         {
+                                             return;
+                                         }
+                                         memcpy(mem.slot(i, 1), mem.slot(i, 0), wc.byte_len);
+                                         post_recv(sqps[i], mem, i, 0);
+                                         post_send(sqps[i], mem, i, 1, wc.byte_len);
+                                         served++;
+                                     });
+        sqps[i] = create_qp(pd, watchers[i]->cq());
+        cqps[i] = create_qp(pd, client_cq);
+        init_qp(sqps[i]);
+        init_qp(cqps[i]);
+        modify_to_rtr(sqps[i], path, cqps[i]->qp_num, 0, port_attr.lid, gid);
+        modify_to_rtr(cqps[i], path, sqps[i]->qp_num, 0, port_attr.lid, gid);
+        modify_to_rts(sqps[i], 0);
+        modify_to_rts(cqps[i], 0);
+        post_recv(sqps[i], mem, i, 0);
+    }
+
+    // once a second: what the loop did and what it cost
+    uint64_t last_ts = now_ns(), last_cpu = 0, last_served = 0, last_wakeups = 0, last_events = 0;
+    uint64_t last_acks = 0, last_wcs = 0;
+    char stats_line[256] = "no stats yet\n";
+    loop.add_timer(1000, [&]() {
+        const uint64_t ts = now_ns(), cpu = thread_cpu_ns();
+        snprintf(stats_line, sizeof(stats_line),
+                 "served=%lu, wakeups=%lu, cq events=%lu, acks=%lu, wcs=%lu, loop cpu=%.2f%%\n",
+                 served - last_served, loop.wakeups() - last_wakeups, st.cq_events - last_events,
+                 st.acks - last_acks, st.wcs - last_wcs, 100.0 * (cpu - last_cpu) / (ts - last_ts));
+        printf("%s", stats_line);
+        last_ts = ts;
+        last_cpu = cpu;
+        last_served = served;
+        last_wakeups = loop.wakeups();
+        last_events = st.cq_events;
+        last_acks = st.acks;
+        last_wcs = st.wcs;
+    });
+
+    // a TCP listener in the same loop, every connection gets the last stats line
+    int lfd = -1;
+    if (stats_port > 0)
+    {
+        lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        CHECK(lfd >= 0, "socket fail");
+        int one = 1;
+        setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(stats_port);
+        CHECK(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "bind fail");
+        CHECK(listen(lfd, 16) == 0, "listen fail");
+        loop.add(lfd, EPOLLIN, [&](uint32_t) {
+            int fd;
+            while ((fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC)) >= 0)
+            {
+                // a client that already reset must not raise SIGPIPE in the loop
+                ssize_t n = send(fd, stats_line, strlen(stats_line), MSG_NOSIGNAL);
+                (void)n;
+                close(fd);
+            }
+        });
+        printf("stats on tcp 127.0.0.1:%d\n", stats_port);
+    }
+
+    // the client busy polls its own cq and paces requests at `rate`
+    std::vector<uint64_t> lat;
+    std::thread client([&]() {
+        std::mt19937 rng(1);
+        std::vector<uint64_t> sent_ts(conns, 0); // 0: no request outstanding
+        const uint64_t interval = 1000000000ull / rate;
+        const uint64_t end = now_ns() + seconds * 1000000000ull;
+        uint64_t next = now_ns();
+        int outstanding = 0;
+        struct ibv_wc wcs[16];
+        while (now_ns() < end || outstanding > 0)
+        {
+            const uint64_t now = now_ns();
+            if (now >= next && now < end)
+            {
+                next += interval;
+                const int i = rng() % conns;
+                if (!sent_ts[i])
+                {
+                    snprintf(mem.slot(i, 3), MSG_SIZE, "request to %d", i);
+                    post_recv(cqps[i], mem, i, 2);
+                    post_send(cqps[i], mem, i, 3, MSG_SIZE);
+                    sent_ts[i] = now;
+                    outstanding++;
+                }
+            }
+            int n = ibv_poll_cq(client_cq, 16, wcs);
+            CHECK(n >= 0, "ibv_poll_cq fail");
+            for (int k = 0; k < n; k++)
+            {
+                CHECK(wcs[k].status == IBV_WC_SUCCESS, "client wc fail");
+                if (wcs[k].wr_id & SEND_TAG)
+                {
+                    continue;
+                }
+                const int i = wcs[k].wr_id;
+                CHECK(memcmp(mem.slot(i, 2), mem.slot(i, 3), MSG_SIZE) == 0, "bad echo");
+                lat.push_back(now_ns() - sent_ts[i]);
+                sent_ts[i] = 0;
+                outstanding--;
+            }
+            if (n == 0 && next > now_ns() + 20000)
+            {
+                usleep(10);
+            }
+        }
+        loop.stop();
+    });
+
+    loop.run();
+    client.join();
+
+    std::sort(lat.begin(), lat.end());
+    printf("conns=%d, requests=%zu, cq events=%lu, ack calls=%lu, events per ack=%.1f, wc per event=%.2f\n",
+           conns, lat.size(), st.cq_events, st.acks, st.acks ? (double)st.cq_events / st.acks : 0.0,
+           st.cq_events ? (double)st.wcs / st.cq_events : 0.0);
+    if (!lat.empty())
+    {
+        printf("rtt us p50=%.1f p99=%.1f max=%.1f\n", lat[lat.size() / 2] / 1e3,
+               lat[lat.size() * 99 / 100] / 1e3, lat.back() / 1e3);
+    }
+
+    if (lfd >= 0)
+    {
+        close(lfd);
+    }
+    for (int i = 0; i < conns; i++)
+    {
+        ibv_destroy_qp(sqps[i]);
+        ibv_destroy_qp(cqps[i]);
+        delete watchers[i];
+    }
+    ibv_destroy_cq(client_cq);
+    ibv_dereg_mr(mem.mr);
+    free(mem.buf);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
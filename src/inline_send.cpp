@@ -0,0 +1,621 @@
+/**
+ * Example of an inline small message fast path with message coalescing.
+ * If you have no RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181
+ * to config Soft-RoCE(RXE).
+ *
+ * create_qp in poll_cq.cpp never sets cap.max_inline_data, so even a 20
+ * bytes message is gathered by DMA from a registered buffer. Here:
+ * - the largest max_inline_data the device accepts is probed by creating
+ *   throwaway qps, and payloads below the threshold are posted with
+ *   IBV_SEND_INLINE: the data is copied into the wqe, no lkey, no extra
+ *   PCIe read, and the buffer can be reused as soon as post returns;
+ * - when the send queue is busy (more than half of it in flight), small
+ *   messages are appended to a frame instead, and the frame goes out as
+ *   one SEND once it is full or the queue drains. Every SEND carries
+ *   [u16 len][payload] records, the receiver deframes them in place.
+ *
+ * g++ -O2 inline_send.cpp -libverbs -o inline_send
+ * ./inline_send [-t threshold] [-n msgs] [-d depth]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define FRAME_SIZE 4096
+#define MAX_MSG 256
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int io_depth, uint32_t max_inline)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    init_attr.cap.max_recv_wr = io_depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = max_inline;
+    init_attr.qp_type = IBV_QPT_RC;
+    return ibv_create_qp(pd, &init_attr);
+}
+
+/**
+ * There is no device attribute for the inline limit, so try qps with a
+ * decreasing max_inline_data until one is created. The provider reports
+ * the real value (maybe larger than asked) back in cap.max_inline_data.
+ */
+uint32_t probe_max_inline(struct ibv_pd *pd, struct ibv_cq *cq)
+{
+    for (uint32_t want = 1024; want >= 16; want /= 2)
+    {
+        struct ibv_qp_init_attr init_attr;
+        memset(&init_attr, 0, sizeof(init_attr));
+        init_attr.send_cq = cq;
+        init_attr.recv_cq = cq;
+        init_attr.cap.max_send_wr = 1;
+        init_attr.cap.max_recv_wr = 1;
+        init_attr.cap.max_send_sge = 1;
+        init_attr.cap.max_recv_sge = 1;
+        init_attr.cap.max_inline_data = want;
+        init_attr.qp_type = IBV_QPT_RC;
+        struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+        if (qp)
+        {
+            ibv_destroy_qp(qp);
+            return init_attr.cap.max_inline_data;
+        }
+    }
+    return 0;
+}
+
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+enum send_mode
+{
+    MODE_DMA,      // one SEND per message from a registered buffer
+    MODE_INLINE,   // one SEND per message, inline below the threshold
+    MODE_COALESCE, // inline, and frames of many messages under load
+};
+const char *mode_to_str(send_mode m)
+{
+    switch (m)
+    {
+    case MODE_DMA:
+        return "dma";
+    case MODE_INLINE:
+        return "inline";
+    case MODE_COALESCE:
+        return "coalesce";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * Small message sender. Every SEND is a frame of [u16 len][payload]
+ * records, a single message is a frame of one record. Frames bigger than
+ * the inline threshold are copied to a registered staging slot, slot
+ * seq % depth is free again once wr seq completes (in order completion).
+ */
+class msg_sender
+{
+public:
+    msg_sender(struct ibv_qp *qp, struct ibv_pd *pd, int depth, uint32_t inline_threshold, send_mode mode)
+        : qp_(qp), depth_(depth), threshold_(inline_threshold), mode_(mode)
+    {
+        slots_ = (char *)aligned_alloc(4096, (uint64_t)depth * FRAME_SIZE);
+        CHECK(slots_, "aligned_alloc fail");
+        mr_ = ibv_reg_mr(pd, slots_, (uint64_t)depth * FRAME_SIZE, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(mr_, "ibv_reg_mr fail");
+    }
+    ~msg_sender()
+    {
+        ibv_dereg_mr(mr_);
+        free(slots_);
+    }
+
+    int inflight() const { return (int)(seq_ - completed_); }
+    uint64_t sends() const { return seq_; }
+    uint64_t inlined() const { return inlined_; }
+
+    // false if the send queue is full, reap completions and try again
+    bool send(const void *data, uint16_t len)
+    {
+        const uint32_t rec = sizeof(uint16_t) + len;
+        if (mode_ == MODE_COALESCE && (frame_len_ > 0 || inflight() >= depth_ / 2))
+        {
+            if (frame_len_ + rec > FRAME_SIZE && !flush())
+            {
+                return false;
+            }
+            append(frame_, frame_len_, data, len);
+            return true;
+        }
+        if (inflight() >= depth_)
+        {
+            return false;
+        }
+        char one[sizeof(uint16_t) + MAX_MSG];
+        uint32_t one_len = 0;
+        append(one, one_len, data, len);
+        post(one, one_len);
+        return true;
+    }
+
+    // send the pending frame, false if the send queue is full
+    bool flush()
+    {
+        if (frame_len_ == 0)
+        {
+            return true;
+        }
+        if (inflight() >= depth_)
+        {
+            return false;
+        }
+        post(frame_, frame_len_);
+        frame_len_ = 0;
+        return true;
+    }
+
+    void on_wc(const struct ibv_wc &wc)
+    {
+        CHECK(wc.status == IBV_WC_SUCCESS, "bad send wc");
+        completed_ = std::max(completed_, wc.wr_id + 1);
+        // the queue is draining, do not hold messages back any longer
+        if (inflight() < depth_ / 2)
+        {
+            flush();
+        }
+    }
+
+    /**
+     * Wait until everything posted is complete. The tail may be unsignaled,
+     * so a signaled zero length RDMA WRITE is posted behind it, its cqe
+     * retires all the wrs before. Must be called with no receive pending.
+     */
+    void finish(struct ibv_cq *cq)
+    {
+        auto poll_own = [&]() {
+            struct ibv_wc wc;
+            int n = ibv_poll_cq(cq, 1, &wc);
+            CHECK(n >= 0, "ibv_poll_cq fail");
+            if (n == 1 && wc.qp_num == qp_->qp_num)
+            {
+                on_wc(wc);
+            }
+        };
+        while (!flush() || inflight() >= depth_)
+        {
+            // a full queue always ends with a signaled wr
+            poll_own();
+        }
+        if (completed_ == seq_)
+        {
+            return;
+        }
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = seq_++;
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+        while (completed_ < seq_)
+        {
+            poll_own();
+        }
+    }
+
+private:
+    static void append(char *frame, uint32_t &frame_len, const void *data, uint16_t len)
+    {
+        memcpy(frame + frame_len, &len, sizeof(len));
+        memcpy(frame + frame_len + sizeof(len), data, len);
+        frame_len += sizeof(len) + len;
+    }
+
+    void post(const char *frame, uint32_t len)
+    {
+        const uint64_t seq = seq_++;
+        struct ibv_sge sge;
+        sge.length = len;
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = seq;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        if (mode_ != MODE_DMA && len <= threshold_)
+        {
+            // copied into the wqe by ibv_post_send, lkey is not used
+            sge.addr = (uint64_t)frame;
+            sge.lkey = 0;
+            wr.send_flags = IBV_SEND_INLINE;
+            inlined_++;
+        }
+        else
+        {
+            char *slot = slots_ + (seq % depth_) * FRAME_SIZE;
+            memcpy(slot, frame, len);
+            sge.addr = (uint64_t)slot;
+            sge.lkey = mr_->lkey;
+        }
+        // selective signaling, see send_batch.cpp
+        if ((seq + 1) % (depth_ / 4) == 0 || inflight() == depth_)
+        {
+            wr.send_flags |= IBV_SEND_SIGNALED;
+        }
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+    }
+
+    struct ibv_qp *qp_;
+    const int depth_;
+    const uint32_t threshold_;
+    const send_mode mode_;
+    char *slots_;
+    struct ibv_mr *mr_;
+    char frame_[FRAME_SIZE];
+    uint32_t frame_len_ = 0;
+    uint64_t seq_ = 0;
+    uint64_t completed_ = 0;
+    uint64_t inlined_ = 0;
+};
+
+// split a received frame into messages, fn(const char *data, uint16_t len)
+template <typename F>
+void deframe(const char *frame, uint32_t len, F fn)
+{
+    uint32_t off = 0;
+    while (off + sizeof(uint16_t) <= len)
+    {
+        uint16_t n;
+        memcpy(&n, frame + off, sizeof(n));
+        off += sizeof(n);
+        CHECK(off + n <= len, "truncated frame");
+        fn(frame + off, n);
+        off += n;
+    }
+}
+
+struct loopback
+{
+    struct ibv_cq *cq;
+    struct ibv_qp *aqp;
+    struct ibv_qp *bqp;
+    char *recv_bufs; // depth frames for each qp
+    struct ibv_mr *recv_mr;
+    int depth;
+};
+
+void post_recv(loopback &lb, struct ibv_qp *qp, uint64_t idx)
+{
+    struct ibv_sge sge;
+    sge.addr = (uint64_t)lb.recv_bufs + idx * FRAME_SIZE;
+    sge.length = FRAME_SIZE;
+    sge.lkey = lb.recv_mr->lkey;
+    struct ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = idx;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    struct ibv_recv_wr *bad_wr = nullptr;
+    int ret = ibv_post_recv(qp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_recv fail");
+}
+
+// stream msgs messages of 16~MAX_MSG bytes from aqp to bqp
+void run_stream(loopback &lb, struct ibv_pd *pd, uint32_t threshold, send_mode mode, int msgs)
+{
+    msg_sender sender(lb.aqp, pd, lb.depth, threshold, mode);
+    char payload[MAX_MSG];
+    memset(payload, 'x', sizeof(payload));
+    uint64_t seed = 1;
+    int sent = 0, received = 0;
+    uint64_t bytes = 0;
+    std::vector<struct ibv_wc> wcs(64);
+    const uint64_t start = now_ns();
+    while (received < msgs)
+    {
+        while (sent < msgs)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            uint16_t len = 16 + (seed >> 33) % (MAX_MSG - 16 + 1);
+            memcpy(payload, &sent, sizeof(sent));
+            if (!sender.send(payload, len))
+            {
+                break;
+            }
+            sent++;
+        }
+        if (sent == msgs)
+        {
+            sender.flush();
+        }
+        int n = ibv_poll_cq(lb.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs[i];
+            if (wc.opcode == IBV_WC_SEND)
+            {
+                sender.on_wc(wc);
+                continue;
+            }
+            CHECK(wc.status == IBV_WC_SUCCESS && wc.opcode == IBV_WC_RECV, "bad recv wc");
+            const char *frame = lb.recv_bufs + wc.wr_id * FRAME_SIZE;
+            deframe(frame, wc.byte_len, [&](const char *data, uint16_t len) {
+                int seq;
+                memcpy(&seq, data, sizeof(seq));
+                CHECK(seq == received, "message out of order");
+                received++;
+                bytes += len;
+            });
+            post_recv(lb, lb.bqp, wc.wr_id);
+        }
+    }
+    const double secs = (now_ns() - start) / 1e9;
+    sender.finish(lb.cq);
+    printf("stream   %-9s msgs=%d, sends=%lu, inlined=%lu, %.0f msgs/s, %.2f MB/s\n",
+           mode_to_str(mode), msgs, sender.sends(), sender.inlined(),
+           msgs / secs, bytes / secs / 1e6);
+}
+
+// one message in flight at a time, a -> b -> a
+void run_pingpong(loopback &lb, struct ibv_pd *pd, uint32_t threshold, send_mode mode, int rounds, uint16_t len)
+{
+    msg_sender a(lb.aqp, pd, lb.depth, threshold, mode);
+    msg_sender b(lb.bqp, pd, lb.depth, threshold, mode);
+    char payload[MAX_MSG];
+    memset(payload, 'y', sizeof(payload));
+    std::vector<struct ibv_wc> wcs(16);
+    std::vector<uint64_t> lat;
+    for (int r = 0; r < rounds; r++)
+    {
+        const uint64_t start = now_ns();
+        CHECK(a.send(payload, len), "send fail");
+        bool done = false;
+        while (!done)
+        {
+            int n = ibv_poll_cq(lb.cq, wcs.size(), wcs.data());
+            CHECK(n >= 0, "ibv_poll_cq fail");
+            for (int i = 0; i < n; i++)
+            {
+                struct ibv_wc &wc = wcs[i];
+                const bool on_a = wc.qp_num == lb.aqp->qp_num;
+                if (wc.opcode == IBV_WC_SEND)
+                {
+                    (on_a ? a : b).on_wc(wc);
+                    continue;
+                }
+                CHECK(wc.status == IBV_WC_SUCCESS, "bad recv wc");
+                post_recv(lb, on_a ? lb.aqp : lb.bqp, wc.wr_id);
+                if (on_a)
+                {
+                    done = true;
+                }
+                else
+                {
+                    CHECK(b.send(payload, len), "send fail");
+                }
+            }
+        }
+        lat.push_back(now_ns() - start);
+    }
+    a.finish(lb.cq);
+    b.finish(lb.cq);
+    std::sort(lat.begin(), lat.end());
+    printf("pingpong %-9s len=%u, rtt p50=%.2fus p99=%.2fus\n", mode_to_str(mode), len,
+           lat[lat.size() / 2] / 1e3, lat[lat.size() * 99 / 100] / 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t threshold = 256;
+    int msgs = 1000000;
+    int depth = 128;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            threshold = atoi(optarg);
+            break;
+        case 'n':
+            msgs = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-t threshold] [-n msgs] [-d depth]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(depth >= 4 && msgs > 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    loopback lb;
+    lb.depth = depth;
+    lb.cq = ibv_create_cq(ctx, depth * 4, nullptr, nullptr, 0);
+    CHECK(lb.cq, "ibv_create_cq fail");
+    const uint32_t max_inline = probe_max_inline(pd, lb.cq);
+    threshold = std::min(threshold, max_inline);
+    printf("device max_inline_data=%u, inline threshold=%u\n", max_inline, threshold);
+
+    lb.aqp = create_qp(pd, lb.cq, depth, threshold);
+    CHECK(lb.aqp, "ibv_create_qp fail");
+    lb.bqp = create_qp(pd, lb.cq, depth, threshold);
+    CHECK(lb.bqp, "ibv_create_qp fail");
+    init_qp(lb.aqp);
+    init_qp(lb.bqp);
+    modify_to_rtr(lb.aqp, path, lb.bqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rtr(lb.bqp, path, lb.aqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rts(lb.aqp, 0);
+    modify_to_rts(lb.bqp, 0);
+
+    // [0, depth) for aqp, [depth, 2*depth) for bqp
+    lb.recv_bufs = (char *)aligned_alloc(4096, (uint64_t)depth * 2 * FRAME_SIZE);
+    CHECK(lb.recv_bufs, "aligned_alloc fail");
+    lb.recv_mr = ibv_reg_mr(pd, lb.recv_bufs, (uint64_t)depth * 2 * FRAME_SIZE, IBV_ACCESS_LOCAL_WRITE);
+    CHECK(lb.recv_mr, "ibv_reg_mr fail");
+    for (int i = 0; i < depth; i++)
+    {
+        post_recv(lb, lb.aqp, i);
+        post_recv(lb, lb.bqp, depth + i);
+    }
+
+    const send_mode modes[] = {MODE_DMA, MODE_INLINE, MODE_COALESCE};
+    for (send_mode m : modes)
+    {
+        run_pingpong(lb, pd, threshold, m, 10000, 32);
+    }
+    for (send_mode m : modes)
+    {
+        run_stream(lb, pd, threshold, m, msgs);
+    }
+
+    ibv_destroy_qp(lb.aqp);
+    ibv_destroy_qp(lb.bqp);
+    ibv_destroy_cq(lb.cq);
+    ibv_dereg_mr(lb.recv_mr);
+    free(lb.recv_bufs);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
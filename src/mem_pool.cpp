@@ -0,0 +1,449 @@
+/**
+ * Example of a pre-registered memory pool. If you have no RDMA hardware,
+ * see https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * reg_mr.cpp mallocs every buffer and registers it with ibv_reg_mr one by
+ * one, each call costs a syscall plus page pinning. Here a few large
+ * hugepage backed regions are registered once, carved into slabs of power
+ * of 2 size classes, and handed out from a per thread cache. alloc/free on
+ * the data path are O(1) and never touch registration.
+ *
+ * g++ -O2 mem_pool.cpp -libverbs -lpthread -o mem_pool
+ * ./mem_pool [threads] [region_mb]
+ *
+ * Hugepages have to be reserved first, or the pool falls back to normal
+ * pages with MADV_HUGEPAGE:
+ * echo 64 > /proc/sys/vm/nr_hugepages
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <thread>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// a sub allocation of the pool, ready to be put into an ibv_sge
+struct rdma_buf
+{
+    void *addr;
+    uint32_t length;
+    uint32_t lkey;
+    uint32_t rkey;
+};
+
+/**
+ * Registered memory pool.
+ * - region: MAP_HUGETLB mmap, registered once by ibv_reg_mr
+ * - slab:   SLAB_SIZE piece of a region, holds chunks of one size class
+ * - chunk:  what alloc returns, free chunks are linked through their first 8 bytes
+ *
+ * Every thread owns a cache with one free list per size class. alloc pops
+ * from it, free pushes to it. Only when the cache is empty or too long it
+ * takes the global lock and moves BATCH chunks at once.
+ */
+class mr_pool
+{
+public:
+    static const uint32_t MIN_SHIFT = 6;  // 64B
+    static const uint32_t MAX_SHIFT = 20; // 1MiB
+    static const int CLASSES = MAX_SHIFT - MIN_SHIFT + 1;
+    static const uint64_t SLAB_SIZE = 2 * 1024 * 1024;
+    static const int BATCH = 32;
+    static const int MAX_CACHED = BATCH * 2;
+
+    mr_pool(struct ibv_pd *pd, uint64_t region_size, int max_regions)
+        : pd_(pd), region_size_(region_size), max_regions_(max_regions)
+    {
+        CHECK(region_size % SLAB_SIZE == 0, "region size must be multiple of 2MiB");
+        regions_.reserve(max_regions);
+        std::lock_guard<std::mutex> lk(mu_);
+        add_region();
+    }
+    // all other threads using the pool must have exited
+    ~mr_pool()
+    {
+        thread_cache &tc = cache();
+        tc.pool = nullptr;
+        for (int c = 0; c < CLASSES; c++)
+        {
+            tc.lists[c] = free_list();
+        }
+        for (auto &r : regions_)
+        {
+            ibv_dereg_mr(r.mr);
+            munmap(r.base, region_size_);
+        }
+    }
+
+    rdma_buf alloc(uint32_t size)
+    {
+        int c = size_class(size);
+        CHECK(c >= 0, "alloc size too large");
+        thread_cache &tc = cache();
+        free_list &fl = tc.lists[c];
+        if (fl.head == nullptr)
+        {
+            refill(c, fl);
+        }
+        chunk *ch = fl.head;
+        fl.head = ch->next;
+        fl.count--;
+        return make_buf(ch, 1u << (c + MIN_SHIFT));
+    }
+
+    // buf must come from alloc, not from lookup
+    void free(const rdma_buf &buf)
+    {
+        int c = size_class(buf.length);
+        thread_cache &tc = cache();
+        free_list &fl = tc.lists[c];
+        chunk *ch = (chunk *)buf.addr;
+        ch->next = fl.head;
+        fl.head = ch;
+        fl.count++;
+        if (fl.count > MAX_CACHED)
+        {
+            flush(c, fl, BATCH);
+        }
+    }
+
+    // {addr, lkey, rkey} of any address inside the pool
+    bool lookup(void *addr, uint32_t length, rdma_buf *out)
+    {
+        const region *r = find_region(addr);
+        if (r == nullptr || (char *)addr + length > r->base + region_size_)
+        {
+            return false;
+        }
+        out->addr = addr;
+        out->length = length;
+        out->lkey = r->mr->lkey;
+        out->rkey = r->mr->rkey;
+        return true;
+    }
+
+    void stat(uint64_t *regions, uint64_t *slabs, uint64_t *refills, uint64_t *flushes)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        *regions = regions_.size();
+        *slabs = slabs_;
+        *refills = refills_;
+        *flushes = flushes_;
+    }
+
+private:
+    struct chunk
+    {
+        chunk *next;
+    };
+    struct free_list
+    {
+        chunk *head = nullptr;
+        int count = 0;
+    };
+    struct region
+    {
+        char *base;
+        struct ibv_mr *mr;
+        uint64_t used; // bump pointer for slabs
+        bool huge;
+    };
+    struct thread_cache
+    {
+        mr_pool *pool = nullptr;
+        free_list lists[CLASSES];
+        ~thread_cache()
+        {
+            if (pool == nullptr)
+            {
+                return;
+            }
+            for (int c = 0; c < CLASSES; c++)
+            {
+                pool->flush(c, lists[c], lists[c].count);
+            }
+        }
+    };
+
+    // one pool per process, the cache of a thread belongs to the first pool it touches
+    thread_cache &cache()
+    {
+        static thread_local thread_cache tc;
+        if (tc.pool == nullptr)
+        {
+            tc.pool = this;
+        }
+        return tc;
+    }
+
+    static int size_class(uint32_t size)
+    {
+        if (size <= (1u << MIN_SHIFT))
+        {
+            return 0;
+        }
+        int shift = 32 - __builtin_clz(size - 1);
+        if (shift > (int)MAX_SHIFT)
+        {
+            return -1;
+        }
+        return shift - MIN_SHIFT;
+    }
+
+    rdma_buf make_buf(chunk *ch, uint32_t length)
+    {
+        const region *r = find_region(ch);
+        rdma_buf buf;
+        buf.addr = ch;
+        buf.length = length;
+        buf.lkey = r->mr->lkey;
+        buf.rkey = r->mr->rkey;
+        return buf;
+    }
+
+    // regions are few and never removed, a linear scan is cheap enough
+    const region *find_region(void *addr)
+    {
+        const int n = nregions_.load(std::memory_order_acquire);
+        for (int i = 0; i < n; i++)
+        {
+            const region &r = regions_[i];
+            if ((char *)addr >= r.base && (char *)addr < r.base + region_size_)
+            {
+                return &r;
+            }
+        }
+        return nullptr;
+    }
+
+    // called with mu_ held
+    bool add_region()
+    {
+        if ((int)regions_.size() >= max_regions_)
+        {
+            return false;
+        }
+        region r;
+        r.used = 0;
+        r.huge = true;
+        void *p = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            // no hugepage reserved, let THP back it if possible
+            r.huge = false;
+            p = mmap(nullptr, region_size_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            CHECK(p != MAP_FAILED, "mmap region fail");
+            madvise(p, region_size_, MADV_HUGEPAGE);
+        }
+        r.base = (char *)p;
+        r.mr = ibv_reg_mr(pd_, r.base, region_size_,
+                          IBV_ACCESS_LOCAL_WRITE |
+                              IBV_ACCESS_REMOTE_WRITE |
+                              IBV_ACCESS_REMOTE_READ);
+        CHECK(r.mr, "ibv_reg_mr region fail");
+        printf("pool: region %zu, addr=%p, size=%lu, hugepage=%d, lkey=%u, rkey=%u\n",
+               regions_.size(), r.base, region_size_, r.huge, r.mr->lkey, r.mr->rkey);
+        regions_.push_back(r);
+        nregions_.store(regions_.size(), std::memory_order_release);
+        return true;
+    }
+
+    // carve a new slab into the global list of class c, called with mu_ held
+    bool grow(int c)
+    {
+        region *r = &regions_.back();
+        if (r->used + SLAB_SIZE > region_size_)
+        {
+            if (!add_region())
+            {
+                return false;
+            }
+            r = &regions_.back();
+        }
+        char *slab = r->base + r->used;
+        r->used += SLAB_SIZE;
+        slabs_++;
+        const uint64_t size = 1ull << (c + MIN_SHIFT);
+        free_list &g = global_[c];
+        for (uint64_t off = 0; off + size <= SLAB_SIZE; off += size)
+        {
+            chunk *ch = (chunk *)(slab + off);
+            ch->next = g.head;
+            g.head = ch;
+            g.count++;
+        }
+        return true;
+    }
+
+    void refill(int c, free_list &fl)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        free_list &g = global_[c];
+        if (g.head == nullptr)
+        {
+            CHECK(grow(c), "memory pool exhausted");
+        }
+        refills_++;
+        for (int i = 0; i < BATCH && g.head; i++)
+        {
+            chunk *ch = g.head;
+            g.head = ch->next;
+            g.count--;
+            ch->next = fl.head;
+            fl.head = ch;
+            fl.count++;
+        }
+    }
+
+    void flush(int c, free_list &fl, int n)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        free_list &g = global_[c];
+        flushes_++;
+        for (int i = 0; i < n && fl.head; i++)
+        {
+            chunk *ch = fl.head;
+            fl.head = ch->next;
+            fl.count--;
+            ch->next = g.head;
+            g.head = ch;
+            g.count++;
+        }
+    }
+
+    struct ibv_pd *pd_;
+    const uint64_t region_size_;
+    const int max_regions_;
+    std::mutex mu_;
+    // reserved up front and never reallocated, so find_region can read it without the lock
+    std::vector<region> regions_;
+    std::atomic<int> nregions_{0};
+    free_list global_[CLASSES];
+    uint64_t slabs_ = 0;
+    uint64_t refills_ = 0;
+    uint64_t flushes_ = 0;
+};
+
+int main(int argc, char *argv[])
+{
+    const int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    const uint64_t region_mb = argc > 2 ? strtoull(argv[2], nullptr, 10) : 64;
+    CHECK(nthreads > 0 && region_mb > 0 && region_mb % 2 == 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+
+    // the old way: malloc + ibv_reg_mr for every buffer
+    const int n = 256;
+    const int size = 4096;
+    uint64_t start = now_ns();
+    std::vector<struct ibv_mr *> mrs;
+    for (int i = 0; i < n; i++)
+    {
+        char *buf = (char *)malloc(size);
+        CHECK(buf, "malloc fail");
+        struct ibv_mr *mr = ibv_reg_mr(pd, buf, size,
+                                       IBV_ACCESS_LOCAL_WRITE |
+                                           IBV_ACCESS_REMOTE_WRITE |
+                                           IBV_ACCESS_REMOTE_READ);
+        CHECK(mr, "ibv_reg_mr fail");
+        mrs.push_back(mr);
+    }
+    for (auto mr : mrs)
+    {
+        void *addr = mr->addr;
+        ibv_dereg_mr(mr);
+        free(addr);
+    }
+    printf("malloc+ibv_reg_mr+ibv_dereg_mr: %.1f ns/buffer\n", (double)(now_ns() - start) / n);
+
+    {
+        mr_pool pool(pd, region_mb * 1024 * 1024, 16);
+
+        rdma_buf b = pool.alloc(100);
+        printf("alloc(100): addr=%p, length=%u, lkey=%u, rkey=%u\n", b.addr, b.length, b.lkey, b.rkey);
+        rdma_buf sub;
+        CHECK(pool.lookup((char *)b.addr + 16, 32, &sub), "lookup fail");
+        printf("lookup(addr+16): addr=%p, length=%u, lkey=%u, rkey=%u\n",
+               sub.addr, sub.length, sub.lkey, sub.rkey);
+        pool.free(b);
+
+        // every thread keeps a window of live buffers of mixed sizes
+        const int rounds = 1000000;
+        const int window = 64;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < nthreads; t++)
+        {
+            threads.emplace_back([&pool, t]() {
+                std::vector<rdma_buf> live(window);
+                uint64_t seed = t + 1;
+                for (int i = 0; i < window; i++)
+                {
+                    live[i] = pool.alloc(64);
+                }
+                uint64_t start = now_ns();
+                for (int i = 0; i < rounds; i++)
+                {
+                    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+                    int k = (seed >> 33) % window;
+                    pool.free(live[k]);
+                    live[k] = pool.alloc(64u << ((seed >> 40) % 8));
+                }
+                uint64_t cost = now_ns() - start;
+                for (auto &b : live)
+                {
+                    pool.free(b);
+                }
+                printf("thread %d: %.1f ns per alloc+free\n", t, (double)cost / rounds);
+            });
+        }
+        for (auto &t : threads)
+        {
+            t.join();
+        }
+        uint64_t regions, slabs, refills, flushes;
+        pool.stat(&regions, &slabs, &refills, &flushes);
+        printf("pool: regions=%lu, slabs=%lu, refills=%lu, flushes=%lu\n",
+               regions, slabs, refills, flushes);
+    }
+
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
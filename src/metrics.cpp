@@ -0,0 +1,800 @@
+/**
+ * Example of hot path metrics for qps and cqs. If you have no RDMA hardware,
+ * see https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * Every qp has a send and a recv queue_metrics: wrs posted, wrs completed,
+ * bytes, errors by ibv_wc_status, the in-flight depth and its high water
+ * mark, and an HDR style histogram of the post to completion latency,
+ * matched by wr_id. Every cq counts polls, empty polls and cqes.
+ *
+ * A metric is only updated by the thread owning the qp/cq, so a counter
+ * is a relaxed load + store on an atomic, a plain mov, no locked
+ * instruction and no cache line ping-pong. An exporter thread copies them
+ * into a POSIX shared memory snapshot under a seqlock, together with the
+ * port counters from sysfs. A sidecar (./metrics -r pid) maps the snapshot
+ * read-only and retries on a torn read, the data path never waits.
+ *
+ * The demo drives SENDs over `qps` loopback qp pairs for `seconds`,
+ * publishing every `interval_ms`, then prints the last snapshot.
+ *
+ * g++ -O2 metrics.cpp -libverbs -lpthread -lrt -o metrics
+ * ./metrics [-q qps] [-d depth] [-s size] [-T seconds] [-i interval_ms]
+ * ./metrics -r pid
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+
+#define SUB_BITS 4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_BUCKETS (64 * SUB_BUCKETS)
+#define WC_STATUS_MAX 32
+#define MAX_QPS 64
+#define MAX_CQS 8
+#define MAX_PORT_COUNTERS 64
+#define SHM_MAGIC 0x524d4554 // RMET
+#define SHM_VERSION 1
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// written by one thread, read by any
+struct counter
+{
+    std::atomic<uint64_t> v{0};
+    void add(uint64_t n) { v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void set_max(uint64_t n)
+    {
+        if (n > v.load(std::memory_order_relaxed))
+        {
+            v.store(n, std::memory_order_relaxed);
+        }
+    }
+    uint64_t get() const { return v.load(std::memory_order_relaxed); }
+};
+
+// log-linear buckets, 1/16 relative precision
+static int hist_index(uint64_t v)
+{
+    if (v < SUB_BUCKETS)
+    {
+        return v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int sub = (v >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS + sub;
+}
+// the largest value falls into bucket i
+static uint64_t hist_upper(int i)
+{
+    if (i < SUB_BUCKETS)
+    {
+        return i;
+    }
+    int msb = i / SUB_BUCKETS + SUB_BITS - 1;
+    uint64_t sub = i % SUB_BUCKETS;
+    uint64_t low = (1ull << msb) | (sub << (msb - SUB_BITS));
+    return low + (1ull << (msb - SUB_BITS)) - 1;
+}
+static uint64_t hist_percentile(const uint64_t *counts, double p)
+{
+    uint64_t total = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        total += counts[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = std::min<uint64_t>(p / 100.0 * total, total - 1);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen > rank)
+        {
+            return hist_upper(i);
+        }
+    }
+    return hist_upper(HIST_BUCKETS - 1);
+}
+
+/**
+ * Metrics of a send or a recv queue. post_ts[wr_id & mask] holds the post
+ * time, so wr_ids in flight must differ in their low bits, e.g. a sequence
+ * number or a slot index with mask >= depth. A completion may retire more
+ * than one wr when unsignaled wrs are used, pass that number to on_wc.
+ */
+struct queue_metrics
+{
+    counter posted;
+    counter completed;
+    counter bytes;
+    counter inflight_max;
+    counter errors[WC_STATUS_MAX];
+    counter lat_max;
+    counter lat[HIST_BUCKETS]; // ns
+    std::vector<uint64_t> post_ts;
+    uint64_t mask;
+
+    explicit queue_metrics(int depth)
+    {
+        uint64_t n = 1;
+        while (n < (uint64_t)depth)
+        {
+            n <<= 1;
+        }
+        post_ts.assign(n, 0);
+        mask = n - 1;
+    }
+
+    uint64_t inflight() const { return posted.get() - completed.get(); }
+
+    void on_post(uint64_t wr_id, uint64_t now)
+    {
+        post_ts[wr_id & mask] = now;
+        posted.add(1);
+        inflight_max.set_max(inflight());
+    }
+
+    void on_wc(const struct ibv_wc &wc, uint64_t now, uint32_t bytes, int retired = 1)
+    {
+        completed.add(retired);
+        if (wc.status != IBV_WC_SUCCESS)
+        {
+            errors[std::min<int>(wc.status, WC_STATUS_MAX - 1)].add(1);
+            return;
+        }
+        this->bytes.add(bytes);
+        uint64_t ns = now - post_ts[wc.wr_id & mask];
+        lat[hist_index(ns)].add(1);
+        lat_max.set_max(ns);
+    }
+};
+
+struct qp_metrics
+{
+    uint32_t qpn;
+    queue_metrics sq;
+    queue_metrics rq;
+    qp_metrics(uint32_t qpn, int sq_depth, int rq_depth) : qpn(qpn), sq(sq_depth), rq(rq_depth) {}
+};
+
+struct cq_metrics
+{
+    counter polls;
+    counter empty_polls;
+    counter cqes;
+    counter max_batch;
+
+    void on_poll(int n)
+    {
+        polls.add(1);
+        if (n == 0)
+        {
+            empty_polls.add(1);
+            return;
+        }
+        cqes.add(n);
+        max_batch.set_max(n);
+    }
+};
+
+// shared memory layout, plain integers only
+struct shm_queue
+{
+    uint64_t posted, completed, bytes, inflight, inflight_max, lat_max;
+    uint64_t errors[WC_STATUS_MAX];
+    uint64_t lat[HIST_BUCKETS];
+};
+struct shm_qp
+{
+    uint32_t qpn;
+    uint32_t pad;
+    shm_queue sq, rq;
+};
+struct shm_cq
+{
+    uint64_t polls, empty_polls, cqes, max_batch;
+};
+struct shm_port_counter
+{
+    char name[48]; // e.g. counters/port_xmit_data
+    int64_t value;
+};
+struct metrics_shm
+{
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint64_t> seq; // odd while the exporter writes
+    uint64_t ts_ns;
+    uint32_t num_qps, num_cqs, num_port_counters, pad;
+    shm_qp qps[MAX_QPS];
+    shm_cq cqs[MAX_CQS];
+    shm_port_counter port[MAX_PORT_COUNTERS];
+};
+
+static std::string shm_name(int pid)
+{
+    return "/rdma_metrics." + std::to_string(pid);
+}
+
+// every file of ports/<port>/counters and ports/<port>/hw_counters
+std::vector<std::string> list_port_counters(const std::string &dev, int port)
+{
+    std::vector<std::string> names;
+    const std::string base = "/sys/class/infiniband/" + dev + "/ports/" + std::to_string(port) + "/";
+    for (const char *dir : {"counters", "hw_counters"})
+    {
+        DIR *d = opendir((base + dir).c_str());
+        if (!d)
+        {
+            continue;
+        }
+        struct dirent *e;
+        while ((e = readdir(d)) != nullptr && names.size() < MAX_PORT_COUNTERS)
+        {
+            if (e->d_name[0] == '.' || strcmp(e->d_name, "lifespan") == 0)
+            {
+                continue;
+            }
+            std::string name = std::string(dir) + "/" + e->d_name;
+            if (name.size() < sizeof(shm_port_counter::name))
+            {
+                names.push_back(name);
+            }
+        }
+        closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+/**
+ * Owns the metrics and the shared memory snapshot. add_qp/add_cq are
+ * called before the data path starts, publish() from the exporter thread.
+ */
+class metrics_registry
+{
+public:
+    metrics_registry(const std::string &dev, int port) : dev_(dev), port_(port)
+    {
+        name_ = shm_name(getpid());
+        int fd = shm_open(name_.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        CHECK(fd >= 0, "shm_open fail");
+        int ret = ftruncate(fd, sizeof(metrics_shm));
+        CHECK(ret == 0, "ftruncate fail");
+        shm_ = (metrics_shm *)mmap(nullptr, sizeof(metrics_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        CHECK(shm_ != MAP_FAILED, "mmap fail");
+        close(fd);
+        shm_->magic = SHM_MAGIC;
+        shm_->version = SHM_VERSION;
+        counters_ = list_port_counters(dev_, port_);
+    }
+
+    ~metrics_registry()
+    {
+        munmap(shm_, sizeof(metrics_shm));
+        shm_unlink(name_.c_str());
+    }
+
+    qp_metrics *add_qp(uint32_t qpn, int sq_depth, int rq_depth)
+    {
+        CHECK(qps_.size() < MAX_QPS, "too many qps");
+        qps_.emplace_back(new qp_metrics(qpn, sq_depth, rq_depth));
+        return qps_.back().get();
+    }
+
+    cq_metrics *add_cq()
+    {
+        CHECK(cqs_.size() < MAX_CQS, "too many cqs");
+        cqs_.emplace_back(new cq_metrics());
+        return cqs_.back().get();
+    }
+
+    const std::string &name() const { return name_; }
+
+    void publish()
+    {
+        // sample sysfs outside of the write section, it is the slow part
+        std::vector<int64_t> values(counters_.size(), -1);
+        const std::string base = "/sys/class/infiniband/" + dev_ + "/ports/" + std::to_string(port_) + "/";
+        for (size_t i = 0; i < counters_.size(); i++)
+        {
+            FILE *f = fopen((base + counters_[i]).c_str(), "r");
+            if (f)
+            {
+                long long v;
+                if (fscanf(f, "%lld", &v) == 1)
+                {
+                    values[i] = v;
+                }
+                fclose(f);
+            }
+        }
+
+        uint64_t seq = shm_->seq.load(std::memory_order_relaxed);
+        shm_->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        shm_->ts_ns = now_ns();
+        shm_->num_qps = qps_.size();
+        for (size_t i = 0; i < qps_.size(); i++)
+        {
+            shm_->qps[i].qpn = qps_[i]->qpn;
+            copy(qps_[i]->sq, shm_->qps[i].sq);
+            copy(qps_[i]->rq, shm_->qps[i].rq);
+        }
+        shm_->num_cqs = cqs_.size();
+        for (size_t i = 0; i < cqs_.size(); i++)
+        {
+            shm_->cqs[i].polls = cqs_[i]->polls.get();
+            shm_->cqs[i].empty_polls = cqs_[i]->empty_polls.get();
+            shm_->cqs[i].cqes = cqs_[i]->cqes.get();
+            shm_->cqs[i].max_batch = cqs_[i]->max_batch.get();
+        }
+        shm_->num_port_counters = counters_.size();
+        for (size_t i = 0; i < counters_.size(); i++)
+        {
+            snprintf(shm_->port[i].name, sizeof(shm_->port[i].name), "%s", counters_[i].c_str());
+            shm_->port[i].value = values[i];
+        }
+        shm_->seq.store(seq + 2, std::memory_order_release);
+    }
+
+private:
+    static void copy(const queue_metrics &m, shm_queue &s)
+    {
+        s.posted = m.posted.get();
+        s.completed = m.completed.get();
+        s.bytes = m.bytes.get();
+        s.inflight = s.posted - std::min(s.posted, s.completed);
+        s.inflight_max = m.inflight_max.get();
+        s.lat_max = m.lat_max.get();
+        for (int i = 0; i < WC_STATUS_MAX; i++)
+        {
+            s.errors[i] = m.errors[i].get();
+        }
+        for (int i = 0; i < HIST_BUCKETS; i++)
+        {
+            s.lat[i] = m.lat[i].get();
+        }
+    }
+
+    std::string dev_;
+    int port_;
+    std::string name_;
+    metrics_shm *shm_;
+    std::vector<std::string> counters_;
+    std::vector<std::unique_ptr<qp_metrics>> qps_;
+    std::vector<std::unique_ptr<cq_metrics>> cqs_;
+};
+
+// consistent copy of a snapshot, retry while the exporter is writing
+bool read_snapshot(const metrics_shm *shm, metrics_shm *out)
+{
+    for (int tries = 0; tries < 1000; tries++)
+    {
+        uint64_t s1 = shm->seq.load(std::memory_order_acquire);
+        if (s1 & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy((void *)out, (const void *)shm, sizeof(metrics_shm));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (shm->seq.load(std::memory_order_relaxed) == s1)
+        {
+            return out->magic == SHM_MAGIC && out->version == SHM_VERSION;
+        }
+    }
+    return false;
+}
+
+void print_queue(const char *name, const shm_queue &q)
+{
+    printf("  %s: posted=%lu, completed=%lu, bytes=%lu, inflight=%lu, inflight_max=%lu, "
+           "lat_ns p50=%lu p99=%lu p999=%lu max=%lu\n",
+           name, q.posted, q.completed, q.bytes, q.inflight, q.inflight_max,
+           hist_percentile(q.lat, 50), hist_percentile(q.lat, 99), hist_percentile(q.lat, 99.9), q.lat_max);
+    for (int i = 0; i < WC_STATUS_MAX; i++)
+    {
+        if (q.errors[i])
+        {
+            printf("    errors[%s]=%lu\n", ibv_wc_status_str((enum ibv_wc_status)i), q.errors[i]);
+        }
+    }
+}
+
+void print_snapshot(const metrics_shm &m)
+{
+    printf("snapshot at %lu ns, seq=%lu\n", m.ts_ns, m.seq.load());
+    for (uint32_t i = 0; i < m.num_qps; i++)
+    {
+        printf("qp %u\n", m.qps[i].qpn);
+        print_queue("sq", m.qps[i].sq);
+        print_queue("rq", m.qps[i].rq);
+    }
+    for (uint32_t i = 0; i < m.num_cqs; i++)
+    {
+        const shm_cq &c = m.cqs[i];
+        printf("cq %u: polls=%lu, empty_polls=%lu, cqes=%lu, avg_batch=%.2f, max_batch=%lu\n",
+               i, c.polls, c.empty_polls, c.cqes,
+               c.polls > c.empty_polls ? (double)c.cqes / (c.polls - c.empty_polls) : 0.0, c.max_batch);
+    }
+    for (uint32_t i = 0; i < m.num_port_counters; i++)
+    {
+        printf("port %s=%ld\n", m.port[i].name, m.port[i].value);
+    }
+}
+
+int dump_snapshot(const std::string &name)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    CHECK(fd >= 0, "shm_open fail");
+    const metrics_shm *shm = (const metrics_shm *)mmap(nullptr, sizeof(metrics_shm), PROT_READ, MAP_SHARED, fd, 0);
+    CHECK(shm != MAP_FAILED, "mmap fail");
+    close(fd);
+    metrics_shm *snap = (metrics_shm *)malloc(sizeof(metrics_shm));
+    CHECK(snap, "malloc fail");
+    bool ok = read_snapshot(shm, snap);
+    CHECK(ok, "read_snapshot fail");
+    print_snapshot(*snap);
+    free(snap);
+    munmap((void *)shm, sizeof(metrics_shm));
+    return 0;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int io_depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    init_attr.cap.max_recv_wr = io_depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+// a loopback pair, SENDs go from sqp to rqp
+struct pair
+{
+    struct ibv_qp *sqp;
+    struct ibv_qp *rqp;
+    qp_metrics *sm;
+    qp_metrics *rm;
+    uint64_t seq = 0;
+};
+
+void post_send(pair &p, char *buf, uint32_t size, uint32_t lkey)
+{
+    struct ibv_sge sge;
+    sge.addr = (uint64_t)buf;
+    sge.length = size;
+    sge.lkey = lkey;
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = p.seq++;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_SEND;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    struct ibv_send_wr *bad_wr = nullptr;
+    p.sm->sq.on_post(wr.wr_id, now_ns());
+    int ret = ibv_post_send(p.sqp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_send fail");
+}
+
+void post_recv(pair &p, uint64_t slot, char *buf, uint32_t size, uint32_t lkey)
+{
+    struct ibv_sge sge;
+    sge.addr = (uint64_t)buf;
+    sge.length = size;
+    sge.lkey = lkey;
+    struct ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = slot;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    struct ibv_recv_wr *bad_wr = nullptr;
+    p.rm->rq.on_post(slot, now_ns());
+    int ret = ibv_post_recv(p.rqp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_recv fail");
+}
+
+int main(int argc, char *argv[])
+{
+    int num_pairs = 4;
+    int depth = 32;
+    uint32_t size = 4096;
+    double seconds = 3;
+    int interval_ms = 100;
+    int sidecar_pid = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "q:d:s:T:i:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            num_pairs = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'T':
+            seconds = atof(optarg);
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'r':
+            sidecar_pid = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-q qps] [-d depth] [-s size] [-T seconds] [-i interval_ms] | -r pid\n", argv[0]);
+            return -1;
+        }
+    }
+    if (sidecar_pid > 0)
+    {
+        return dump_snapshot(shm_name(sidecar_pid));
+    }
+    CHECK(num_pairs > 0 && num_pairs * 2 <= MAX_QPS && depth > 0 && size > 0 && interval_ms > 0,
+          "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    const std::string dev_name = ibv_get_device_name(devs[0]);
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    struct ibv_cq *cq = ibv_create_cq(ctx, num_pairs * depth * 2, nullptr, nullptr, 0);
+    CHECK(cq, "ibv_create_cq fail");
+
+    metrics_registry reg(dev_name, PORT_NUM);
+    cq_metrics *cm = reg.add_cq();
+    printf("metrics published to /dev/shm%s, run `%s -r %d` to read them\n",
+           reg.name().c_str(), argv[0], getpid());
+
+    // per pair: depth send slots followed by depth recv slots
+    const uint64_t buf_size = (uint64_t)num_pairs * depth * 2 * size;
+    char *buf = (char *)malloc(buf_size);
+    CHECK(buf, "malloc fail");
+    memset(buf, 'm', buf_size);
+    struct ibv_mr *mr = ibv_reg_mr(pd, buf, buf_size, IBV_ACCESS_LOCAL_WRITE);
+    CHECK(mr, "ibv_reg_mr fail");
+    auto send_slot = [&](int p, uint64_t i) { return buf + ((uint64_t)p * depth * 2 + i % depth) * size; };
+    auto recv_slot = [&](int p, uint64_t i) { return buf + ((uint64_t)p * depth * 2 + depth + i) * size; };
+
+    std::vector<pair> pairs(num_pairs);
+    for (int p = 0; p < num_pairs; p++)
+    {
+        pair &pr = pairs[p];
+        pr.sqp = create_qp(pd, cq, depth);
+        pr.rqp = create_qp(pd, cq, depth);
+        init_qp(pr.sqp);
+        init_qp(pr.rqp);
+        modify_to_rtr(pr.sqp, path, pr.rqp->qp_num, 0, port_attr.lid, gid);
+        modify_to_rtr(pr.rqp, path, pr.sqp->qp_num, 0, port_attr.lid, gid);
+        modify_to_rts(pr.sqp, 0);
+        modify_to_rts(pr.rqp, 0);
+        pr.sm = reg.add_qp(pr.sqp->qp_num, depth, 1);
+        pr.rm = reg.add_qp(pr.rqp->qp_num, 1, depth);
+        for (int i = 0; i < depth; i++)
+        {
+            post_recv(pr, i, recv_slot(p, i), size, mr->lkey);
+        }
+    }
+
+    std::atomic<bool> stop{false};
+    std::thread exporter([&]() {
+        while (!stop.load())
+        {
+            reg.publish();
+            usleep(interval_ms * 1000);
+        }
+        reg.publish();
+    });
+
+    // the data path: keep depth sends in flight on every pair
+    std::vector<struct ibv_wc> wcs(64);
+    std::unordered_map<uint32_t, int> qp_to_pair;
+    for (int p = 0; p < num_pairs; p++)
+    {
+        qp_to_pair[pairs[p].sqp->qp_num] = p;
+        qp_to_pair[pairs[p].rqp->qp_num] = p;
+        for (int i = 0; i < depth; i++)
+        {
+            post_send(pairs[p], send_slot(p, pairs[p].seq), size, mr->lkey);
+        }
+    }
+    const uint64_t deadline = now_ns() + (uint64_t)(seconds * 1e9);
+    uint64_t sent = 0;
+    while (now_ns() < deadline)
+    {
+        int n = ibv_poll_cq(cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        cm->on_poll(n);
+        const uint64_t now = now_ns();
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs[i];
+            pair &pr = pairs[qp_to_pair[wc.qp_num]];
+            const int p = &pr - pairs.data();
+            if (wc.qp_num == pr.sqp->qp_num)
+            {
+                pr.sm->sq.on_wc(wc, now, size);
+                CHECK(wc.status == IBV_WC_SUCCESS, "send fail");
+                sent++;
+                post_send(pr, send_slot(p, pr.seq), size, mr->lkey);
+            }
+            else
+            {
+                pr.rm->rq.on_wc(wc, now, wc.byte_len);
+                CHECK(wc.status == IBV_WC_SUCCESS, "recv fail");
+                post_recv(pr, wc.wr_id, recv_slot(p, wc.wr_id), size, mr->lkey);
+            }
+        }
+    }
+    stop = true;
+    exporter.join();
+    printf("sent %lu msgs in %.1f s, %.0f msgs/s\n", sent, seconds, sent / seconds);
+
+    // read back the way a sidecar would
+    dump_snapshot(reg.name());
+
+    // the wrs still in flight are flushed when the qps are destroyed
+    for (auto &pr : pairs)
+    {
+        ibv_destroy_qp(pr.sqp);
+        ibv_destroy_qp(pr.rqp);
+    }
+    ibv_destroy_cq(cq);
+    ibv_dereg_mr(mr);
+    free(buf);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
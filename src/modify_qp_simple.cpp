@@ -6,10 +6,14 @@
  * g++ modify_qp_simple.cpp -libverbs -o modify_qp_simple
  *
  * machine or comand line A:
- * ./modify_qp_simple
+ * ./modify_qp_simple [local_ip] [io_depth]
  *
  * machine or comand line B:
- * ./modify_qp_simple
+ * ./modify_qp_simple [local_ip] [io_depth]
+ *
+ * local_ip selects the RoCEv2 gid bound to that address, by default the
+ * first RoCEv2 gid with an IPv4 address is used. io_depth defaults to 256
+ * and is capped by the device max_qp_wr.
  *
  * author: lihao <hooleeucas@163.com>
  * 
@@ -20,7 +24,10 @@
 #include <infiniband/verbs.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
 #include <vector>
+#include <algorithm>
 #include <sstream>
 #include <time.h>
 #include <iostream>
@@ -44,6 +51,8 @@ struct meta
     uint32_t qpn;
     uint32_t psn;
     uint32_t lid; // 主要用于ib，RoCE v2中该字段始终为0
+    uint32_t mtu;     // active mtu of the port, enum ibv_mtu
+    uint32_t rd_atom; // max_dest_rd_atomic of the qp
     uint8_t gid[16];
 
     // 为了方便演示，将meta序列化成字符串
@@ -51,7 +60,8 @@ struct meta
     {
         const int len = 256;
         char buf[len];
-        int n = sprintf(buf, "qpn=%u, spn=%u, lid=%u", qpn, psn, lid);
+        int n = sprintf(buf, "qpn=%u, spn=%u, lid=%u, mtu=%u, rd_atom=%u",
+                        qpn, psn, lid, mtu, rd_atom);
         for (int i = 0; i < 16; i += 2)
         {
             if (i == 0)
@@ -73,8 +83,8 @@ struct meta
         int offset = 0;
         int read;
         uint32_t m, n;
-        sscanf(str.c_str(), "qpn=%u, spn=%u, lid=%u, gid=%02x%02x%n",
-               &i.qpn, &i.psn, &i.lid, &m, &n, &read);
+        sscanf(str.c_str(), "qpn=%u, spn=%u, lid=%u, mtu=%u, rd_atom=%u, gid=%02x%02x%n",
+               &i.qpn, &i.psn, &i.lid, &i.mtu, &i.rd_atom, &m, &n, &read);
         i.gid[0] = m;
         i.gid[1] = n;
         offset += read;
@@ -89,6 +99,92 @@ struct meta
     }
 };
 
+// qp attributes derived from the port, the device and the gid table
+struct qp_params
+{
+    enum ibv_mtu mtu;       // path mtu
+    bool is_global;         // RoCE always needs a GRH
+    int gid_index;          // sgid_index
+    int max_rd_atomic;      // outstanding RDMA READ/atomic as requester
+    int max_dest_rd_atomic; // outstanding RDMA READ/atomic as responder
+    int io_depth;           // max_send_wr and max_recv_wr
+    int max_sge;
+    int max_cqe;
+};
+
+static int mtu_to_num(enum ibv_mtu mtu)
+{
+    return 128 << mtu;
+}
+
+/**
+ * Probe the qp attributes instead of hardcoding them:
+ * - mtu is the active mtu of the port. A path mtu larger than what the
+ *   link carries makes the HCA drop every full sized packet.
+ * - gid_index is the RoCEv2 gid bound to `ip` if one is given, else the
+ *   first RoCEv2 gid carrying an IPv4 address, else the first RoCEv2 gid.
+ *   On IB gid 0 is used and no GRH is needed.
+ * - max_rd_atomic/max_dest_rd_atomic are what the device supports. With 1
+ *   a qp has a single RDMA READ in flight, one round trip per message.
+ * - io_depth is `want_depth` bounded by max_qp_wr.
+ */
+qp_params probe_qp_params(struct ibv_context *ctx, int port, const char *ip, int want_depth)
+{
+    struct ibv_device_attr dev_attr;
+    int ret = ibv_query_device(ctx, &dev_attr);
+    CHECK(ret == 0, "ibv_query_device fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    qp_params p;
+    p.mtu = port_attr.active_mtu;
+    p.is_global = port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND;
+    p.gid_index = 0;
+    p.max_rd_atomic = std::min(dev_attr.max_qp_init_rd_atom, 255);
+    p.max_dest_rd_atomic = std::min(dev_attr.max_qp_rd_atom, 255);
+    p.io_depth = std::min(want_depth, dev_attr.max_qp_wr);
+    p.max_sge = std::min(30, dev_attr.max_sge);
+    p.max_cqe = dev_attr.max_cqe;
+
+    struct in_addr want_ip;
+    const bool match_ip = ip && inet_pton(AF_INET, ip, &want_ip) == 1;
+    // an IPv4 address is mapped as ::ffff:a.b.c.d
+    static const uint8_t v4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    int best_score = 0;
+    for (int i = 0; p.is_global && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) != 0 ||
+            entry.gid_type != IBV_GID_TYPE_ROCE_V2)
+        {
+            continue; // empty slot or RoCEv1
+        }
+        const bool v4 = memcmp(entry.gid.raw, v4_prefix, sizeof(v4_prefix)) == 0;
+        int score = v4 ? 2 : 1;
+        if (v4 && match_ip && memcmp(entry.gid.raw + 12, &want_ip, 4) == 0)
+        {
+            score = 3;
+        }
+        if (score > best_score)
+        {
+            best_score = score;
+            p.gid_index = i;
+        }
+    }
+    CHECK(!p.is_global || best_score > 0, "no RoCEv2 gid found");
+    if (ip && best_score < 3)
+    {
+        printf("no RoCEv2 gid bound to %s, fall back to gid_index=%d\n", ip, p.gid_index);
+    }
+
+    printf("qp params: link_layer=%s, active_mtu=%d, gid_index=%d, max_rd_atomic=%d, "
+           "max_dest_rd_atomic=%d, io_depth=%d (max_qp_wr=%d), max_sge=%d\n",
+           p.is_global ? "Ethernet" : "InfiniBand", mtu_to_num(p.mtu), p.gid_index,
+           p.max_rd_atomic, p.max_dest_rd_atomic, p.io_depth, dev_attr.max_qp_wr, p.max_sge);
+    return p;
+}
+
 const char *stat_to_str(enum ibv_qp_state s)
 {
     switch (s)
@@ -121,12 +217,12 @@ enum ibv_qp_state get_qp_state(struct ibv_qp *qp)
     CHECK(ret == 0, "ibv_query_qp");
     return attr.qp_state;
 }
-struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq)
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, const qp_params &p)
 {
     struct ibv_qp_init_attr init_attr;
     memset(&init_attr, 0, sizeof(init_attr));
-    const int io_depth = 32;
-    const int max_sge = 30;
+    const int io_depth = p.io_depth;
+    const int max_sge = p.max_sge;
     init_attr.send_cq = cq;
     init_attr.recv_cq = cq;
     init_attr.cap.max_send_wr = io_depth;
@@ -158,21 +254,21 @@ bool init_qp(struct ibv_qp *qp)
     return true;
 }
 
-bool modify_to_rtr(struct ibv_qp *qp, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid r_gid)
+bool modify_to_rtr(struct ibv_qp *qp, const qp_params &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid r_gid)
 {
     struct ibv_qp_attr attr;
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RTR;
-    attr.path_mtu = IBV_MTU_4096;
+    attr.path_mtu = p.mtu;
     attr.dest_qp_num = r_qpn; // 从对端获取
     attr.rq_psn = r_psn;      // 从对端获取
-    attr.max_dest_rd_atomic = 1;
+    attr.max_dest_rd_atomic = p.max_dest_rd_atomic;
     attr.min_rnr_timer = 12;
-    attr.ah_attr.is_global = 1;
+    attr.ah_attr.is_global = p.is_global;
 
-    attr.ah_attr.grh.hop_limit = 1;
+    attr.ah_attr.grh.hop_limit = 64;
     attr.ah_attr.grh.dgid = r_gid; // 从对端获取
-    attr.ah_attr.grh.sgid_index = 1;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
 
     attr.ah_attr.dlid = dlid; // 从对端获取
     attr.ah_attr.sl = 0;
@@ -185,7 +281,7 @@ bool modify_to_rtr(struct ibv_qp *qp, uint32_t r_qpn, uint32_t r_psn, uint16_t d
     CHECK(ret == 0, "ibv_modify_qp RTR fail");
     return true;
 }
-bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+bool modify_to_rts(struct ibv_qp *qp, const qp_params &p, uint32_t my_psn)
 {
     struct ibv_qp_attr attr;
     memset(&attr, 0, sizeof(attr));
@@ -194,7 +290,7 @@ bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
     attr.timeout = 10;
     attr.retry_cnt = 5;
     attr.rnr_retry = 4; /* infinite */
-    attr.max_rd_atomic = 1;
+    attr.max_rd_atomic = p.max_rd_atomic;
     int ret = ibv_modify_qp(qp, &attr,
                             IBV_QP_STATE |
                                 IBV_QP_TIMEOUT |
@@ -223,11 +319,17 @@ int main(int argc, char *argv[])
     struct ibv_comp_channel *ch = ibv_create_comp_channel(ctx);
     CHECK(ch, "ibv_create_comp_channel fail");
 
-    struct ibv_cq *cq = ibv_create_cq(ctx, 128, nullptr, ch, 0);
+    const char *local_ip = argc > 1 ? argv[1] : nullptr;
+    const int want_depth = argc > 2 ? atoi(argv[2]) : 256;
+    CHECK(want_depth > 0, "invalid io_depth");
+    qp_params params = probe_qp_params(ctx, IB_PORT_NUM, local_ip, want_depth);
+
+    struct ibv_cq *cq = ibv_create_cq(ctx, std::min(2 * params.io_depth, params.max_cqe),
+                                      nullptr, ch, 0);
     CHECK(cq, "ibv_create_cq fail");
 
     union ibv_gid gid;
-    int ret = ibv_query_gid(ctx, IB_PORT_NUM, 1, &gid);
+    int ret = ibv_query_gid(ctx, IB_PORT_NUM, params.gid_index, &gid);
     CHECK(ret == 0, "ibv_query_gid fail");
 
     struct ibv_port_attr port_attr;
@@ -235,7 +337,7 @@ int main(int argc, char *argv[])
     CHECK(ret == 0, "ibv_query_port fail");
 
     // create qp
-    struct ibv_qp *qp = create_qp(pd, cq);
+    struct ibv_qp *qp = create_qp(pd, cq, params);
     CHECK(qp, "ibv_create_qp fail");
     printf("qp state is: %s\n", stat_to_str(get_qp_state(qp)));
 
@@ -244,6 +346,8 @@ int main(int argc, char *argv[])
     my_mt.qpn = qp->qp_num;                         // 只有创建qp之后才能拿到qp_num
     my_mt.psn = time(nullptr) & 0xFFFFFFFF;         // 随机生成一个数字做为自己的psn
     my_mt.lid = port_attr.lid;                      // 自己的lid
+    my_mt.mtu = params.mtu;
+    my_mt.rd_atom = params.max_dest_rd_atomic;
     memcpy(my_mt.gid, &gid, sizeof(union ibv_gid)); // 自己的gid
     std::cout << "copy the following data to peer:" << my_mt.to_str() << std::endl;
     // 从控制台读取对方的建联meta信息，生产中可以选择合适的方式完成交换，比如通过TCP
@@ -252,6 +356,13 @@ int main(int argc, char *argv[])
     std::getline(std::cin, s);
     meta peer_mt = meta::from_str(s);
 
+    // both ends must agree on the path mtu, and we must not have more
+    // RDMA READs in flight than the peer's responder resources
+    params.mtu = std::min(params.mtu, (enum ibv_mtu)peer_mt.mtu);
+    params.max_rd_atomic = std::min(params.max_rd_atomic, (int)peer_mt.rd_atom);
+    printf("negotiated: path_mtu=%d, max_rd_atomic=%d\n",
+           mtu_to_num(params.mtu), params.max_rd_atomic);
+
     // init qp
     init_qp(qp);
     printf("qp state is: %s\n", stat_to_str(get_qp_state(qp)));
@@ -259,13 +370,13 @@ int main(int argc, char *argv[])
     // modify to RTR
     union ibv_gid r_gid;
     memcpy(&r_gid, &peer_mt.gid, sizeof(union ibv_gid));
-    modify_to_rtr(qp, peer_mt.qpn, peer_mt.psn, peer_mt.lid, r_gid);
+    modify_to_rtr(qp, params, peer_mt.qpn, peer_mt.psn, peer_mt.lid, r_gid);
     printf("qp state is: %s\n", stat_to_str(get_qp_state(qp)));
 
     // TODO: post recv some RR
 
     // modify to RTS
-    modify_to_rts(qp, my_mt.psn);
+    modify_to_rts(qp, params, my_mt.psn);
     printf("qp state is: %s\n", stat_to_str(get_qp_state(qp)));
 
     // TODO: barrier
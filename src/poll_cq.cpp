@@ -4,7 +4,12 @@
  * see https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
  *
  * g++ poll_cq.cpp -libverbs -lpthread -o poll_cq
- * ./poll_cq
+ * ./poll_cq [batch] [spin_us] [msgs]
+ *
+ * batch:   max number of wc reaped by one ibv_poll_cq call, default 16
+ * spin_us: busy polling budget before arming the cq and sleeping on the
+ *          completion channel, default 50us. 0 means always sleep.
+ * msgs:    number of messages sent from qp1 to qp2, default 64
  *
  * author: lihao <hooleeucas@163.com>
  * 
@@ -15,7 +20,12 @@
 #include <infiniband/verbs.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <string>
 #include <vector>
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <thread>
 
@@ -32,6 +42,264 @@
 
 #define PORT_NUM 1
 
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Adaptive cq poller. Reap up to `batch` wc per ibv_poll_cq call and busy
+ * poll for at most `spin_us`. When the budget runs out the cq is armed by
+ * ibv_req_notify_cq and the thread blocks on the completion channel until
+ * an event arrives, then it goes back to spinning.
+ *
+ * The time spent spinning and sleeping is accounted separately, so the
+ * latency/CPU trade off of a given spin_us can be measured per workload.
+ */
+struct cq_poller
+{
+    struct ibv_cq *cq;
+    struct ibv_comp_channel *ch;
+    int batch;
+    uint64_t spin_ns;
+    std::vector<struct ibv_wc> wcs;
+
+    // statistics
+    uint64_t spin_time_ns = 0;
+    uint64_t sleep_time_ns = 0;
+    uint64_t polls = 0;       // ibv_poll_cq calls
+    uint64_t empty_polls = 0; // ibv_poll_cq calls return 0
+    uint64_t reaped = 0;      // wc reaped
+    uint64_t sleeps = 0;      // times blocked on the channel
+
+    cq_poller(struct ibv_cq *cq, struct ibv_comp_channel *ch, int batch, uint64_t spin_us)
+        : cq(cq), ch(ch), batch(batch), spin_ns(spin_us * 1000), wcs(batch)
+    {
+    }
+
+    int try_poll()
+    {
+        int n = ibv_poll_cq(cq, batch, wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        polls++;
+        if (n == 0)
+        {
+            empty_polls++;
+        }
+        reaped += n;
+        return n;
+    }
+
+    // block until at least one wc is available, return the number of wc in wcs
+    int poll()
+    {
+        while (1)
+        {
+            uint64_t start = now_ns();
+            int n = 0;
+            do
+            {
+                n = try_poll();
+            } while (n == 0 && now_ns() - start < spin_ns);
+            spin_time_ns += now_ns() - start;
+            if (n > 0)
+            {
+                return n;
+            }
+
+            // arm first, then poll again, or a wc arrived between the last
+            // poll and the arm would never generate an event
+            int ret = ibv_req_notify_cq(cq, 0);
+            CHECK(ret == 0, "ibv_req_notify_cq fail");
+            n = try_poll();
+            if (n > 0)
+            {
+                // the cq is armed anyway, the pending event is consumed by
+                // the next sleep and costs one extra empty loop
+                return n;
+            }
+
+            start = now_ns();
+            struct ibv_cq *ev_cq;
+            void *ev_ctx;
+            ret = ibv_get_cq_event(ch, &ev_cq, &ev_ctx);
+            CHECK(ret == 0, "ibv_get_cq_event fail");
+            ibv_ack_cq_events(ev_cq, 1);
+            sleep_time_ns += now_ns() - start;
+            sleeps++;
+        }
+    }
+
+    void report() const
+    {
+        printf("poller: batch=%d, spin_us=%lu, polls=%lu, empty_polls=%lu, reaped=%lu, "
+               "avg_wc_per_poll=%.2f, sleeps=%lu, spin_us_total=%lu, sleep_us_total=%lu\n",
+               batch, spin_ns / 1000, polls, empty_polls, reaped,
+               polls ? (double)reaped / polls : 0.0, sleeps,
+               spin_time_ns / 1000, sleep_time_ns / 1000);
+    }
+};
+
+/**
+ * Receive ring. `slots` buffers of `slot_size` bytes are carved out of one
+ * registered region and all posted up front, slot i uses wr_id i. A recv wc
+ * is turned into a borrowed view of exactly wc.byte_len bytes of its slot,
+ * nothing is copied. Once the handler is done it releases the wr_id, the
+ * slot is reposted with other released slots as one chained ibv_post_recv,
+ * either when `batch` of them are pending or when fewer than `batch` recvs
+ * are still posted, so the peer never runs into RNR because of batching.
+ */
+struct recv_view
+{
+    uint64_t wr_id;
+    const char *data;
+    uint32_t len;
+};
+
+struct recv_ring
+{
+    struct ibv_qp *qp;
+    int slots;
+    uint32_t slot_size;
+    int batch;
+    char *buf;
+    struct ibv_mr *mr;
+    std::vector<struct ibv_recv_wr> wrs;
+    std::vector<struct ibv_sge> sges;
+    std::vector<uint64_t> pending; // released, not yet reposted
+    int posted = 0;
+
+    // statistics
+    uint64_t post_calls = 0; // ibv_post_recv calls
+    uint64_t reposted = 0;   // recv wr reposted
+
+    recv_ring(struct ibv_pd *pd, struct ibv_qp *qp, int slots, uint32_t slot_size, int batch)
+        : qp(qp), slots(slots), slot_size(slot_size), batch(batch), wrs(slots), sges(slots)
+    {
+        buf = (char *)malloc((size_t)slots * slot_size);
+        CHECK(buf, "malloc recv ring fail");
+        mr = ibv_reg_mr(pd, buf, (size_t)slots * slot_size, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(mr, "ibv_reg_mr recv ring fail");
+        pending.reserve(slots);
+        for (int i = 0; i < slots; i++)
+        {
+            pending.push_back(i);
+        }
+        flush();
+        post_calls = reposted = 0;
+    }
+
+    ~recv_ring()
+    {
+        ibv_dereg_mr(mr);
+        free(buf);
+    }
+
+    recv_view on_wc(const struct ibv_wc &wc)
+    {
+        posted--;
+        return {wc.wr_id, buf + wc.wr_id * slot_size, wc.byte_len};
+    }
+
+    void release(uint64_t wr_id)
+    {
+        pending.push_back(wr_id);
+        if ((int)pending.size() >= batch || posted < batch)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if (pending.empty())
+        {
+            return;
+        }
+        const int n = pending.size();
+        for (int i = 0; i < n; i++)
+        {
+            const uint64_t id = pending[i];
+            sges[i].addr = (uint64_t)buf + id * slot_size;
+            sges[i].length = slot_size;
+            sges[i].lkey = mr->lkey;
+            memset(&wrs[i], 0, sizeof(wrs[i]));
+            wrs[i].wr_id = id;
+            wrs[i].sg_list = &sges[i];
+            wrs[i].num_sge = 1;
+            wrs[i].next = i + 1 < n ? &wrs[i + 1] : nullptr;
+        }
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_recv(qp, wrs.data(), &bad_wr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+        posted += n;
+        post_calls++;
+        reposted += n;
+        pending.clear();
+    }
+
+    void report() const
+    {
+        printf("recv ring: slots=%d, slot_size=%u, batch=%d, reposted=%lu, post_calls=%lu\n",
+               slots, slot_size, batch, reposted, post_calls);
+    }
+};
+
+// qp attributes derived from the port, the device and the gid table
+struct qp_params
+{
+    enum ibv_mtu mtu;       // path mtu
+    bool is_global;         // RoCE always needs a GRH
+    int gid_index;          // sgid_index
+    int max_rd_atomic;      // outstanding RDMA READ/atomic as requester
+    int max_dest_rd_atomic; // outstanding RDMA READ/atomic as responder
+    int io_depth;           // max_send_wr and max_recv_wr
+    int max_sge;
+    int max_cqe;
+};
+
+/**
+ * Loopback only version of probe_qp_params in modify_qp_simple.cpp, which
+ * documents each choice and also picks the gid by local ip. Here any
+ * RoCEv2 gid will do since both qps sit on the same port.
+ */
+qp_params probe_qp_params(struct ibv_context *ctx, int port, int want_depth)
+{
+    struct ibv_device_attr dev_attr;
+    int ret = ibv_query_device(ctx, &dev_attr);
+    CHECK(ret == 0, "ibv_query_device fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    qp_params p;
+    p.mtu = port_attr.active_mtu;
+    p.is_global = port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND;
+    p.gid_index = -1;
+    p.max_rd_atomic = std::min(dev_attr.max_qp_init_rd_atom, 255);
+    p.max_dest_rd_atomic = std::min(dev_attr.max_qp_rd_atom, 255);
+    p.io_depth = std::min(want_depth, dev_attr.max_qp_wr);
+    p.max_sge = std::min(30, dev_attr.max_sge);
+    p.max_cqe = dev_attr.max_cqe;
+    for (int i = 0; p.is_global && p.gid_index < 0 && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 &&
+            entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+        }
+    }
+    CHECK(!p.is_global || p.gid_index >= 0, "no RoCEv2 gid found");
+    p.gid_index = std::max(p.gid_index, 0);
+
+    printf("qp params: active_mtu=%d, gid_index=%d, max_rd_atomic=%d, max_dest_rd_atomic=%d, io_depth=%d\n",
+           128 << p.mtu, p.gid_index, p.max_rd_atomic, p.max_dest_rd_atomic, p.io_depth);
+    return p;
+}
+
 void out_qp_state(struct ibv_qp *qp)
 {
     // enum ibv_qp_state {
@@ -50,12 +318,12 @@ void out_qp_state(struct ibv_qp *qp)
     CHECK(ret == 0, "ibv_query_qp");
     printf("qp=%p, qp_state=%d\n", qp, attr.qp_state);
 }
-struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq)
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, const qp_params &p)
 {
     struct ibv_qp_init_attr init_attr;
     memset(&init_attr, 0, sizeof(init_attr));
-    const int io_depth = 32;
-    const int max_sge = 30;
+    const int io_depth = p.io_depth;
+    const int max_sge = p.max_sge;
     init_attr.send_cq = cq;
     init_attr.recv_cq = cq;
     init_attr.cap.max_send_wr = io_depth;
@@ -87,27 +355,27 @@ bool init_qp(struct ibv_qp *qp)
     return true;
 }
 
-bool modify_to_rtr(struct ibv_qp *qp, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+bool modify_to_rtr(struct ibv_qp *qp, const qp_params &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
 {
     struct ibv_qp_attr attr;
     memset(&attr, 0, sizeof(attr));
     attr.qp_state = IBV_QPS_RTR;
-    attr.path_mtu = IBV_MTU_4096;
+    attr.path_mtu = p.mtu;
     attr.dest_qp_num = r_qpn; // TODO
     attr.rq_psn = r_psn;      // TODO
-    attr.max_dest_rd_atomic = 1;
+    attr.max_dest_rd_atomic = p.max_dest_rd_atomic;
     attr.min_rnr_timer = 12;
-    attr.ah_attr.is_global = 1;
+    attr.ah_attr.is_global = p.is_global;
     
-    attr.ah_attr.grh.hop_limit = 1;
+    attr.ah_attr.grh.hop_limit = 64;
     attr.ah_attr.grh.dgid = gid; // TODO
-    attr.ah_attr.grh.sgid_index = 1; // TODO
+    attr.ah_attr.grh.sgid_index = p.gid_index;
 
     attr.ah_attr.dlid = dlid; // TODO
     // service level, https://www.cnblogs.com/burningTheStar/p/8563347.html
     attr.ah_attr.sl = 0;      // 
     attr.ah_attr.src_path_bits = 0;
-    attr.ah_attr.port_num = 1;
+    attr.ah_attr.port_num = PORT_NUM;
     int ret = ibv_modify_qp(qp, &attr,
                             IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
                                 IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
@@ -115,7 +383,7 @@ bool modify_to_rtr(struct ibv_qp *qp, uint32_t r_qpn, uint32_t r_psn, uint16_t d
     CHECK(ret == 0, "ibv_modify_qp RTR fail");
     return true;
 }
-bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+bool modify_to_rts(struct ibv_qp *qp, const qp_params &p, uint32_t my_psn)
 {
     struct ibv_qp_attr attr;
     memset(&attr, 0, sizeof(attr));
@@ -124,7 +392,7 @@ bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
     attr.timeout = 10;
     attr.retry_cnt = 5;
     attr.rnr_retry = 4; /* infinite */
-    attr.max_rd_atomic = 1;
+    attr.max_rd_atomic = p.max_rd_atomic;
     int ret = ibv_modify_qp(qp, &attr,
                             IBV_QP_STATE |
                                 IBV_QP_TIMEOUT |
@@ -139,6 +407,11 @@ bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
 int main(int argc, char *argv[])
 {
     printf("enter...\n");
+    const int batch = argc > 1 ? atoi(argv[1]) : 16;
+    const uint64_t spin_us = argc > 2 ? strtoull(argv[2], nullptr, 10) : 50;
+    const int msgs = argc > 3 ? atoi(argv[3]) : 64;
+    CHECK(batch > 0, "invalid batch");
+    CHECK(msgs > 0, "invalid msgs");
     int ret = ibv_fork_init();
     CHECK(ret == 0, "ibv_fork_init fail");
     struct ibv_device **devs;
@@ -152,14 +425,16 @@ int main(int argc, char *argv[])
     CHECK(pd, "ibv_alloc_pd fail");
     struct ibv_comp_channel *ch = ibv_create_comp_channel(ctx);
     CHECK(ch, "ibv_create_comp_channel fail");
-    const int cqe = 128;
+    // 2 qps share the cq, each with io_depth sends and recvs
+    const qp_params params = probe_qp_params(ctx, PORT_NUM, 256);
+    const int cqe = std::min(4 * params.io_depth, params.max_cqe);
     struct ibv_cq *cq = ibv_create_cq(ctx, cqe, nullptr, ch, 0);
     CHECK(cq, "ibv_create_cq fail");
 
     // create qp
-    struct ibv_qp *qp1 = create_qp(pd, cq);
+    struct ibv_qp *qp1 = create_qp(pd, cq, params);
     CHECK(qp1, "ibv_create_qp fail");
-    struct ibv_qp *qp2 = create_qp(pd, cq);
+    struct ibv_qp *qp2 = create_qp(pd, cq, params);
     CHECK(qp2, "ibv_create_qp fail");
     out_qp_state(qp1);
     out_qp_state(qp2);
@@ -172,7 +447,7 @@ int main(int argc, char *argv[])
 
     // RTR
     union ibv_gid gid;
-    ret = ibv_query_gid(ctx, PORT_NUM, 1, &gid);
+    ret = ibv_query_gid(ctx, PORT_NUM, params.gid_index, &gid);
     CHECK(ret == 0, "ibv_query_gid fail");
     printf("subnet_prefix=%llu, interface_id=%llu, 0x%llx\n",
         gid.global.subnet_prefix, gid.global.interface_id, gid.global.interface_id);
@@ -184,28 +459,22 @@ int main(int argc, char *argv[])
     ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
     CHECK(ret == 0, "ibv_query_port fail");
     const uint32_t psn = 0;
-    modify_to_rtr(qp1, qp2->qp_num, psn, port_attr.lid, gid);
-    modify_to_rtr(qp2, qp1->qp_num, psn, port_attr.lid, gid);
+    modify_to_rtr(qp1, params, qp2->qp_num, psn, port_attr.lid, gid);
+    modify_to_rtr(qp2, params, qp1->qp_num, psn, port_attr.lid, gid);
 
     out_qp_state(qp1);
     out_qp_state(qp2);
 
     // RTS
-    modify_to_rts(qp1, psn);
-    modify_to_rts(qp2, psn);
+    modify_to_rts(qp1, params, psn);
+    modify_to_rts(qp2, params, psn);
     out_qp_state(qp1);
     out_qp_state(qp2);
 
     const uint32_t size = 1024 *1024;
     char *send_buf = (char *)malloc(size);
     CHECK(send_buf, "malloc send_buf fail");
-    char *recv_buf = (char *)malloc(size);
-    CHECK(recv_buf, "malloc recv_buf fail");
     memset(send_buf, 0, size);
-    memset(recv_buf, 0, size);
-
-    std::string hello = "hello rxe RDMA send!";
-    memcpy(send_buf, hello.c_str(), hello.size());
 
     struct ibv_mr *send_mr = ibv_reg_mr(pd, send_buf, size,
                             IBV_ACCESS_LOCAL_WRITE |
@@ -213,92 +482,93 @@ int main(int argc, char *argv[])
                             IBV_ACCESS_REMOTE_READ);
     CHECK(send_mr, "ibv_reg_mr fail");
     printf("send_mr=%p, lkey=%u\n", send_mr, send_mr->lkey);
-    struct ibv_mr *recv_mr = ibv_reg_mr(pd, recv_buf, size,
-                            IBV_ACCESS_LOCAL_WRITE |
-                            IBV_ACCESS_REMOTE_WRITE |
-                            IBV_ACCESS_REMOTE_READ);
-    CHECK(recv_mr, "ibv_reg_mr fail");
-    printf("recv_mr=%p, lkey=%u\n", recv_mr, recv_mr->lkey);
 
+    // qp2 receives into a ring of 16 x 64KiB slots, reposted 4 at a time
+    const int ring_slots = 16;
+    const uint32_t slot_size = 64 * 1024;
+    const int repost_batch = 4;
+    recv_ring *ring = new recv_ring(pd, qp2, ring_slots, slot_size, repost_batch);
+    printf("recv_mr=%p, lkey=%u\n", ring->mr, ring->mr->lkey);
+
+    // keep at least repost_batch recvs posted ahead of the sends
+    const int max_inflight = ring_slots - repost_batch;
+    std::atomic<int> send_done(0);
+    cq_poller poller(cq, ch, batch, spin_us);
     std::function<void()> polling = [&]() {
         printf("polling thread starting...\n");
-        while(1) {
-            struct ibv_wc wc;
-            int cnt = ibv_poll_cq(cq, 1, &wc);
-            CHECK(cnt >= 0, "ibv_poll_cq fail");
-            if(cnt == 0) {
-                continue;
-            }
-            if(wc.status != IBV_WC_SUCCESS) {
-                /**
-                 * Not all wc attributes are always valid. 
-                 * If the completion status is other than IBV_WC_SUCCESS,
-                 * only the following attributes are valid:
-                    wr_id
-                    status
-                    qp_num
-                    vendor_err
-                */
-                printf("wc.status != IBV_WC_SUCCESS, wc.status=%u. wr_id=%lu\n",
-                    wc.status, wc.wr_id);
-                continue;
-            }
-            if(wc.opcode == IBV_WC_SEND) {
-                // handle send success
-                printf("send success~\n");
-            
-            } else if(wc.opcode == IBV_WC_RECV) {
-                // handle receive success
-                std::string msg(recv_buf, size);
-                printf("recv success, msg=%s\n", msg.c_str());
-            } else {
-                printf("unknown wc.opcode == %d\n", wc.opcode);
+        // msgs sends and msgs recvs are posted below
+        int expected = 2 * msgs;
+        while(expected > 0) {
+            int cnt = poller.poll();
+            for(int k = 0; k < cnt; k++) {
+                struct ibv_wc &wc = poller.wcs[k];
+                expected--;
+                if(wc.status != IBV_WC_SUCCESS) {
+                    /**
+                     * Not all wc attributes are always valid. 
+                     * If the completion status is other than IBV_WC_SUCCESS,
+                     * only the following attributes are valid:
+                        wr_id
+                        status
+                        qp_num
+                        vendor_err
+                    */
+                    printf("wc.status != IBV_WC_SUCCESS, wc.status=%u. wr_id=%lu\n",
+                        wc.status, wc.wr_id);
+                    continue;
+                }
+                if(wc.opcode == IBV_WC_SEND) {
+                    // handle send success
+                    send_done.fetch_add(1, std::memory_order_release);
+                } else if(wc.opcode == IBV_WC_RECV) {
+                    // handle receive success, the view is only valid until release
+                    recv_view msg = ring->on_wc(wc);
+                    printf("recv success, slot=%lu, len=%u, msg=%.*s\n",
+                        msg.wr_id, msg.len, (int)msg.len, msg.data);
+                    ring->release(msg.wr_id);
+                } else {
+                    printf("unknown wc.opcode == %d\n", wc.opcode);
+                }
             }
         }
+        poller.report();
+        ring->report();
     };
     // start poll cq
     std::thread poll_thread(polling);
 
-    // qp2 ibv_post_recv
-    struct ibv_sge recv_sge;
-    recv_sge.addr = (uint64_t)recv_buf;
-    recv_sge.length = size;
-    recv_sge.lkey = recv_mr->lkey;
-    struct ibv_recv_wr recv_wr;
-    memset(&recv_wr, 0, sizeof(recv_wr));
-    recv_wr.wr_id = 1234;
-    recv_wr.sg_list = &recv_sge;
-    recv_wr.num_sge = 1;
-    struct ibv_recv_wr *bad_recv_wr = nullptr;
-    ret = ibv_post_recv(qp2, &recv_wr, &bad_recv_wr);
-    CHECK(ret == 0, "ibv_post_recv fail");
-    // printf("post_recv succ\n");
-
-    // qp1 ibv_post_send
-    struct ibv_sge send_sge;
-    send_sge.addr = (uint64_t)send_buf;
-    send_sge.length = size;
-    send_sge.lkey = send_mr->lkey;
-    struct ibv_send_wr send_wr;
-    memset(&send_wr, 0, sizeof(send_wr));
-    send_wr.wr_id = 5678;
-    send_wr.sg_list = &send_sge;
-    send_wr.num_sge = 1;
-    send_wr.opcode = IBV_WR_SEND;
-    send_wr.send_flags = IBV_SEND_SIGNALED;
-    struct ibv_send_wr *bad_send_wr = nullptr;
-    ret = ibv_post_send(qp1, &send_wr, &bad_send_wr);
-    CHECK(ret == 0, "ibv_post_send fail");
-    // printf("post_send succ\n");
+    // qp1 ibv_post_send, each message only sends its own bytes
+    const uint32_t msg_slot = 4096;
+    for (int k = 0; k < msgs; k++) {
+        while (k - send_done.load(std::memory_order_acquire) >= max_inflight) {
+            std::this_thread::yield();
+        }
+        char *msg = send_buf + (k % max_inflight) * msg_slot;
+        int len = snprintf(msg, msg_slot, "hello rxe RDMA send! #%d", k);
+        struct ibv_sge send_sge;
+        send_sge.addr = (uint64_t)msg;
+        send_sge.length = len;
+        send_sge.lkey = send_mr->lkey;
+        struct ibv_send_wr send_wr;
+        memset(&send_wr, 0, sizeof(send_wr));
+        send_wr.wr_id = k;
+        send_wr.sg_list = &send_sge;
+        send_wr.num_sge = 1;
+        send_wr.opcode = IBV_WR_SEND;
+        send_wr.send_flags = IBV_SEND_SIGNALED;
+        struct ibv_send_wr *bad_send_wr = nullptr;
+        ret = ibv_post_send(qp1, &send_wr, &bad_send_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+    }
 
     poll_thread.join();
     printf("after polling thread\n");
     ibv_dereg_mr(send_mr);
-    ibv_dereg_mr(recv_mr);
     free(send_buf);
-    free(recv_buf);
+    delete ring;
 
     ibv_destroy_qp(qp1);
+    ibv_destroy_qp(qp2);
     ibv_destroy_cq(cq);
     ibv_destroy_comp_channel(ch);
     ibv_dealloc_pd(pd);
@@ -0,0 +1,554 @@
+/**
+ * Example of a pre-warmed qp pool. If you have no RDMA hardware, see
+ * https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * Bringing up a qp the way modify_qp_simple.cpp does costs ibv_create_qp,
+ * three ibv_modify_qp and an ibv_query_qp after every transition, and the
+ * teardown costs an ibv_destroy_qp. qp_pool moves everything but RTR/RTS off
+ * the connect path:
+ * - a background thread keeps `target` qps created and parked in INIT,
+ * - acquire() hands out a parked qp, the caller only does RTR and RTS,
+ * - release() queues the qp for the background thread, which moves it to
+ *   RESET and back to INIT instead of destroying it,
+ * - the pool knows parked qps are in INIT, nothing queries the state.
+ * Drain the cq of a qp's completions before releasing it, the qp_num stays
+ * the same once reused.
+ *
+ * The benchmark opens and closes loopback connections (two qps each), keeps
+ * at most `live` open and reports connections/s and connect latency for:
+ * cold+query (create, INIT, RTR, RTS, query after each step, destroy),
+ * cold (the same without queries) and pool.
+ *
+ * g++ -O2 qp_pool.cpp -libverbs -lpthread -o qp_pool
+ * ./qp_pool [-n connections] [-l live] [-t target] [-v]
+ *
+ * -v: ping one message over every connection to check it works
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define QP_DEPTH 64
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = QP_DEPTH;
+    init_attr.cap.max_recv_wr = QP_DEPTH;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+enum ibv_qp_state get_qp_state(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    struct ibv_qp_init_attr init_attr;
+    int ret = ibv_query_qp(qp, &attr, IBV_QP_STATE, &init_attr);
+    CHECK(ret == 0, "ibv_query_qp");
+    return attr.qp_state;
+}
+bool reset_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RESET;
+    int ret = ibv_modify_qp(qp, &attr, IBV_QP_STATE);
+    CHECK(ret == 0, "ibv_modify_qp reset fail");
+    return true;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+/**
+ * qps parked in INIT, all on one pd and cq. Only the background thread
+ * creates, resets and initializes qps, acquire() and release() just move
+ * pointers under the lock.
+ */
+class qp_pool
+{
+public:
+    qp_pool(struct ibv_pd *pd, struct ibv_cq *cq, int target)
+        : pd_(pd), cq_(cq), target_(target)
+    {
+        worker_ = std::thread([this]() { refill(); });
+    }
+    ~qp_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        worker_.join();
+        for (struct ibv_qp *qp : parked_)
+        {
+            ibv_destroy_qp(qp);
+        }
+        for (struct ibv_qp *qp : recycle_)
+        {
+            ibv_destroy_qp(qp);
+        }
+    }
+
+    // wait until `target` qps are parked
+    void warm_up()
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        warm_cv_.wait(lk, [this]() { return (int)parked_.size() >= target_; });
+    }
+
+    // a qp in INIT, ready for RTR
+    struct ibv_qp *acquire()
+    {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (!parked_.empty())
+            {
+                struct ibv_qp *qp = parked_.front();
+                parked_.pop_front();
+                hits_++;
+                cv_.notify_one();
+                return qp;
+            }
+            misses_++;
+        }
+        // the pool ran dry, build one inline rather than wait for the worker
+        struct ibv_qp *qp = create_qp(pd_, cq_);
+        init_qp(qp);
+        return qp;
+    }
+
+    // the qp may be in any state, its completions must be drained already
+    void release(struct ibv_qp *qp)
+    {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            recycle_.push_back(qp);
+        }
+        cv_.notify_one();
+    }
+
+    void report(const char *name)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        printf("%s: hits=%lu, misses=%lu, created=%lu, recycled=%lu, parked=%zu\n",
+               name, hits_, misses_, created_, recycled_, parked_.size());
+    }
+
+private:
+    void refill()
+    {
+        std::unique_lock<std::mutex> lk(mu_);
+        while (true)
+        {
+            cv_.wait(lk, [this]() {
+                return stop_ || !recycle_.empty() || (int)parked_.size() < target_;
+            });
+            if (stop_)
+            {
+                return;
+            }
+            // a recycled qp is cheaper than a new one, take those first
+            struct ibv_qp *qp = nullptr;
+            if (!recycle_.empty())
+            {
+                qp = recycle_.front();
+                recycle_.pop_front();
+            }
+            const bool recycled = qp != nullptr;
+            lk.unlock();
+            if (recycled)
+            {
+                reset_qp(qp);
+            }
+            else
+            {
+                qp = create_qp(pd_, cq_);
+            }
+            init_qp(qp);
+            lk.lock();
+            parked_.push_back(qp);
+            (recycled ? recycled_ : created_)++;
+            warm_cv_.notify_all();
+        }
+    }
+
+    struct ibv_pd *pd_;
+    struct ibv_cq *cq_;
+    const int target_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::condition_variable warm_cv_;
+    std::deque<struct ibv_qp *> parked_;
+    std::deque<struct ibv_qp *> recycle_;
+    bool stop_ = false;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t created_ = 0;
+    uint64_t recycled_ = 0;
+    std::thread worker_;
+};
+
+enum mode
+{
+    COLD_QUERY,
+    COLD,
+    POOL,
+};
+
+struct conn
+{
+    struct ibv_qp *a;
+    struct ibv_qp *b;
+};
+
+struct bench
+{
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_mr *mr;
+    char *buf;
+    union ibv_gid gid;
+    uint16_t lid;
+    port_path path;
+    bool verify;
+
+    struct ibv_qp *cold_qp(bool query)
+    {
+        struct ibv_qp *qp = create_qp(pd, cq);
+        if (query)
+        {
+            CHECK(get_qp_state(qp) == IBV_QPS_RESET, "not in RESET");
+        }
+        init_qp(qp);
+        if (query)
+        {
+            CHECK(get_qp_state(qp) == IBV_QPS_INIT, "not in INIT");
+        }
+        return qp;
+    }
+
+    void connect(conn &c, bool query)
+    {
+        const uint32_t psn_a = lrand48() & 0xffffff;
+        const uint32_t psn_b = lrand48() & 0xffffff;
+        modify_to_rtr(c.a, path, c.b->qp_num, psn_b, lid, gid);
+        modify_to_rtr(c.b, path, c.a->qp_num, psn_a, lid, gid);
+        if (query)
+        {
+            CHECK(get_qp_state(c.a) == IBV_QPS_RTR && get_qp_state(c.b) == IBV_QPS_RTR, "not in RTR");
+        }
+        modify_to_rts(c.a, psn_a);
+        modify_to_rts(c.b, psn_b);
+        if (query)
+        {
+            CHECK(get_qp_state(c.a) == IBV_QPS_RTS && get_qp_state(c.b) == IBV_QPS_RTS, "not in RTS");
+        }
+    }
+
+    // one SEND from a to b, waits for both completions so the cq is drained
+    void ping(conn &c, uint64_t seq)
+    {
+        struct ibv_sge rsge = {(uint64_t)buf + 8, 8, mr->lkey};
+        struct ibv_recv_wr rwr;
+        memset(&rwr, 0, sizeof(rwr));
+        rwr.wr_id = seq;
+        rwr.sg_list = &rsge;
+        rwr.num_sge = 1;
+        struct ibv_recv_wr *bad_rwr = nullptr;
+        int ret = ibv_post_recv(c.b, &rwr, &bad_rwr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+
+        memcpy(buf, &seq, 8);
+        struct ibv_sge ssge = {(uint64_t)buf, 8, mr->lkey};
+        struct ibv_send_wr swr;
+        memset(&swr, 0, sizeof(swr));
+        swr.wr_id = seq;
+        swr.sg_list = &ssge;
+        swr.num_sge = 1;
+        swr.opcode = IBV_WR_SEND;
+        swr.send_flags = IBV_SEND_SIGNALED;
+        struct ibv_send_wr *bad_swr = nullptr;
+        ret = ibv_post_send(c.a, &swr, &bad_swr);
+        CHECK(ret == 0, "ibv_post_send fail");
+
+        int got = 0;
+        struct ibv_wc wc[2];
+        while (got < 2)
+        {
+            int n = ibv_poll_cq(cq, 2 - got, wc);
+            CHECK(n >= 0, "ibv_poll_cq fail");
+            for (int i = 0; i < n; i++)
+            {
+                CHECK(wc[i].status == IBV_WC_SUCCESS && wc[i].wr_id == seq, "ping fail");
+            }
+            got += n;
+        }
+        uint64_t echo;
+        memcpy(&echo, buf + 8, 8);
+        CHECK(echo == seq, "ping payload mismatch");
+    }
+
+    void run(mode m, int n, int live, int target)
+    {
+        qp_pool *pool = m == POOL ? new qp_pool(pd, cq, target) : nullptr;
+        if (pool)
+        {
+            pool->warm_up();
+        }
+        std::deque<conn> open;
+        std::vector<uint64_t> lat;
+        lat.reserve(n);
+        auto close = [&](conn &c) {
+            if (pool)
+            {
+                pool->release(c.a);
+                pool->release(c.b);
+            }
+            else
+            {
+                ibv_destroy_qp(c.a);
+                ibv_destroy_qp(c.b);
+            }
+        };
+
+        const uint64_t start = now_ns();
+        for (int i = 0; i < n; i++)
+        {
+            if ((int)open.size() >= live)
+            {
+                close(open.front());
+                open.pop_front();
+            }
+            const uint64_t t0 = now_ns();
+            conn c;
+            if (pool)
+            {
+                c.a = pool->acquire();
+                c.b = pool->acquire();
+            }
+            else
+            {
+                c.a = cold_qp(m == COLD_QUERY);
+                c.b = cold_qp(m == COLD_QUERY);
+            }
+            connect(c, m == COLD_QUERY);
+            lat.push_back(now_ns() - t0);
+            if (verify)
+            {
+                ping(c, i);
+            }
+            open.push_back(c);
+        }
+        const double secs = (now_ns() - start) / 1e9;
+        for (conn &c : open)
+        {
+            close(c);
+        }
+
+        std::sort(lat.begin(), lat.end());
+        const char *name = m == COLD_QUERY ? "cold+query" : (m == COLD ? "cold" : "pool");
+        printf("%-10s %8.0f conn/s, connect us p50=%.1f p99=%.1f max=%.1f\n",
+               name, n / secs, lat[n / 2] / 1e3, lat[(size_t)n * 99 / 100] / 1e3, lat.back() / 1e3);
+        if (pool)
+        {
+            pool->report(name);
+            delete pool;
+        }
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    int n = 2000;
+    int live = 64;
+    int target = 128;
+    bool verify = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:l:t:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'l':
+            live = atoi(optarg);
+            break;
+        case 't':
+            target = atoi(optarg);
+            break;
+        case 'v':
+            verify = true;
+            break;
+        default:
+            printf("usage: %s [-n connections] [-l live] [-t target] [-v]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(n > 0 && live > 0 && target > 0, "invalid args");
+    srand48(time(nullptr));
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    struct ibv_cq *cq = ibv_create_cq(ctx, 64, nullptr, nullptr, 0);
+    CHECK(cq, "ibv_create_cq fail");
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    bench b;
+    b.pd = pd;
+    b.cq = cq;
+    b.buf = (char *)malloc(64);
+    CHECK(b.buf, "malloc fail");
+    b.mr = ibv_reg_mr(pd, b.buf, 64, IBV_ACCESS_LOCAL_WRITE);
+    CHECK(b.mr, "ibv_reg_mr fail");
+    b.path = probe_path(ctx, PORT_NUM);
+    ret = ibv_query_gid(ctx, PORT_NUM, b.path.gid_index, &b.gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    b.lid = port_attr.lid;
+    b.verify = verify;
+
+    b.run(COLD_QUERY, n, live, target);
+    b.run(COLD, n, live, target);
+    b.run(POOL, n, live, target);
+
+    ibv_dereg_mr(b.mr);
+    free(b.buf);
+    ibv_destroy_cq(cq);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,591 @@
+/**
+ * Example of recovering a qp from the error state in place. If you have no RDMA
+ * hardware, see https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * Once a wc comes back with an error status the qp is in ERR, every wr still
+ * queued is flushed and nothing goes through until the qp is reset. A link
+ * flap shorter than timeout * retry_cnt is absorbed by the HCA retries, this
+ * is about the longer ones. Instead of tearing down the connection,
+ * recoverable_qp:
+ * - keeps every send posted but not completed successfully, by wr_id, RC
+ *   completes them in order so the successful ones retire from the front,
+ * - on the first bad wc moves the qp to ERR (if it isn't) and drains the cq
+ *   until every posted send and recv has come back,
+ * - exchanges fresh psns with the peer, which does the same drain and reset,
+ *   and cycles RESET -> INIT -> RTR -> RTS without recreating anything,
+ * - reposts the receives and replays the unacknowledged sends in order.
+ * A replayed message may have arrived already (its ack got lost), so delivery
+ * is at least once, the receiver drops duplicates by the sequence number in
+ * the immediate data.
+ *
+ * The psn exchange is a callback, the demo connects two endpoints over
+ * loopback so it calls the peer directly, a real one would use the TCP
+ * side channel. Errors are injected by moving a qp to ERR every `-e`
+ * messages, alternating sender and receiver.
+ *
+ * Over a side channel both ends can start recovering at once and their psn
+ * requests cross. That has to be broken by a fixed rule, e.g. the end with
+ * the lower qpn wins: the other end answers that request with reset_for()
+ * and drops its own, the winner drops the request it got and keeps waiting
+ * for the answer to its own. The single threaded demo never gets there,
+ * whoever polls first recovers and the peer's pending failure is cleared
+ * by reset_for().
+ *
+ * g++ -O2 qp_recovery.cpp -libverbs -o qp_recovery
+ * ./qp_recovery [-n msgs] [-e error_every] [-s size] [-d depth]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define RECV_TAG (1ull << 63)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = depth;
+    init_attr.cap.max_recv_wr = depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool modify_to_state(struct ibv_qp *qp, enum ibv_qp_state state)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = state;
+    int ret = ibv_modify_qp(qp, &attr, IBV_QP_STATE);
+    CHECK(ret == 0, "ibv_modify_qp fail");
+    return true;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+static uint32_t new_psn()
+{
+    return lrand48() & 0xffffff;
+}
+
+/**
+ * One end of an RC connection that survives the qp going to ERR. Sends are
+ * SEND_WITH_IMM from a slot of buf, receives land in the other slots.
+ */
+class recoverable_qp
+{
+public:
+    // given our new psn, reset the peer and return its new psn, see the
+    // header for requests crossing when both ends recover
+    typedef std::function<uint32_t(uint32_t my_psn)> exchange_fn;
+    typedef std::function<void(uint32_t imm, const char *data, uint32_t len)> recv_fn;
+
+    recoverable_qp(const char *name, struct ibv_context *ctx, struct ibv_pd *pd, int depth, uint32_t size)
+        : name_(name), depth_(depth), size_(size)
+    {
+        cq_ = ibv_create_cq(ctx, 2 * depth, nullptr, nullptr, 0);
+        CHECK(cq_, "ibv_create_cq fail");
+        qp_ = create_qp(pd, cq_, depth);
+        buf_ = (char *)malloc((size_t)2 * depth * size);
+        CHECK(buf_, "malloc fail");
+        memset(buf_, 0, (size_t)2 * depth * size);
+        mr_ = ibv_reg_mr(pd, buf_, (size_t)2 * depth * size, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(mr_, "ibv_reg_mr fail");
+    }
+    ~recoverable_qp()
+    {
+        ibv_destroy_qp(qp_);
+        ibv_destroy_cq(cq_);
+        ibv_dereg_mr(mr_);
+        free(buf_);
+    }
+
+    uint32_t qpn() const { return qp_->qp_num; }
+
+    void set_handlers(exchange_fn exchange, recv_fn on_recv)
+    {
+        exchange_ = exchange;
+        on_recv_ = on_recv;
+    }
+
+    void connect(const port_path &path, uint32_t r_qpn, uint16_t lid, union ibv_gid gid, uint32_t my_psn,
+                 uint32_t r_psn)
+    {
+        path_ = path;
+        r_qpn_ = r_qpn;
+        lid_ = lid;
+        gid_ = gid;
+        init_qp(qp_);
+        post_recvs();
+        modify_to_rtr(qp_, path_, r_qpn_, r_psn, lid_, gid_);
+        modify_to_rts(qp_, my_psn);
+    }
+
+    bool can_send() const { return !recovering_ && !replay_due_ && (int)pending_.size() < depth_; }
+
+    void send(uint32_t imm, const void *data, uint32_t len)
+    {
+        CHECK(can_send() && len <= size_, "send not possible now");
+        pending_op op;
+        op.seq = next_seq_++;
+        op.imm = imm;
+        op.len = len;
+        memcpy(send_slot(op.seq), data, len);
+        post_send(op);
+        pending_.push_back(op);
+    }
+
+    // reap completions, recovers the qp in place if one failed
+    void poll()
+    {
+        struct ibv_wc wcs[32];
+        int n = ibv_poll_cq(cq_, 32, wcs);
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            on_wc(wcs[i]);
+        }
+        if (failed_ && !recovering_)
+        {
+            recover();
+        }
+        if (replay_due_)
+        {
+            replay();
+        }
+    }
+
+    // the peer is recovering, drain and reset to its psn, return ours. The
+    // replay waits for the next poll(), by then the peer is back in RTS too
+    uint32_t reset_for(uint32_t r_psn)
+    {
+        recovering_ = true;
+        drain();
+        const uint32_t my_psn = new_psn();
+        reset(r_psn, my_psn);
+        replay_due_ = true;
+        fail_ts_ = 0;
+        failed_ = false;
+        recovering_ = false;
+        return my_psn;
+    }
+
+    // simulate a fatal transport error
+    void inject_error()
+    {
+        modify_to_state(qp_, IBV_QPS_ERR);
+    }
+
+    size_t unacked() const { return pending_.size(); }
+    uint64_t recoveries() const { return recoveries_; }
+    uint64_t replayed() const { return replayed_; }
+    uint64_t recover_ns_max() const { return recover_ns_max_; }
+    uint64_t recover_ns_total() const { return recover_ns_total_; }
+
+private:
+    struct pending_op
+    {
+        uint64_t seq;
+        uint32_t imm;
+        uint32_t len;
+    };
+
+    char *send_slot(uint64_t seq) { return buf_ + (seq % depth_) * size_; }
+    char *recv_slot(uint64_t i) { return buf_ + (depth_ + i) * size_; }
+
+    void post_send(const pending_op &op)
+    {
+        struct ibv_sge sge = {(uint64_t)send_slot(op.seq), op.len, mr_->lkey};
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = op.seq;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND_WITH_IMM;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.imm_data = htonl(op.imm);
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+        sends_posted_++;
+    }
+
+    void post_recv(uint64_t slot)
+    {
+        struct ibv_sge sge = {(uint64_t)recv_slot(slot), size_, mr_->lkey};
+        struct ibv_recv_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = RECV_TAG | slot;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_recv(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+        recvs_posted_++;
+    }
+
+    void post_recvs()
+    {
+        for (int i = 0; i < depth_; i++)
+        {
+            post_recv(i);
+        }
+    }
+
+    void on_wc(const struct ibv_wc &wc)
+    {
+        const bool is_recv = wc.wr_id & RECV_TAG;
+        if (is_recv)
+        {
+            recvs_posted_--;
+        }
+        else
+        {
+            sends_posted_--;
+        }
+        if (wc.status != IBV_WC_SUCCESS)
+        {
+            // the first real error explains the rest, which are flushes
+            if (!failed_ && wc.status != IBV_WC_WR_FLUSH_ERR)
+            {
+                printf("%s: wr %lu failed, %s, recovering\n", name_.c_str(), (uint64_t)(wc.wr_id & ~RECV_TAG),
+                       ibv_wc_status_str(wc.status));
+            }
+            if (!failed_)
+            {
+                failed_ = true;
+                fail_ts_ = now_ns();
+            }
+            return;
+        }
+        if (is_recv)
+        {
+            on_recv_(ntohl(wc.imm_data), recv_slot(wc.wr_id & ~RECV_TAG), wc.byte_len);
+            if (!failed_ && !recovering_)
+            {
+                post_recv(wc.wr_id & ~RECV_TAG);
+            }
+            return;
+        }
+        CHECK(!pending_.empty() && pending_.front().seq == wc.wr_id, "send completed out of order");
+        pending_.pop_front();
+    }
+
+    // move to ERR and wait until every posted wr came back
+    void drain()
+    {
+        modify_to_state(qp_, IBV_QPS_ERR);
+        struct ibv_wc wcs[32];
+        while (sends_posted_ > 0 || recvs_posted_ > 0)
+        {
+            int n = ibv_poll_cq(cq_, 32, wcs);
+            CHECK(n >= 0, "ibv_poll_cq fail");
+            for (int i = 0; i < n; i++)
+            {
+                on_wc(wcs[i]);
+            }
+        }
+    }
+
+    void reset(uint32_t r_psn, uint32_t my_psn)
+    {
+        modify_to_state(qp_, IBV_QPS_RESET);
+        init_qp(qp_);
+        post_recvs();
+        modify_to_rtr(qp_, path_, r_qpn_, r_psn, lid_, gid_);
+        modify_to_rts(qp_, my_psn);
+    }
+
+    void recover()
+    {
+        recovering_ = true;
+        if (!fail_ts_)
+        {
+            fail_ts_ = now_ns();
+        }
+        drain();
+        const uint32_t my_psn = new_psn();
+        const uint32_t r_psn = exchange_(my_psn);
+        reset(r_psn, my_psn);
+        replay();
+        recoveries_++;
+        const uint64_t took = now_ns() - fail_ts_;
+        recover_ns_total_ += took;
+        recover_ns_max_ = std::max(recover_ns_max_, took);
+        fail_ts_ = 0;
+        failed_ = false;
+        recovering_ = false;
+    }
+
+    // whatever is left was flushed or failed, send it again in order
+    void replay()
+    {
+        for (const pending_op &op : pending_)
+        {
+            post_send(op);
+        }
+        replayed_ += pending_.size();
+        replay_due_ = false;
+    }
+
+    const std::string name_;
+    const int depth_;
+    const uint32_t size_;
+    struct ibv_cq *cq_;
+    struct ibv_qp *qp_;
+    struct ibv_mr *mr_;
+    char *buf_;
+    port_path path_;
+    uint32_t r_qpn_ = 0;
+    uint16_t lid_ = 0;
+    union ibv_gid gid_;
+    exchange_fn exchange_;
+    recv_fn on_recv_;
+
+    std::deque<pending_op> pending_; // posted, not completed successfully
+    uint64_t next_seq_ = 0;
+    int sends_posted_ = 0;
+    int recvs_posted_ = 0;
+    bool failed_ = false;
+    bool recovering_ = false;
+    bool replay_due_ = false;
+    uint64_t fail_ts_ = 0;
+
+    uint64_t recoveries_ = 0;
+    uint64_t replayed_ = 0;
+    uint64_t recover_ns_total_ = 0;
+    uint64_t recover_ns_max_ = 0;
+};
+
+int main(int argc, char *argv[])
+{
+    int msgs = 100000;
+    int error_every = 10000;
+    uint32_t size = 1024;
+    int depth = 64;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:e:s:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            msgs = atoi(optarg);
+            break;
+        case 'e':
+            error_every = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-n msgs] [-e error_every] [-s size] [-d depth]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(msgs > 0 && error_every >= 0 && size >= sizeof(uint32_t) && depth > 0, "invalid args");
+    srand48(time(nullptr));
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    recoverable_qp *a = new recoverable_qp("sender", ctx, pd, depth, size);
+    recoverable_qp *b = new recoverable_qp("receiver", ctx, pd, depth, size);
+
+    uint32_t expect = 0;
+    uint64_t dups = 0;
+    auto on_recv = [&](uint32_t seq, const char *data, uint32_t len) {
+        uint32_t body;
+        memcpy(&body, data, sizeof(body));
+        CHECK(len == size && body == seq, "corrupted message");
+        if (seq < expect)
+        {
+            dups++; // replayed after its ack got lost
+            return;
+        }
+        CHECK(seq == expect, "message lost");
+        expect++;
+    };
+    a->set_handlers([&](uint32_t psn) { return b->reset_for(psn); }, [](uint32_t, const char *, uint32_t) {});
+    b->set_handlers([&](uint32_t psn) { return a->reset_for(psn); }, on_recv);
+    const uint32_t psn_a = new_psn(), psn_b = new_psn();
+    a->connect(path, b->qpn(), port_attr.lid, gid, psn_a, psn_b);
+    b->connect(path, a->qpn(), port_attr.lid, gid, psn_b, psn_a);
+
+    std::vector<char> msg(size, 'm');
+    int sent = 0, injected = 0;
+    const uint64_t start = now_ns();
+    while (expect < (uint32_t)msgs || a->unacked() > 0)
+    {
+        while (sent < msgs && a->can_send())
+        {
+            memcpy(msg.data(), &sent, sizeof(uint32_t));
+            a->send(sent, msg.data(), size);
+            sent++;
+            if (error_every > 0 && sent % error_every == 0)
+            {
+                // alternate: the sender fails its sends, the receiver its receives
+                (injected++ % 2 == 0 ? a : b)->inject_error();
+            }
+        }
+        a->poll();
+        b->poll();
+    }
+    const double secs = (now_ns() - start) / 1e9;
+
+    const uint64_t recoveries = a->recoveries() + b->recoveries();
+    printf("msgs=%d, %.0f msgs/s, injected errors=%d, recoveries=%lu (sender %lu, receiver %lu), "
+           "replayed=%lu, duplicates dropped=%lu\n",
+           msgs, msgs / secs, injected, recoveries, a->recoveries(), b->recoveries(),
+           a->replayed() + b->replayed(), dups);
+    if (recoveries > 0)
+    {
+        printf("recovery ms avg=%.3f max=%.3f\n",
+               (a->recover_ns_total() + b->recover_ns_total()) / 1e6 / recoveries,
+               std::max(a->recover_ns_max(), b->recover_ns_max()) / 1e6);
+    }
+
+    delete a;
+    delete b;
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -2,17 +2,30 @@
  * Example of query RDMA device info. If you have no RDMA hardware,
  * see https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
  *
- * gcc query_device.cpp -libverbs -o query_device
- * ./query_device
+ * g++ query_device.cpp -libverbs -o query_device
+ * ./query_device [-j]
+ *
+ * -j: instead of the summary, probe ports, the GID table, link speed/width
+ *     and the PCI/NUMA location from sysfs, and print a JSON profile with a
+ *     recommended core set and queue sizing per device. The profile can be
+ *     saved and loaded by sharded_engine -p, so it does not re-probe:
+ *     ./query_device -j > rdma_profile.json
  *
  * author: lihao <hooleeucas@163.com>
- * 
+ *
  * Under Apache License 2.0
  */
 #include <stdio.h>
 #include <infiniband/verbs.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 #define CHECK(c, fmt, ...)                                               \
     do                                                                   \
@@ -25,27 +38,330 @@
         }                                                                \
     } while (0)
 
+// 读取sysfs文件的第一行，不存在时返回空串
+static std::string read_sysfs(const std::string &path)
+{
+    char buf[4096];
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+    {
+        return "";
+    }
+    std::string s;
+    if (fgets(buf, sizeof(buf), f))
+    {
+        s = buf;
+    }
+    fclose(f);
+    while (!s.empty() && (s.back() == '\n' || s.back() == ' '))
+    {
+        s.pop_back();
+    }
+    return s;
+}
+
+// "0-7,16-23" -> {0..7, 16..23}
+static std::vector<int> parse_cpulist(const std::string &list)
+{
+    std::vector<int> cpus;
+    const char *p = list.c_str();
+    while (*p)
+    {
+        char *end;
+        int a = strtol(p, &end, 10);
+        if (end == p)
+        {
+            break;
+        }
+        int b = a;
+        p = end;
+        if (*p == '-')
+        {
+            b = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (int c = a; c <= b; c++)
+        {
+            cpus.push_back(c);
+        }
+        if (*p == ',')
+        {
+            p++;
+        }
+    }
+    return cpus;
+}
+
+static int mtu_to_num(enum ibv_mtu mtu)
+{
+    return 128 << mtu;
+}
+
+// per lane rate in Gb/s of ibv_port_attr.active_speed
+static double speed_to_gbps(uint8_t speed)
+{
+    switch (speed)
+    {
+    case 1:
+        return 2.5; // SDR
+    case 2:
+        return 5.0; // DDR
+    case 4:
+    case 8:
+        return 10.0; // QDR, FDR10
+    case 16:
+        return 14.0625; // FDR
+    case 32:
+        return 25.78125; // EDR
+    case 64:
+        return 50.0; // HDR
+    case 128:
+        return 100.0; // NDR
+    default:
+        return 0;
+    }
+}
+
+// lanes of ibv_port_attr.active_width
+static int width_to_lanes(uint8_t width)
+{
+    switch (width)
+    {
+    case 1:
+        return 1;
+    case 2:
+        return 4;
+    case 4:
+        return 8;
+    case 8:
+        return 12;
+    case 16:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static const char *port_state_str(enum ibv_port_state s)
+{
+    switch (s)
+    {
+    case IBV_PORT_DOWN:
+        return "DOWN";
+    case IBV_PORT_INIT:
+        return "INIT";
+    case IBV_PORT_ARMED:
+        return "ARMED";
+    case IBV_PORT_ACTIVE:
+        return "ACTIVE";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+static const char *gid_type_str(uint32_t type)
+{
+    switch (type)
+    {
+    case IBV_GID_TYPE_IB:
+        return "IB";
+    case IBV_GID_TYPE_ROCE_V1:
+        return "RoCEv1";
+    case IBV_GID_TYPE_ROCE_V2:
+        return "RoCEv2";
+    default:
+        return "unknown";
+    }
+}
+
+static uint32_t next_pow2(uint64_t v)
+{
+    uint32_t n = 1;
+    while (n < v && n < (1u << 30))
+    {
+        n <<= 1;
+    }
+    return n;
+}
+
+/**
+ * Print one device as a single line JSON object, sharded_engine reads the
+ * profile line by line.
+ *
+ * Recommendations:
+ * - cores: the cpus local to the NIC (device/local_cpulist) we may run on,
+ *   or all allowed cpus if the NIC has no locality.
+ * - workers: one per local core, at most one per completion vector.
+ * - qp_depth: enough MTU sized WRs to cover the bandwidth-delay product of
+ *   the fastest active port with a 10us round trip, within [64, max_qp_wr].
+ * - cq_depth: the sends and recvs of 16 such qps, bounded by max_cqe.
+ */
+static void print_json(struct ibv_device *dev, struct ibv_context *ctx, bool last)
+{
+    const std::string name = ibv_get_device_name(dev);
+    const std::string sys = "/sys/class/infiniband/" + name;
+    struct ibv_device_attr attr;
+    int ret = ibv_query_device(ctx, &attr);
+    CHECK(ret == 0, "ibv_query_device fail");
+
+    char link[4096];
+    std::string pci_addr;
+    ssize_t n = readlink((sys + "/device").c_str(), link, sizeof(link) - 1);
+    if (n > 0)
+    {
+        link[n] = 0;
+        pci_addr = strrchr(link, '/') ? strrchr(link, '/') + 1 : link;
+    }
+    std::string numa = read_sysfs(sys + "/device/numa_node");
+    const std::string local_cpus = read_sysfs(sys + "/device/local_cpulist");
+
+    printf("{\"name\":\"%s\",\"node_guid\":\"%016llx\",\"fw_ver\":\"%s\","
+           "\"vendor_id\":%u,\"vendor_part_id\":%u,\"hw_ver\":%u,\"num_comp_vectors\":%d,",
+           name.c_str(), (unsigned long long)be64toh(ibv_get_device_guid(dev)), attr.fw_ver,
+           attr.vendor_id, attr.vendor_part_id, attr.hw_ver, ctx->num_comp_vectors);
+    printf("\"caps\":{\"max_qp\":%d,\"max_qp_wr\":%d,\"max_sge\":%d,\"max_sge_rd\":%d,"
+           "\"max_cq\":%d,\"max_cqe\":%d,\"max_mr\":%d,\"max_mr_size\":%lu,\"max_pd\":%d,"
+           "\"max_qp_rd_atom\":%d,\"max_qp_init_rd_atom\":%d,\"max_srq\":%d,\"max_srq_wr\":%d,"
+           "\"atomic_cap\":%d},",
+           attr.max_qp, attr.max_qp_wr, attr.max_sge, attr.max_sge_rd, attr.max_cq, attr.max_cqe,
+           attr.max_mr, attr.max_mr_size, attr.max_pd, attr.max_qp_rd_atom,
+           attr.max_qp_init_rd_atom, attr.max_srq, attr.max_srq_wr, attr.atomic_cap);
+    printf("\"pci\":{\"addr\":\"%s\",\"numa_node\":%s,\"local_cpus\":\"%s\"},",
+           pci_addr.c_str(), numa.empty() ? "-1" : numa.c_str(), local_cpus.c_str());
+
+    double best_gbps = 0;
+    int best_mtu = 1024;
+    int best_port = 1, best_gid = 0;
+    printf("\"ports\":[");
+    for (int port = 1; port <= attr.phys_port_cnt; port++)
+    {
+        struct ibv_port_attr pa;
+        ret = ibv_query_port(ctx, port, &pa);
+        CHECK(ret == 0, "ibv_query_port fail");
+        const bool eth = pa.link_layer == IBV_LINK_LAYER_ETHERNET;
+        const double gbps = speed_to_gbps(pa.active_speed) * width_to_lanes(pa.active_width);
+        printf("%s{\"port\":%d,\"state\":\"%s\",\"link_layer\":\"%s\",\"active_mtu\":%d,"
+               "\"max_mtu\":%d,\"lid\":%u,\"speed_gbps\":%.2f,\"width\":%d,\"gids\":[",
+               port > 1 ? "," : "", port, port_state_str(pa.state), eth ? "Ethernet" : "InfiniBand",
+               mtu_to_num(pa.active_mtu), mtu_to_num(pa.max_mtu), pa.lid, gbps,
+               width_to_lanes(pa.active_width));
+
+        // the first RoCEv2 gid with an IPv4 address, like modify_qp_simple picks it
+        static const uint8_t v4_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        int rec_gid = eth ? -1 : 0, rec_score = 0;
+        bool first = true;
+        for (int i = 0; i < pa.gid_tbl_len; i++)
+        {
+            struct ibv_gid_entry entry;
+            if (ibv_query_gid_ex(ctx, port, i, &entry, 0) != 0)
+            {
+                continue; // empty slot
+            }
+            char addr[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, entry.gid.raw, addr, sizeof(addr));
+            const std::string ndev = read_sysfs(sys + "/ports/" + std::to_string(port) +
+                                                "/gid_attrs/ndevs/" + std::to_string(i));
+            printf("%s{\"index\":%d,\"gid\":\"%s\",\"type\":\"%s\",\"netdev\":\"%s\"}",
+                   first ? "" : ",", i, addr, gid_type_str(entry.gid_type), ndev.c_str());
+            first = false;
+            if (eth && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+            {
+                int score = memcmp(entry.gid.raw, v4_prefix, sizeof(v4_prefix)) == 0 ? 2 : 1;
+                if (score > rec_score)
+                {
+                    rec_score = score;
+                    rec_gid = i;
+                }
+            }
+        }
+        printf("],\"recommended_gid_index\":%d}", rec_gid);
+        if (pa.state == IBV_PORT_ACTIVE && rec_gid >= 0 && gbps >= best_gbps)
+        {
+            best_gbps = gbps;
+            best_mtu = mtu_to_num(pa.active_mtu);
+            best_port = port;
+            best_gid = rec_gid;
+        }
+    }
+    printf("],");
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    std::vector<int> cores;
+    for (int c : parse_cpulist(local_cpus))
+    {
+        if (c < CPU_SETSIZE && CPU_ISSET(c, &allowed))
+        {
+            cores.push_back(c);
+        }
+    }
+    if (cores.empty())
+    {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+        {
+            if (CPU_ISSET(c, &allowed))
+            {
+                cores.push_back(c);
+            }
+        }
+    }
+    const int workers = std::max(1, std::min<int>(cores.size(), ctx->num_comp_vectors));
+    const uint64_t bdp = best_gbps * 1e9 / 8 * 10e-6;
+    const int qp_depth = std::min<int>(std::max<uint32_t>(next_pow2(bdp / best_mtu), 64), attr.max_qp_wr);
+    const int cq_depth = std::min(16 * 2 * qp_depth, attr.max_cqe);
+
+    printf("\"recommended\":{\"port\":%d,\"gid_index\":%d,\"workers\":%d,\"qp_depth\":%d,"
+           "\"cq_depth\":%d,\"max_send_sge\":%d,\"max_rd_atomic\":%d,\"cores\":[",
+           best_port, best_gid, workers, qp_depth, cq_depth, std::min(30, attr.max_sge),
+           attr.max_qp_init_rd_atom);
+    for (size_t i = 0; i < cores.size(); i++)
+    {
+        printf("%s%d", i ? "," : "", cores[i]);
+    }
+    printf("]}}%s\n", last ? "" : ",");
+}
+
 int main(int argc, char *argv[])
 {
+    const bool json = argc > 1 && strcmp(argv[1], "-j") == 0;
     struct ibv_device **devs;
     int num_devs;
     // 查询RDMA设备列表
     devs = ibv_get_device_list(&num_devs);
     if (devs == nullptr || num_devs == 0)
     {
+        if (json)
+        {
+            printf("{\"devices\":[\n]}\n");
+            return 0;
+        }
         printf("NO RDMA device found!\n");
         return 0;
     }
+    if (json)
+    {
+        printf("{\"devices\":[\n");
+    }
     // 依次查询所有RDMA设备的信息
     for (int i = 0; i < num_devs; i++)
     {
-        printf("------- RDMA device %d -------\n", i);
+        if (!json)
+        {
+            printf("------- RDMA device %d -------\n", i);
+        }
         // 获取设备名字
         const char *name = ibv_get_device_name(devs[i]);
         CHECK(name != nullptr, "ibv_get_device_name fail");
         // 打开设备
         struct ibv_context *ctx = ibv_open_device(devs[i]);
         CHECK(ctx, "ibv_open_device fail");
+        if (json)
+        {
+            print_json(devs[i], ctx, i == num_devs - 1);
+            ibv_close_device(ctx);
+            continue;
+        }
         // 并查询设备详细信息
         struct ibv_device_attr attr;
         int ret = ibv_query_device(ctx, &attr);
@@ -80,6 +396,10 @@ int main(int argc, char *argv[])
                attr.max_qp_rd_atom);
         ibv_close_device(ctx);
     }
+    if (json)
+    {
+        printf("]}\n");
+    }
     ibv_free_device_list(devs);
     return 0;
 }
@@ -0,0 +1,367 @@
+/**
+ * Example of a memory registration cache (pin-down cache). If you have no
+ * RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE).
+ *
+ * reg_mr.cpp registers every buffer it sends. An application that sends
+ * from arbitrary heap buffers pays ibv_reg_mr again and again for the same
+ * pages. The cache keeps the mr of recently used address ranges, hands it
+ * out again when a buffer falls inside one, evicts the least recently used
+ * mr when the pinned bytes exceed a limit, and drops the mr of a range that
+ * is freed or unmapped.
+ *
+ * g++ -O2 reg_cache.cpp -libverbs -o reg_cache
+ * ./reg_cache [limit_mb]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <list>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Registration cache.
+ *
+ * Cached ranges are page aligned and never overlap, so a std::map keyed by
+ * the start address works as the interval tree: the only candidate covering
+ * addr is the last range starting at or before it. When a new buffer
+ * overlaps cached ranges, they are merged into one larger registration and
+ * the old ones are retired.
+ *
+ * get() pins an entry until the matching put(). Entries in use are never
+ * deregistered, a retired or invalidated entry in use is deregistered by
+ * its last put().
+ */
+class reg_cache
+{
+public:
+    struct entry
+    {
+        uint64_t start;
+        uint64_t end;
+        struct ibv_mr *mr;
+        int refs;
+        bool cached; // still in the map and lru list
+        std::list<entry *>::iterator lru_it;
+    };
+
+    struct stats
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t merges = 0;
+        uint64_t evictions = 0;
+        uint64_t invalidations = 0;
+        uint64_t failures = 0; // over the pinned limit with everything in use
+        uint64_t pinned_bytes = 0;
+        uint64_t entries = 0;
+    };
+
+    reg_cache(struct ibv_pd *pd, uint64_t max_pinned, int access)
+        : pd_(pd), max_pinned_(max_pinned), access_(access), page_(sysconf(_SC_PAGESIZE))
+    {
+    }
+    ~reg_cache()
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto &kv : ranges_)
+        {
+            ibv_dereg_mr(kv.second->mr);
+            delete kv.second;
+        }
+    }
+
+    // nullptr if the range can not be registered within the pinned limit
+    entry *get(void *addr, uint64_t length)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        uint64_t start = (uint64_t)addr & ~(page_ - 1);
+        uint64_t end = ((uint64_t)addr + length + page_ - 1) & ~(page_ - 1);
+
+        entry *e = find(start);
+        if (e && e->end >= end)
+        {
+            stats_.hits++;
+            e->refs++;
+            lru_.splice(lru_.end(), lru_, e->lru_it);
+            return e;
+        }
+        stats_.misses++;
+
+        // merge all cached ranges overlapping [start, end)
+        auto it = ranges_.lower_bound(start);
+        if (it != ranges_.begin() && std::prev(it)->second->end > start)
+        {
+            --it;
+        }
+        while (it != ranges_.end() && it->second->start < end)
+        {
+            entry *old = it->second;
+            ++it;
+            start = std::min(start, old->start);
+            end = std::max(end, old->end);
+            stats_.merges++;
+            retire(old);
+        }
+
+        const uint64_t size = end - start;
+        while (stats_.pinned_bytes + size > max_pinned_ && evict_one())
+        {
+        }
+        if (stats_.pinned_bytes + size > max_pinned_)
+        {
+            stats_.failures++;
+            return nullptr;
+        }
+        struct ibv_mr *mr = ibv_reg_mr(pd_, (void *)start, size, access_);
+        if (mr == nullptr)
+        {
+            stats_.failures++;
+            return nullptr;
+        }
+        e = new entry;
+        e->start = start;
+        e->end = end;
+        e->mr = mr;
+        e->refs = 1;
+        e->cached = true;
+        e->lru_it = lru_.insert(lru_.end(), e);
+        ranges_[start] = e;
+        stats_.pinned_bytes += size;
+        stats_.entries++;
+        return e;
+    }
+
+    void put(entry *e)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        e->refs--;
+        if (e->refs == 0 && !e->cached)
+        {
+            destroy(e);
+        }
+    }
+
+    /**
+     * The pages of [addr, addr+length) are going away, drop every mr that
+     * covers any of them. Must be called before free/munmap returns memory
+     * to the system, rc_free/rc_munmap below do it for you.
+     */
+    void invalidate(void *addr, uint64_t length)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        uint64_t start = (uint64_t)addr;
+        uint64_t end = start + length;
+        auto it = ranges_.lower_bound(start);
+        if (it != ranges_.begin() && std::prev(it)->second->end > start)
+        {
+            --it;
+        }
+        while (it != ranges_.end() && it->second->start < end)
+        {
+            entry *e = it->second;
+            ++it;
+            stats_.invalidations++;
+            retire(e);
+        }
+    }
+
+    stats get_stats()
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        return stats_;
+    }
+
+private:
+    entry *find(uint64_t addr)
+    {
+        auto it = ranges_.upper_bound(addr);
+        if (it == ranges_.begin())
+        {
+            return nullptr;
+        }
+        --it;
+        return it->second->end > addr ? it->second : nullptr;
+    }
+
+    // take e out of the cache, deregister now or on its last put()
+    void retire(entry *e)
+    {
+        ranges_.erase(e->start);
+        lru_.erase(e->lru_it);
+        e->cached = false;
+        stats_.entries--;
+        if (e->refs == 0)
+        {
+            destroy(e);
+        }
+    }
+
+    void destroy(entry *e)
+    {
+        stats_.pinned_bytes -= e->end - e->start;
+        ibv_dereg_mr(e->mr);
+        delete e;
+    }
+
+    bool evict_one()
+    {
+        for (entry *e : lru_)
+        {
+            if (e->refs == 0)
+            {
+                stats_.evictions++;
+                retire(e);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    struct ibv_pd *pd_;
+    const uint64_t max_pinned_;
+    const int access_;
+    const uint64_t page_;
+    std::mutex mu_;
+    std::map<uint64_t, entry *> ranges_;
+    std::list<entry *> lru_; // front is the least recently used
+    stats stats_;
+};
+
+// free/munmap wrappers which keep the cache coherent
+void rc_free(reg_cache &rc, void *p)
+{
+    if (p)
+    {
+        rc.invalidate(p, malloc_usable_size(p));
+    }
+    free(p);
+}
+int rc_munmap(reg_cache &rc, void *addr, size_t length)
+{
+    rc.invalidate(addr, length);
+    return munmap(addr, length);
+}
+
+void print_stats(reg_cache &rc)
+{
+    reg_cache::stats s = rc.get_stats();
+    printf("hits=%lu, misses=%lu, hit_rate=%.3f, merges=%lu, evictions=%lu, "
+           "invalidations=%lu, failures=%lu, entries=%lu, pinned_bytes=%lu\n",
+           s.hits, s.misses, (s.hits + s.misses) ? (double)s.hits / (s.hits + s.misses) : 0.0,
+           s.merges, s.evictions, s.invalidations, s.failures, s.entries, s.pinned_bytes);
+}
+
+int main(int argc, char *argv[])
+{
+    const uint64_t limit_mb = argc > 1 ? strtoull(argv[1], nullptr, 10) : 16;
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+
+    const int access = IBV_ACCESS_LOCAL_WRITE |
+                       IBV_ACCESS_REMOTE_WRITE |
+                       IBV_ACCESS_REMOTE_READ;
+    {
+        reg_cache rc(pd, limit_mb * 1024 * 1024, access);
+
+        // a working set of heap buffers, messages are sent from random slices of them
+        const int nbufs = 64;
+        const uint64_t buf_size = 256 * 1024;
+        std::vector<char *> bufs;
+        for (int i = 0; i < nbufs; i++)
+        {
+            char *p = (char *)malloc(buf_size);
+            CHECK(p, "malloc fail");
+            memset(p, i, buf_size);
+            bufs.push_back(p);
+        }
+
+        const int rounds = 100000;
+        uint64_t seed = 1;
+        uint64_t start = now_ns();
+        for (int i = 0; i < rounds; i++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            char *p = bufs[(seed >> 33) % nbufs];
+            uint64_t off = (seed >> 20) % (buf_size / 2);
+            reg_cache::entry *e = rc.get(p + off, buf_size / 4);
+            CHECK(e, "reg_cache get fail");
+            // the sge would be {p + off, buf_size / 4, e->mr->lkey} here
+            rc.put(e);
+        }
+        printf("cached: %.1f ns per get/put\n", (double)(now_ns() - start) / rounds);
+        print_stats(rc);
+
+        // no cache: register and deregister every time
+        const int uncached_rounds = 1000;
+        start = now_ns();
+        for (int i = 0; i < uncached_rounds; i++)
+        {
+            struct ibv_mr *mr = ibv_reg_mr(pd, bufs[i % nbufs], buf_size / 4, access);
+            CHECK(mr, "ibv_reg_mr fail");
+            ibv_dereg_mr(mr);
+        }
+        printf("uncached: %.1f ns per ibv_reg_mr/ibv_dereg_mr\n",
+               (double)(now_ns() - start) / uncached_rounds);
+
+        // freeing the buffers drops their registrations
+        for (auto p : bufs)
+        {
+            rc_free(rc, p);
+        }
+        print_stats(rc);
+
+        // same for an mmap'ed buffer
+        const uint64_t map_size = 1024 * 1024;
+        void *m = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        CHECK(m != MAP_FAILED, "mmap fail");
+        reg_cache::entry *e = rc.get(m, map_size);
+        CHECK(e, "reg_cache get fail");
+        printf("mmap buffer: lkey=%u, rkey=%u\n", e->mr->lkey, e->mr->rkey);
+        rc.put(e);
+        rc_munmap(rc, m, map_size);
+        print_stats(rc);
+    }
+
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,449 @@
+/**
+ * Example of doorbell batching and selective signaling. If you have no
+ * RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE).
+ *
+ * poll_cq.cpp rings the doorbell once per message (one ibv_post_send per
+ * wr) and asks for a cqe for every wr (IBV_SEND_SIGNALED). send_queue
+ * below links work requests by `next` and posts a whole chain with one
+ * ibv_post_send, and only every Nth wr is signaled.
+ *
+ * Slot accounting: RC completes the send queue in order, so the cqe of a
+ * signaled wr means every wr posted before it is done as well. wr_id holds
+ * the sequence number of the wr, in-flight = next_seq - completed_seq.
+ * A wr is forced to be signaled when it is the last free slot, so the send
+ * queue can never fill up with only unsignaled wrs, which would never be
+ * reaped and overflow max_send_wr.
+ *
+ * g++ -O2 send_batch.cpp -libverbs -o send_batch
+ * ./send_batch [-o write|send] [-d depth] [-b batch] [-N signal_every] [-s size] [-n msgs]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int io_depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    init_attr.cap.max_recv_wr = io_depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    // cqe only for the wrs posted with IBV_SEND_SIGNALED
+    init_attr.sq_sig_all = 0;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+/**
+ * Send queue with doorbell batching and selective signaling.
+ *
+ * post() only queues the wr into the pending chain, the chain is handed to
+ * the device by flush(), or automatically when it reaches max_batch wrs.
+ * wr and sge storage is a ring of max_send_wr entries indexed by sequence
+ * number, a slot is reused only after its wr is known to be complete.
+ */
+class send_queue
+{
+public:
+    send_queue(struct ibv_qp *qp, int max_send_wr, int max_batch, int signal_every)
+        : qp_(qp), depth_(max_send_wr), max_batch_(std::min(max_batch, max_send_wr)),
+          signal_every_(std::max(1, std::min(signal_every, max_send_wr))),
+          wrs_(max_send_wr), sges_(max_send_wr)
+    {
+    }
+
+    // free slots, counting the wrs still pending in the chain
+    int available() const { return depth_ - (int)(next_seq_ - completed_seq_); }
+    uint64_t completed_seq() const { return completed_seq_; }
+    uint64_t doorbells() const { return doorbells_; }
+    uint64_t signaled() const { return signaled_; }
+
+    /**
+     * Queue one wr. Returns false when the send queue is full, the caller
+     * has to reap completions (on_wc) first. The last wr of a stream has to
+     * be posted with force_signal, or its completion is never reported.
+     */
+    bool post(enum ibv_wr_opcode opcode, uint64_t addr, uint32_t length, uint32_t lkey,
+              uint64_t remote_addr = 0, uint32_t rkey = 0, bool force_signal = false)
+    {
+        if (available() == 0)
+        {
+            return false;
+        }
+        const uint64_t seq = next_seq_++;
+        const int slot = seq % depth_;
+        struct ibv_sge &sge = sges_[slot];
+        sge.addr = addr;
+        sge.length = length;
+        sge.lkey = lkey;
+        struct ibv_send_wr &wr = wrs_[slot];
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = seq;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = opcode;
+        wr.wr.rdma.remote_addr = remote_addr;
+        wr.wr.rdma.rkey = rkey;
+        // every Nth wr, and the wr taking the last free slot
+        if (++unsignaled_ >= signal_every_ || available() == 0 || force_signal)
+        {
+            wr.send_flags = IBV_SEND_SIGNALED;
+            unsignaled_ = 0;
+            signaled_++;
+        }
+        if (pending_tail_)
+        {
+            pending_tail_->next = &wr;
+        }
+        else
+        {
+            pending_head_ = &wr;
+        }
+        pending_tail_ = &wr;
+        pending_++;
+        if (pending_ >= max_batch_)
+        {
+            flush();
+        }
+        return true;
+    }
+
+    // ring the doorbell once for the whole pending chain
+    void flush()
+    {
+        if (pending_head_ == nullptr)
+        {
+            return;
+        }
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, pending_head_, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+        doorbells_++;
+        pending_head_ = pending_tail_ = nullptr;
+        pending_ = 0;
+    }
+
+    // feed every send side wc of this qp here
+    void on_wc(const struct ibv_wc &wc)
+    {
+        if (wc.status != IBV_WC_SUCCESS)
+        {
+            printf("bad wc, status=%s, seq=%lu\n", ibv_wc_status_str(wc.status), wc.wr_id);
+        }
+        CHECK(wc.status == IBV_WC_SUCCESS, "bad send wc");
+        // in order completion, everything up to wr_id is done
+        completed_seq_ = std::max(completed_seq_, wc.wr_id + 1);
+    }
+
+private:
+    struct ibv_qp *qp_;
+    const int depth_;
+    const int max_batch_;
+    const int signal_every_;
+    std::vector<struct ibv_send_wr> wrs_;
+    std::vector<struct ibv_sge> sges_;
+    struct ibv_send_wr *pending_head_ = nullptr;
+    struct ibv_send_wr *pending_tail_ = nullptr;
+    int pending_ = 0;
+    uint64_t next_seq_ = 0;
+    uint64_t completed_seq_ = 0;
+    int unsignaled_ = 0; // wrs since the last signaled one
+    uint64_t doorbells_ = 0;
+    uint64_t signaled_ = 0;
+};
+
+struct loopback
+{
+    struct ibv_cq *cq;
+    struct ibv_qp *sqp; // sender
+    struct ibv_qp *rqp; // receiver
+    char *buf;
+    struct ibv_mr *mr;
+    uint32_t size;
+};
+
+void post_recvs(loopback &lb, int n)
+{
+    std::vector<struct ibv_sge> sges(n);
+    std::vector<struct ibv_recv_wr> wrs(n);
+    for (int i = 0; i < n; i++)
+    {
+        sges[i].addr = (uint64_t)lb.buf + lb.size;
+        sges[i].length = lb.size;
+        sges[i].lkey = lb.mr->lkey;
+        memset(&wrs[i], 0, sizeof(wrs[i]));
+        wrs[i].sg_list = &sges[i];
+        wrs[i].num_sge = 1;
+        wrs[i].next = i + 1 < n ? &wrs[i + 1] : nullptr;
+    }
+    struct ibv_recv_wr *bad_wr = nullptr;
+    int ret = ibv_post_recv(lb.rqp, wrs.data(), &bad_wr);
+    CHECK(ret == 0, "ibv_post_recv fail");
+}
+
+/**
+ * Push msgs messages through send_queue. batch=1 and signal_every=1 is the
+ * same as posting every wr on its own with IBV_SEND_SIGNALED.
+ */
+void run(loopback &lb, int depth, bool use_send, int batch, int signal_every, int msgs)
+{
+    send_queue sq(lb.sqp, depth, batch, signal_every);
+    const enum ibv_wr_opcode opcode = use_send ? IBV_WR_SEND : IBV_WR_RDMA_WRITE;
+    int to_repost = 0;
+    uint64_t cqes = 0;
+    int queued = 0;
+    std::vector<struct ibv_wc> wcs(depth * 2);
+    const uint64_t start = now_ns();
+    while (sq.completed_seq() < (uint64_t)msgs)
+    {
+        while (queued < msgs && sq.post(opcode, (uint64_t)lb.buf, lb.size, lb.mr->lkey,
+                                        (uint64_t)lb.buf + lb.size, lb.mr->rkey,
+                                        queued == msgs - 1))
+        {
+            queued++;
+        }
+        sq.flush();
+        int n = ibv_poll_cq(lb.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        cqes += n;
+        for (int i = 0; i < n; i++)
+        {
+            if (wcs[i].qp_num == lb.sqp->qp_num)
+            {
+                sq.on_wc(wcs[i]);
+            }
+            else
+            {
+                CHECK(wcs[i].status == IBV_WC_SUCCESS, "bad recv wc");
+                to_repost++;
+            }
+        }
+        // repost all receives reaped by this poll as one chain
+        if (to_repost > 0)
+        {
+            post_recvs(lb, to_repost);
+            to_repost = 0;
+        }
+    }
+    const double secs = (now_ns() - start) / 1e9;
+    printf("%-5s %6d %6d %12.0f %10lu %10lu %10lu\n", use_send ? "send" : "write",
+           batch, signal_every, msgs / secs, sq.doorbells(), sq.signaled(), cqes);
+}
+
+int main(int argc, char *argv[])
+{
+    bool use_send = false;
+    int depth = 128;
+    int batch = 16;
+    int signal_every = 16;
+    uint32_t size = 64;
+    int msgs = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:d:b:N:s:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'o':
+            use_send = strcmp(optarg, "send") == 0;
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'N':
+            signal_every = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'n':
+            msgs = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-o write|send] [-d depth] [-b batch] [-N signal_every] "
+                   "[-s size] [-n msgs]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(depth > 0 && batch > 0 && signal_every > 0 && size > 0 && msgs > 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    loopback lb;
+    lb.size = size;
+    lb.cq = ibv_create_cq(ctx, depth * 4, nullptr, nullptr, 0);
+    CHECK(lb.cq, "ibv_create_cq fail");
+    lb.sqp = create_qp(pd, lb.cq, depth);
+    lb.rqp = create_qp(pd, lb.cq, depth);
+    init_qp(lb.sqp);
+    init_qp(lb.rqp);
+    modify_to_rtr(lb.sqp, path, lb.rqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rtr(lb.rqp, path, lb.sqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rts(lb.sqp, 0);
+    modify_to_rts(lb.rqp, 0);
+    // first half is the source, second half the target of write/send
+    lb.buf = (char *)aligned_alloc(4096, (size * 2 + 4095) / 4096 * 4096);
+    CHECK(lb.buf, "aligned_alloc fail");
+    memset(lb.buf, 'x', size * 2);
+    lb.mr = ibv_reg_mr(pd, lb.buf, size * 2,
+                       IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_WRITE |
+                           IBV_ACCESS_REMOTE_READ);
+    CHECK(lb.mr, "ibv_reg_mr fail");
+    post_recvs(lb, depth);
+
+    printf("%-5s %6s %6s %12s %10s %10s %10s\n",
+           "op", "batch", "signal", "msgs/s", "doorbells", "signaled", "cqes");
+    // baseline: one doorbell and one cqe per message
+    run(lb, depth, use_send, 1, 1, msgs);
+    run(lb, depth, use_send, batch, signal_every, msgs);
+
+    ibv_destroy_qp(lb.sqp);
+    ibv_destroy_qp(lb.rqp);
+    ibv_destroy_cq(lb.cq);
+    ibv_dereg_mr(lb.mr);
+    free(lb.buf);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,475 @@
+/**
+ * Example of a zero-copy scatter-gather send API. If you have no RDMA
+ * hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE).
+ *
+ * create_qp reserves max_send_sge = 30, but poll_cq.cpp memcpy's the
+ * payload into one registered buffer and posts a single sge. Here a record
+ * made of fragments living in different registered regions (header pool,
+ * application body, trailer) is described by an iovec and mapped straight
+ * onto the sge list of the wr, the HCA gathers the bytes, the CPU copies
+ * nothing.
+ *
+ * When there are more fragments than the qp's max_send_sge they are split
+ * across wrs linked by `next` and posted with one ibv_post_send. Every wr
+ * but the last is a plain SEND, the last one is SEND_WITH_IMM carrying the
+ * total record length, so the receiver knows where a record ends (RC
+ * delivers them in order). Only the last wr is signaled.
+ *
+ * g++ -O2 sg_send.cpp -libverbs -o sg_send
+ * ./sg_send [-b body_size] [-f fragments] [-n records]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define RECV_BUF_SIZE (64 * 1024)
+#define HEADER_SIZE 32
+#define TRAILER_SIZE 16
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// create_qp reports the real capacity back in *max_sge
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int io_depth, int *max_sge)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    init_attr.cap.max_recv_wr = io_depth;
+    init_attr.cap.max_send_sge = *max_sge;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    *max_sge = init_attr.cap.max_send_sge;
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+// one fragment of a record, must live in registered memory
+struct rdma_iov
+{
+    const void *addr;
+    uint32_t length;
+    uint32_t lkey;
+};
+
+// sge and wr arrays of one qp, sized once for a full sq and reused by every post
+struct sg_scratch
+{
+    std::vector<struct ibv_sge> sges;    // max_send_wr * max_sge
+    std::vector<struct ibv_send_wr> wrs; // max_send_wr
+};
+
+/**
+ * Post a record of `n` fragments. Fragments are packed into wrs of at
+ * most max_sge sges, the wrs are chained and posted with one doorbell.
+ * Returns the number of wrs used, the last one is signaled with wr_id.
+ * The caller must keep the fragments untouched until that completion.
+ */
+int sg_send(struct ibv_qp *qp, int max_sge, sg_scratch &scratch, const rdma_iov *iov, int n, uint64_t wr_id)
+{
+    const int nwr = (n + max_sge - 1) / max_sge;
+    CHECK(nwr <= (int)scratch.wrs.size(), "record needs more wrs than the sq holds");
+    struct ibv_sge *sges = scratch.sges.data();
+    struct ibv_send_wr *wrs = scratch.wrs.data();
+    uint64_t total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        sges[i].addr = (uint64_t)iov[i].addr;
+        sges[i].length = iov[i].length;
+        sges[i].lkey = iov[i].lkey;
+        total += iov[i].length;
+    }
+    for (int w = 0; w < nwr; w++)
+    {
+        struct ibv_send_wr &wr = wrs[w];
+        memset(&wr, 0, sizeof(wr));
+        wr.sg_list = &sges[w * max_sge];
+        wr.num_sge = std::min(max_sge, n - w * max_sge);
+        wr.opcode = IBV_WR_SEND;
+        wr.next = w + 1 < nwr ? &wrs[w + 1] : nullptr;
+    }
+    struct ibv_send_wr &last = wrs[nwr - 1];
+    last.opcode = IBV_WR_SEND_WITH_IMM;
+    last.imm_data = htonl(total);
+    last.wr_id = wr_id;
+    last.send_flags = IBV_SEND_SIGNALED;
+    struct ibv_send_wr *bad_wr = nullptr;
+    int ret = ibv_post_send(qp, wrs, &bad_wr);
+    CHECK(ret == 0, "ibv_post_send fail");
+    return nwr;
+}
+
+struct region
+{
+    char *buf;
+    uint64_t size;
+    struct ibv_mr *mr;
+};
+
+region make_region(struct ibv_pd *pd, uint64_t size)
+{
+    region r;
+    r.size = (size + 4095) / 4096 * 4096;
+    r.buf = (char *)aligned_alloc(4096, r.size);
+    CHECK(r.buf, "aligned_alloc fail");
+    r.mr = ibv_reg_mr(pd, r.buf, r.size, IBV_ACCESS_LOCAL_WRITE);
+    CHECK(r.mr, "ibv_reg_mr fail");
+    return r;
+}
+void free_region(region &r)
+{
+    ibv_dereg_mr(r.mr);
+    free(r.buf);
+}
+
+struct loopback
+{
+    struct ibv_cq *cq;
+    struct ibv_qp *sqp;
+    struct ibv_qp *rqp;
+    int max_sge;
+    int depth;
+    sg_scratch scratch;
+    region recv; // depth receive buffers
+};
+
+void post_recv(loopback &lb, uint64_t idx)
+{
+    struct ibv_sge sge;
+    sge.addr = (uint64_t)lb.recv.buf + idx * RECV_BUF_SIZE;
+    sge.length = RECV_BUF_SIZE;
+    sge.lkey = lb.recv.mr->lkey;
+    struct ibv_recv_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = idx;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    struct ibv_recv_wr *bad_wr = nullptr;
+    int ret = ibv_post_recv(lb.rqp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_recv fail");
+}
+
+/**
+ * Send `records` records of header + body (split in `frags` pieces) +
+ * trailer. zero_copy=false memcpy's them into one staging slot first,
+ * which is what the examples do today. With verify the receiver
+ * reassembles every record and compares it byte by byte.
+ */
+void run(loopback &lb, struct ibv_pd *pd, bool zero_copy, uint32_t body_size, int frags,
+         int records, bool verify)
+{
+    const uint32_t record_size = HEADER_SIZE + body_size + TRAILER_SIZE;
+    CHECK(record_size <= RECV_BUF_SIZE, "record too large");
+    region headers = make_region(pd, (uint64_t)lb.depth * HEADER_SIZE);
+    region body = make_region(pd, body_size);
+    region trailers = make_region(pd, (uint64_t)lb.depth * TRAILER_SIZE);
+    region staging = make_region(pd, (uint64_t)lb.depth * record_size);
+    for (uint32_t i = 0; i < body_size; i++)
+    {
+        body.buf[i] = 'a' + i % 26;
+    }
+
+    // every record has the same shape, so the same number of wrs. Bound the
+    // wrs, not the records: sends not completed yet hold sq entries, and
+    // wrs not received yet hold posted receives.
+    const uint32_t piece = (body_size + frags - 1) / frags;
+    const int pieces = (body_size + piece - 1) / piece;
+    const int record_wrs = zero_copy ? (pieces + 2 + lb.max_sge - 1) / lb.max_sge : 1;
+    CHECK(record_wrs <= lb.depth, "record needs more wrs than the sq holds");
+    std::vector<rdma_iov> iov;
+    std::string expect, got;
+    int posted = 0, received = 0;
+    int send_wrs = 0, recv_wrs = 0;
+    uint64_t wrs = 0, copied = 0;
+    std::vector<struct ibv_wc> wcs(64);
+    const uint64_t start = now_ns();
+    while (received < records)
+    {
+        while (posted < records && send_wrs + record_wrs <= lb.depth && recv_wrs + record_wrs <= lb.depth)
+        {
+            const int slot = posted % lb.depth;
+            char *h = headers.buf + slot * HEADER_SIZE;
+            char *t = trailers.buf + slot * TRAILER_SIZE;
+            snprintf(h, HEADER_SIZE, "record %d", posted);
+            snprintf(t, TRAILER_SIZE, "end %d", posted);
+
+            iov.clear();
+            iov.push_back({h, HEADER_SIZE, headers.mr->lkey});
+            for (uint32_t off = 0; off < body_size; off += piece)
+            {
+                iov.push_back({body.buf + off, std::min(piece, body_size - off), body.mr->lkey});
+            }
+            iov.push_back({t, TRAILER_SIZE, trailers.mr->lkey});
+
+            int nwr;
+            if (zero_copy)
+            {
+                nwr = sg_send(lb.sqp, lb.max_sge, lb.scratch, iov.data(), iov.size(), posted);
+            }
+            else
+            {
+                char *dst = staging.buf + (uint64_t)slot * record_size;
+                uint32_t off = 0;
+                for (auto &v : iov)
+                {
+                    memcpy(dst + off, v.addr, v.length);
+                    off += v.length;
+                }
+                copied += off;
+                rdma_iov one = {dst, off, staging.mr->lkey};
+                nwr = sg_send(lb.sqp, lb.max_sge, lb.scratch, &one, 1, posted);
+            }
+            CHECK(nwr == record_wrs, "unexpected wr count");
+            wrs += nwr;
+            send_wrs += nwr;
+            recv_wrs += nwr;
+            posted++;
+        }
+        int n = ibv_poll_cq(lb.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs[i];
+            CHECK(wc.status == IBV_WC_SUCCESS, "bad wc");
+            if (wc.qp_num == lb.sqp->qp_num)
+            {
+                send_wrs -= record_wrs;
+                continue;
+            }
+            recv_wrs--;
+            if (verify)
+            {
+                got.append(lb.recv.buf + wc.wr_id * RECV_BUF_SIZE, wc.byte_len);
+            }
+            post_recv(lb, wc.wr_id);
+            if (!(wc.wc_flags & IBV_WC_WITH_IMM))
+            {
+                continue; // more of the record follows
+            }
+            if (verify)
+            {
+                CHECK(ntohl(wc.imm_data) == record_size, "bad record length");
+                char h[HEADER_SIZE] = {0}, t[TRAILER_SIZE] = {0};
+                snprintf(h, HEADER_SIZE, "record %d", received);
+                snprintf(t, TRAILER_SIZE, "end %d", received);
+                expect.assign(h, HEADER_SIZE);
+                expect.append(body.buf, body_size);
+                expect.append(t, TRAILER_SIZE);
+                CHECK(got == expect, "record mismatch");
+                got.clear();
+            }
+            received++;
+        }
+    }
+    const double secs = (now_ns() - start) / 1e9;
+    printf("%-9s fragments=%zu, wrs/record=%.1f, %.0f records/s, %.2f MB/s, cpu copied=%lu MB%s\n",
+           zero_copy ? "zero-copy" : "copy", iov.size(), (double)wrs / records, records / secs,
+           (double)records * record_size / secs / 1e6, copied >> 20, verify ? ", verified" : "");
+    free_region(headers);
+    free_region(body);
+    free_region(trailers);
+    free_region(staging);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t body_size = 8192;
+    int frags = 1;
+    int records = 100000;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:f:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            body_size = atoi(optarg);
+            break;
+        case 'f':
+            frags = atoi(optarg);
+            break;
+        case 'n':
+            records = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-b body_size] [-f fragments] [-n records]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(body_size > 0 && frags > 0 && (uint32_t)frags <= body_size && records > 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    struct ibv_device_attr dev_attr;
+    int ret = ibv_query_device(ctx, &dev_attr);
+    CHECK(ret == 0, "ibv_query_device fail");
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    loopback lb;
+    lb.depth = 256;
+    lb.cq = ibv_create_cq(ctx, lb.depth * 2, nullptr, nullptr, 0);
+    CHECK(lb.cq, "ibv_create_cq fail");
+    lb.max_sge = std::min(30, dev_attr.max_sge);
+    lb.sqp = create_qp(pd, lb.cq, lb.depth, &lb.max_sge);
+    int recv_sge = 1;
+    lb.rqp = create_qp(pd, lb.cq, lb.depth, &recv_sge);
+    printf("device max_sge=%d, qp max_send_sge=%d\n", dev_attr.max_sge, lb.max_sge);
+    lb.scratch.sges.resize((size_t)lb.depth * lb.max_sge);
+    lb.scratch.wrs.resize(lb.depth);
+    init_qp(lb.sqp);
+    init_qp(lb.rqp);
+    modify_to_rtr(lb.sqp, path, lb.rqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rtr(lb.rqp, path, lb.sqp->qp_num, 0, port_attr.lid, gid);
+    modify_to_rts(lb.sqp, 0);
+    modify_to_rts(lb.rqp, 0);
+    lb.recv = make_region(pd, (uint64_t)lb.depth * RECV_BUF_SIZE);
+    for (int i = 0; i < lb.depth; i++)
+    {
+        post_recv(lb, i);
+    }
+
+    // correctness first, including a record with more fragments than max_sge
+    run(lb, pd, true, body_size, frags, 100, true);
+    run(lb, pd, true, std::max<uint32_t>(body_size, lb.max_sge * 4), lb.max_sge * 2, 100, true);
+    run(lb, pd, false, body_size, frags, records, false);
+    run(lb, pd, true, body_size, frags, records, false);
+
+    ibv_destroy_qp(lb.sqp);
+    ibv_destroy_qp(lb.rqp);
+    ibv_destroy_cq(lb.cq);
+    free_region(lb.recv);
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,783 @@
+/**
+ * Example of a multi-threaded sharded I/O engine. If you have no RDMA
+ * hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE).
+ *
+ * poll_cq.cpp shares one cq between its qps and drains it from one thread.
+ * Here every worker thread is pinned to a core, owns its own cq and the qps
+ * of its connections (conn_id % workers), and is the only thread touching
+ * them, so the data path takes no lock. Other threads hand work to a worker
+ * through a lock-free bounded MPSC queue. Cores on the NUMA node of the
+ * NIC (from sysfs) are used first.
+ *
+ * The benchmark runs 1..N workers, each keeping `depth` RDMA WRITEs in
+ * flight on every connection it owns, then again with the messages
+ * submitted from foreign producer threads through the MPSC queues.
+ *
+ * With -p the cores, gid index and queue depth limit are taken from a
+ * profile written by `query_device -j` instead of probing sysfs again.
+ *
+ * g++ -O2 sharded_engine.cpp -libverbs -lpthread -o sharded_engine
+ * ./sharded_engine [-w max_workers] [-c conns_per_worker] [-d depth] [-s size] [-T seconds]
+ *                  [-p profile.json]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define MAX_PAYLOAD 56
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int io_depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    init_attr.cap.max_recv_wr = 1;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = MAX_PAYLOAD;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+/**
+ * Bounded lock-free MPSC queue (Vyukov's bounded queue). Every cell has a
+ * sequence number telling whether it is free for the producer of lap k or
+ * filled for the consumer of lap k. Producers claim a position by CAS, the
+ * single consumer needs no atomic read-modify-write at all.
+ */
+template <typename T>
+class mpsc_queue
+{
+public:
+    explicit mpsc_queue(size_t size) : mask_(size - 1), cells_(size)
+    {
+        CHECK(size >= 2 && (size & (size - 1)) == 0, "queue size must be power of 2");
+        for (size_t i = 0; i < size; i++)
+        {
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // any thread, false if full
+    bool push(const T &v)
+    {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (1)
+        {
+            cell &c = cells_[pos & mask_];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    c.data = v;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // owner thread only
+    bool pop(T *v)
+    {
+        cell &c = cells_[head_ & mask_];
+        size_t seq = c.seq.load(std::memory_order_acquire);
+        if ((intptr_t)seq - (intptr_t)(head_ + 1) < 0)
+        {
+            return false;
+        }
+        *v = c.data;
+        c.seq.store(head_ + mask_ + 1, std::memory_order_release);
+        head_++;
+        return true;
+    }
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> seq;
+        T data;
+    };
+    const size_t mask_;
+    std::vector<cell> cells_;
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) size_t head_ = 0;
+};
+
+// a message submitted by a foreign thread
+struct submit_req
+{
+    uint32_t conn;
+    uint32_t len;
+    char payload[MAX_PAYLOAD];
+};
+
+struct rdma_dev
+{
+    std::string name;
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    port_path path;
+    union ibv_gid gid;
+    struct ibv_port_attr port_attr;
+};
+
+// one connection, a loopback qp pair: WRITEs go from qp to peer's buffer
+struct conn
+{
+    struct ibv_qp *qp;
+    struct ibv_qp *peer;
+    int inflight = 0;
+};
+
+/**
+ * A worker: pinned thread, own cq, own connections, own submission queue.
+ */
+struct worker
+{
+    int id;
+    int core;
+    struct ibv_cq *cq;
+    std::vector<conn *> conns;
+    mpsc_queue<submit_req> inbox{4096};
+    // popped while its conn's send queue was full. Nothing more is popped
+    // until it is posted, so a full engine pushes back on submit()
+    submit_req stalled;
+    bool has_stalled = false;
+    char *buf; // source slots followed by the write target
+    struct ibv_mr *mr;
+    std::thread thread;
+    std::atomic<uint64_t> completed{0};
+};
+
+struct engine_config
+{
+    int workers;
+    int conns_per_worker;
+    int depth;
+    uint32_t size;
+    bool self_driven; // false: only post what is submitted
+};
+
+/**
+ * Cores of the NUMA node the device sits on first, then the remaining ones.
+ * /sys/class/infiniband/<dev>/device/numa_node is -1 on single node hosts.
+ */
+std::vector<int> pick_cores(const std::string &dev_name)
+{
+    int node = -1;
+    std::string path = "/sys/class/infiniband/" + dev_name + "/device/numa_node";
+    FILE *f = fopen(path.c_str(), "r");
+    if (f)
+    {
+        if (fscanf(f, "%d", &node) != 1)
+        {
+            node = -1;
+        }
+        fclose(f);
+    }
+    std::vector<int> local;
+    if (node >= 0)
+    {
+        path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+        f = fopen(path.c_str(), "r");
+        if (f)
+        {
+            // e.g. "0-7,16-23"
+            int a, b;
+            char sep;
+            while (fscanf(f, "%d", &a) == 1)
+            {
+                b = a;
+                if (fscanf(f, "%c", &sep) == 1 && sep == '-')
+                {
+                    if (fscanf(f, "%d", &b) != 1)
+                    {
+                        break;
+                    }
+                    fscanf(f, "%c", &sep);
+                }
+                for (int c = a; c <= b; c++)
+                {
+                    local.push_back(c);
+                }
+            }
+            fclose(f);
+        }
+    }
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    std::vector<int> cores;
+    for (int c : local)
+    {
+        if (CPU_ISSET(c, &allowed))
+        {
+            cores.push_back(c);
+        }
+    }
+    for (int c = 0; c < CPU_SETSIZE; c++)
+    {
+        if (CPU_ISSET(c, &allowed) && std::find(cores.begin(), cores.end(), c) == cores.end())
+        {
+            cores.push_back(c);
+        }
+    }
+    printf("device %s numa_node=%d, %zu local cores, %zu usable cores\n",
+           dev_name.c_str(), node, local.size(), cores.size());
+    return cores;
+}
+
+// the "recommended" section of one device in a query_device -j profile
+struct dev_profile
+{
+    int gid_index = -1; // -1 if the profile has none
+    int qp_depth = 0;
+    std::vector<int> cores;
+};
+
+static bool json_int(const std::string &obj, const std::string &key, int &v)
+{
+    size_t pos = obj.find("\"" + key + "\":");
+    if (pos == std::string::npos)
+    {
+        return false;
+    }
+    v = atoi(obj.c_str() + pos + key.size() + 3);
+    return true;
+}
+
+/**
+ * query_device -j writes one device object per line, find the line of
+ * `dev_name` and pick its recommendation. Returns false if the file or the
+ * device is not there, or the profile has no usable core.
+ */
+bool load_profile(const std::string &path, const std::string &dev_name, dev_profile &p)
+{
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+    {
+        printf("open profile %s fail, errno=%d\n", path.c_str(), errno);
+        return false;
+    }
+    const std::string name_key = "{\"name\":\"" + dev_name + "\"";
+    std::string line;
+    char buf[4096];
+    bool found = false;
+    while (!found && fgets(buf, sizeof(buf), f))
+    {
+        line += buf;
+        if (line.back() != '\n' && !feof(f))
+        {
+            continue; // long line, keep reading
+        }
+        found = line.compare(0, name_key.size(), name_key) == 0;
+        if (!found)
+        {
+            line.clear();
+        }
+    }
+    fclose(f);
+    size_t rec = found ? line.find("\"recommended\":{") : std::string::npos;
+    if (rec == std::string::npos)
+    {
+        printf("device %s not in profile %s\n", dev_name.c_str(), path.c_str());
+        return false;
+    }
+    const std::string obj = line.substr(rec);
+    json_int(obj, "gid_index", p.gid_index);
+    json_int(obj, "qp_depth", p.qp_depth);
+    size_t pos = obj.find("\"cores\":[");
+    if (pos != std::string::npos)
+    {
+        const char *c = obj.c_str() + pos + 9;
+        while (*c && *c != ']')
+        {
+            char *end;
+            int core = strtol(c, &end, 10);
+            if (end == c)
+            {
+                break;
+            }
+            p.cores.push_back(core);
+            c = *end == ',' ? end + 1 : end;
+        }
+    }
+    return !p.cores.empty();
+}
+
+void post_write(worker &w, conn &c, int slot, const char *data, uint32_t len, const engine_config &cfg)
+{
+    const uint64_t target = (uint64_t)w.buf + (uint64_t)cfg.depth * cfg.size;
+    struct ibv_sge sge;
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uint64_t)&c;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = target;
+    wr.wr.rdma.rkey = w.mr->rkey;
+    if (data)
+    {
+        sge.addr = (uint64_t)data;
+        sge.length = len;
+        sge.lkey = 0;
+        wr.send_flags |= IBV_SEND_INLINE;
+    }
+    else
+    {
+        sge.addr = (uint64_t)w.buf + (uint64_t)slot * cfg.size;
+        sge.length = cfg.size;
+        sge.lkey = w.mr->lkey;
+    }
+    struct ibv_send_wr *bad_wr = nullptr;
+    int ret = ibv_post_send(c.qp, &wr, &bad_wr);
+    CHECK(ret == 0, "ibv_post_send fail");
+    c.inflight++;
+}
+
+void worker_loop(worker &w, const engine_config &cfg, std::atomic<bool> &stop)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w.core, &set);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    CHECK(ret == 0, "pthread_setaffinity_np fail");
+
+    std::vector<struct ibv_wc> wcs(64);
+    uint64_t done = 0;
+    while (!stop.load(std::memory_order_relaxed))
+    {
+        // foreign submissions, bounded so completions keep being reaped
+        for (int i = 0; i < 64 && (w.has_stalled || w.inbox.pop(&w.stalled)); i++)
+        {
+            conn &c = *w.conns[w.stalled.conn / cfg.workers];
+            if (c.inflight == cfg.depth)
+            {
+                w.has_stalled = true; // leave the rest in the inbox
+                break;
+            }
+            post_write(w, c, 0, w.stalled.payload, w.stalled.len, cfg);
+            w.has_stalled = false;
+        }
+        for (conn *c : w.conns)
+        {
+            while (cfg.self_driven && c->inflight < cfg.depth)
+            {
+                post_write(w, *c, c->inflight, nullptr, 0, cfg);
+            }
+        }
+        int n = ibv_poll_cq(w.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            CHECK(wcs[i].status == IBV_WC_SUCCESS, "bad wc");
+            ((conn *)wcs[i].wr_id)->inflight--;
+        }
+        done += n;
+        w.completed.store(done, std::memory_order_relaxed);
+    }
+}
+
+class engine
+{
+public:
+    engine(rdma_dev &dev, const std::vector<int> &cores, const engine_config &cfg)
+        : dev_(dev), cfg_(cfg), workers_(cfg.workers)
+    {
+        const uint64_t buf_size = (uint64_t)cfg.depth * cfg.size + cfg.size;
+        for (int i = 0; i < cfg.workers; i++)
+        {
+            worker &w = workers_[i];
+            w.id = i;
+            w.core = cores[i % cores.size()];
+            w.cq = ibv_create_cq(dev.ctx, cfg.conns_per_worker * cfg.depth * 2, nullptr, nullptr, 0);
+            CHECK(w.cq, "ibv_create_cq fail");
+            w.buf = (char *)aligned_alloc(4096, (buf_size + 4095) / 4096 * 4096);
+            CHECK(w.buf, "aligned_alloc fail");
+            memset(w.buf, 'x', buf_size);
+            w.mr = ibv_reg_mr(dev.pd, w.buf, buf_size,
+                              IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+            CHECK(w.mr, "ibv_reg_mr fail");
+        }
+        // connection i belongs to worker i % workers
+        for (int i = 0; i < cfg.workers * cfg.conns_per_worker; i++)
+        {
+            worker &w = workers_[i % cfg.workers];
+            conn *c = new conn;
+            c->qp = create_qp(dev.pd, w.cq, cfg.depth);
+            c->peer = create_qp(dev.pd, w.cq, cfg.depth);
+            init_qp(c->qp);
+            init_qp(c->peer);
+            modify_to_rtr(c->qp, dev.path, c->peer->qp_num, 0, dev.port_attr.lid, dev.gid);
+            modify_to_rtr(c->peer, dev.path, c->qp->qp_num, 0, dev.port_attr.lid, dev.gid);
+            modify_to_rts(c->qp, 0);
+            modify_to_rts(c->peer, 0);
+            w.conns.push_back(c);
+        }
+    }
+    ~engine()
+    {
+        stop();
+        for (auto &w : workers_)
+        {
+            for (conn *c : w.conns)
+            {
+                ibv_destroy_qp(c->qp);
+                ibv_destroy_qp(c->peer);
+                delete c;
+            }
+            ibv_destroy_cq(w.cq);
+            ibv_dereg_mr(w.mr);
+            free(w.buf);
+        }
+    }
+
+    void start()
+    {
+        for (auto &w : workers_)
+        {
+            w.thread = std::thread(worker_loop, std::ref(w), std::cref(cfg_), std::ref(stop_));
+        }
+    }
+    void stop()
+    {
+        stop_ = true;
+        for (auto &w : workers_)
+        {
+            if (w.thread.joinable())
+            {
+                w.thread.join();
+            }
+        }
+    }
+
+    int num_conns() const { return cfg_.workers * cfg_.conns_per_worker; }
+
+    // from any thread, false if the owner's queue is full
+    bool submit(uint32_t conn_id, const void *data, uint32_t len)
+    {
+        CHECK(len <= MAX_PAYLOAD, "payload too large");
+        submit_req req;
+        req.conn = conn_id;
+        req.len = len;
+        memcpy(req.payload, data, len);
+        return workers_[conn_id % cfg_.workers].inbox.push(req);
+    }
+
+    uint64_t completed() const
+    {
+        uint64_t sum = 0;
+        for (auto &w : workers_)
+        {
+            sum += w.completed.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+private:
+    rdma_dev &dev_;
+    engine_config cfg_;
+    std::vector<worker> workers_;
+    std::atomic<bool> stop_{false};
+};
+
+double measure(engine &e, double seconds)
+{
+    uint64_t c0 = e.completed();
+    uint64_t t0 = now_ns();
+    usleep(seconds * 1e6);
+    return (e.completed() - c0) / ((now_ns() - t0) / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_workers = 0;
+    int conns_per_worker = 4;
+    int depth = 32;
+    uint32_t size = 64;
+    double seconds = 2;
+    std::string profile;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:c:d:s:T:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            max_workers = atoi(optarg);
+            break;
+        case 'c':
+            conns_per_worker = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 's':
+            size = atoi(optarg);
+            break;
+        case 'T':
+            seconds = atof(optarg);
+            break;
+        case 'p':
+            profile = optarg;
+            break;
+        default:
+            printf("usage: %s [-w max_workers] [-c conns_per_worker] [-d depth] [-s size] [-T seconds] "
+                   "[-p profile.json]\n",
+                   argv[0]);
+            return -1;
+        }
+    }
+    CHECK(conns_per_worker > 0 && depth > 0 && size > 0 && seconds > 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    rdma_dev dev;
+    dev.name = ibv_get_device_name(devs[0]);
+    dev.ctx = ibv_open_device(devs[0]);
+    CHECK(dev.ctx, "ibv_open_device fail");
+    dev.pd = ibv_alloc_pd(dev.ctx);
+    CHECK(dev.pd, "ibv_alloc_pd fail");
+
+    // a saved profile saves the sysfs walk on every start
+    const uint64_t t0 = now_ns();
+    dev_profile prof;
+    std::vector<int> cores;
+    const bool loaded = !profile.empty() && load_profile(profile, dev.name, prof);
+    if (loaded)
+    {
+        cores = prof.cores;
+        if (prof.qp_depth > 0 && depth > prof.qp_depth)
+        {
+            depth = prof.qp_depth;
+        }
+    }
+    else
+    {
+        cores = pick_cores(dev.name);
+    }
+    dev.path = probe_path(dev.ctx, PORT_NUM);
+    if (prof.gid_index >= 0)
+    {
+        dev.path.gid_index = prof.gid_index;
+    }
+    printf("startup: %s in %lu us, gid_index=%d, depth=%d\n", loaded ? "profile loaded" : "probed",
+           (now_ns() - t0) / 1000, dev.path.gid_index, depth);
+    int ret = ibv_query_gid(dev.ctx, PORT_NUM, dev.path.gid_index, &dev.gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    ret = ibv_query_port(dev.ctx, PORT_NUM, &dev.port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    if (max_workers <= 0)
+    {
+        max_workers = cores.size();
+    }
+
+    printf("%-8s %-20s %14s %16s %14s\n", "workers", "cores", "self msgs/s", "msgs/s/worker", "mpsc msgs/s");
+    for (int n = 1; n <= max_workers; n++)
+    {
+        engine_config cfg;
+        cfg.workers = n;
+        cfg.conns_per_worker = conns_per_worker;
+        cfg.depth = depth;
+        cfg.size = size;
+
+        // workers keep their own connections busy
+        cfg.self_driven = true;
+        double self_rate;
+        {
+            engine e(dev, cores, cfg);
+            e.start();
+            self_rate = measure(e, seconds);
+        }
+
+        // the same amount of workers fed by foreign producer threads
+        cfg.self_driven = false;
+        double mpsc_rate;
+        {
+            engine e(dev, cores, cfg);
+            e.start();
+            std::atomic<bool> stop{false};
+            std::vector<std::thread> producers;
+            for (int p = 0; p < n; p++)
+            {
+                producers.emplace_back([&, p]() {
+                    char msg[MAX_PAYLOAD];
+                    memset(msg, 'p', sizeof(msg));
+                    // every producer cycles over all conns, so every inbox has n producers
+                    uint32_t k = p;
+                    while (!stop.load(std::memory_order_relaxed))
+                    {
+                        if (!e.submit(k % e.num_conns(), msg, std::min<uint32_t>(size, MAX_PAYLOAD)))
+                        {
+                            sched_yield();
+                            continue;
+                        }
+                        k++;
+                    }
+                });
+            }
+            mpsc_rate = measure(e, seconds);
+            stop = true;
+            for (auto &t : producers)
+            {
+                t.join();
+            }
+        }
+
+        std::string used;
+        for (int i = 0; i < n; i++)
+        {
+            used += (i ? "," : "") + std::to_string(cores[i % cores.size()]);
+        }
+        if (used.size() > 20)
+        {
+            used = used.substr(0, 17) + "...";
+        }
+        printf("%-8d %-20s %14.0f %16.0f %14.0f\n", n, used.c_str(), self_rate, self_rate / n, mpsc_rate);
+    }
+
+    ibv_dealloc_pd(dev.pd);
+    ibv_close_device(dev.ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,981 @@
+/**
+ * Example of an intra-host shared memory fallback transport. If you have no
+ * RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE), both sides can run on localhost.
+ *
+ * poll_cq.cpp connects two qps of the same device, so every byte still
+ * goes through the NIC (or the rxe stack) although both ends share memory.
+ * Here the peers exchange a host id (the kernel boot_id) and their gid
+ * over TCP, together with the qp meta. When both run on the same host the
+ * client creates a POSIX shared memory segment holding two lock-free SPSC
+ * rings, one per direction, and both sides use shm_transport instead of
+ * rdma_transport. Both implement the same post_send/post_recv/poll API with
+ * the same completion semantics, so the code above does not change. If the
+ * peer cannot map the segment (e.g. another IPC namespace) both sides fall
+ * back to the already created qps.
+ *
+ * The client runs a ping-pong and a streaming test, the server echoes.
+ *
+ * g++ -O2 shm_transport.cpp -libverbs -lrt -o shm_transport
+ *
+ * server:
+ * ./shm_transport -s [-p port]
+ *
+ * client:
+ * ./shm_transport -c 127.0.0.1 [-p port] [-n iters] [-S size] [-R]
+ *
+ * -R: never use shared memory, to compare with the RDMA path
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <endian.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#define IB_PORT_NUM 1
+#define HELLO_MAGIC 0x53484d31 // "SHM1"
+#define SHM_RING_SIZE (4 << 20)
+#define DEPTH 64
+#define RECV_TAG (1ull << 63) // marks rdma recv wr_ids, an error wc has no valid opcode
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 建联过程需要交换的信息，按网络字节序在TCP上传输
+struct __attribute__((packed)) wire_hello
+{
+    uint32_t magic;
+    uint8_t host_id[16]; // boot_id, equal on the same host
+    uint8_t gid[16];
+    uint32_t qpn;
+    uint32_t psn;
+    uint16_t lid;
+    uint8_t mtu; // active mtu of the sender port
+    uint8_t allow_shm;
+    uint32_t iters; // client only
+    uint32_t size;  // client only
+};
+
+// the shared memory segment name, sent by the client if both can use it
+struct __attribute__((packed)) wire_shm
+{
+    char name[64];
+};
+
+bool write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    while (len > 0)
+    {
+        // a peer that hung up must not raise SIGPIPE
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+bool read_full(int fd, void *buf, size_t len)
+{
+    char *p = (char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+// /proc/sys/kernel/random/boot_id, e.g. 5b3c...-...; all zero if unknown
+void read_host_id(uint8_t id[16])
+{
+    memset(id, 0, 16);
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+    if (!f)
+    {
+        return;
+    }
+    char buf[64] = {0};
+    if (fgets(buf, sizeof(buf), f))
+    {
+        int n = 0;
+        for (char *p = buf; *p && n < 32; p++)
+        {
+            if (isxdigit((unsigned char)*p))
+            {
+                int v = isdigit((unsigned char)*p) ? *p - '0' : (tolower(*p) - 'a' + 10);
+                id[n / 2] |= n % 2 ? v : v << 4;
+                n++;
+            }
+        }
+    }
+    fclose(f);
+}
+
+struct completion
+{
+    uint64_t wr_id;
+    bool ok;
+    bool is_recv;
+    uint32_t len; // received bytes, valid if is_recv
+};
+
+/**
+ * What the application sees. buf() is a region usable for sends and
+ * receives (registered for RDMA). post_send returns false when the send
+ * queue is full, the caller polls and retries. A receive completes only
+ * into a posted receive buffer.
+ */
+class transport
+{
+public:
+    virtual ~transport() {}
+    virtual char *buf() = 0;
+    virtual bool post_send(const char *data, uint32_t len, uint64_t wr_id) = 0;
+    virtual void post_recv(char *data, uint32_t len, uint64_t wr_id) = 0;
+    virtual int poll(completion *out, int max) = 0;
+    virtual const char *name() const = 0;
+};
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = DEPTH;
+    init_attr.cap.max_recv_wr = DEPTH;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = IB_PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid r_gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = r_gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = IB_PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+// an RC qp with its own cq and one registered region
+class rdma_transport : public transport
+{
+public:
+    rdma_transport(struct ibv_context *ctx, struct ibv_pd *pd, size_t buf_size) : wcs_(DEPTH)
+    {
+        cq_ = ibv_create_cq(ctx, DEPTH * 2, nullptr, nullptr, 0);
+        CHECK(cq_, "ibv_create_cq fail");
+        qp_ = create_qp(pd, cq_);
+        init_qp(qp_);
+        buf_ = (char *)malloc(buf_size);
+        CHECK(buf_, "malloc fail");
+        mr_ = ibv_reg_mr(pd, buf_, buf_size, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(mr_, "ibv_reg_mr fail");
+    }
+    ~rdma_transport()
+    {
+        ibv_destroy_qp(qp_);
+        ibv_destroy_cq(cq_);
+        ibv_dereg_mr(mr_);
+        free(buf_);
+    }
+
+    struct ibv_qp *qp() { return qp_; }
+
+    void connect(const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid r_gid, uint32_t my_psn)
+    {
+        modify_to_rtr(qp_, p, r_qpn, r_psn, dlid, r_gid);
+        modify_to_rts(qp_, my_psn);
+    }
+
+    char *buf() override { return buf_; }
+
+    bool post_send(const char *data, uint32_t len, uint64_t wr_id) override
+    {
+        if (send_inflight_ == DEPTH)
+        {
+            return false;
+        }
+        struct ibv_sge sge = {(uint64_t)data, len, mr_->lkey};
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = wr_id;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+        send_inflight_++;
+        return true;
+    }
+
+    void post_recv(char *data, uint32_t len, uint64_t wr_id) override
+    {
+        struct ibv_sge sge = {(uint64_t)data, len, mr_->lkey};
+        struct ibv_recv_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = wr_id | RECV_TAG;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_recv(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+    }
+
+    int poll(completion *out, int max) override
+    {
+        int n = ibv_poll_cq(cq_, std::min<int>(max, wcs_.size()), wcs_.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            const struct ibv_wc &wc = wcs_[i];
+            // opcode is not valid on error, tell sends and recvs apart by the wr_id
+            const bool is_recv = (wc.wr_id & RECV_TAG) != 0;
+            if (!is_recv)
+            {
+                send_inflight_--;
+            }
+            out[i] = {wc.wr_id & ~RECV_TAG, wc.status == IBV_WC_SUCCESS, is_recv, wc.byte_len};
+        }
+        return n;
+    }
+
+    const char *name() const override { return "rdma"; }
+
+private:
+    struct ibv_cq *cq_;
+    struct ibv_qp *qp_;
+    struct ibv_mr *mr_;
+    char *buf_;
+    int send_inflight_ = 0;
+    std::vector<struct ibv_wc> wcs_;
+};
+
+/**
+ * Lock-free single producer single consumer byte ring in shared memory.
+ * Records are [u32 len][u32 0][payload], 8 byte aligned, and never wrap: a
+ * record not fitting before the end is preceded by a SKIP marker. head is
+ * only written by the consumer, tail by the producer, each on its own
+ * cache line, and each side caches the other index to touch the shared
+ * line only when the cached value says the ring is full/empty.
+ */
+struct shm_ring
+{
+    static const uint32_t SKIP = 0xffffffff;
+    alignas(64) std::atomic<uint64_t> head; // consumed bytes
+    alignas(64) std::atomic<uint64_t> tail; // produced bytes
+    alignas(64) char data[SHM_RING_SIZE];
+};
+
+struct shm_segment
+{
+    uint32_t magic;
+    shm_ring rings[2]; // 0: client -> server, 1: server -> client
+};
+
+class shm_transport : public transport
+{
+public:
+    // the client creates the segment, the server opens it by name
+    shm_transport(const char *shm_name, bool create, bool is_client, size_t buf_size)
+        : name_(shm_name), owner_(create)
+    {
+        int fd = shm_open(shm_name, create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0600);
+        if (fd < 0)
+        {
+            return;
+        }
+        if (create && ftruncate(fd, sizeof(shm_segment)) != 0)
+        {
+            close(fd);
+            return;
+        }
+        void *p = mmap(nullptr, sizeof(shm_segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            return;
+        }
+        seg_ = (shm_segment *)p;
+        if (create)
+        {
+            seg_->magic = HELLO_MAGIC;
+        }
+        else if (seg_->magic != HELLO_MAGIC)
+        {
+            munmap(seg_, sizeof(shm_segment));
+            seg_ = nullptr;
+            return;
+        }
+        tx_ = &seg_->rings[is_client ? 0 : 1];
+        rx_ = &seg_->rings[is_client ? 1 : 0];
+        buf_ = (char *)malloc(buf_size);
+        CHECK(buf_, "malloc fail");
+    }
+    ~shm_transport()
+    {
+        if (seg_)
+        {
+            munmap(seg_, sizeof(shm_segment));
+        }
+        if (owner_)
+        {
+            shm_unlink(name_.c_str());
+        }
+        free(buf_);
+    }
+
+    bool ok() const { return seg_ != nullptr; }
+
+    // both sides mapped it, the name is no longer needed
+    void unlink()
+    {
+        if (owner_)
+        {
+            shm_unlink(name_.c_str());
+            owner_ = false;
+        }
+    }
+
+    char *buf() override { return buf_; }
+
+    // copy into the ring, the send completes at once
+    bool post_send(const char *data, uint32_t len, uint64_t wr_id) override
+    {
+        const uint64_t rec = 8 + ((len + 7) & ~7ull);
+        CHECK(rec <= SHM_RING_SIZE / 2, "message too large for the shm ring");
+        const uint64_t tail = tx_->tail.load(std::memory_order_relaxed);
+        uint64_t off = tail % SHM_RING_SIZE;
+        const uint64_t pad = off + rec > SHM_RING_SIZE ? SHM_RING_SIZE - off : 0;
+        if (tail + pad + rec - tx_head_ > SHM_RING_SIZE)
+        {
+            tx_head_ = tx_->head.load(std::memory_order_acquire);
+            if (tail + pad + rec - tx_head_ > SHM_RING_SIZE)
+            {
+                return false; // full
+            }
+        }
+        if (pad)
+        {
+            *(uint32_t *)(tx_->data + off) = shm_ring::SKIP;
+            off = 0;
+        }
+        *(uint32_t *)(tx_->data + off) = len;
+        memcpy(tx_->data + off + 8, data, len);
+        tx_->tail.store(tail + pad + rec, std::memory_order_release);
+        done_.push_back({wr_id, true, false, 0});
+        return true;
+    }
+
+    void post_recv(char *data, uint32_t len, uint64_t wr_id) override
+    {
+        recvs_.push_back({data, len, wr_id});
+    }
+
+    int poll(completion *out, int max) override
+    {
+        int n = 0;
+        while (n < max && !done_.empty())
+        {
+            out[n++] = done_.front();
+            done_.pop_front();
+        }
+        // messages stay in the ring until a receive is posted, no RNR
+        uint64_t head = rx_->head.load(std::memory_order_relaxed);
+        while (n < max && !recvs_.empty())
+        {
+            if (head == rx_tail_)
+            {
+                rx_tail_ = rx_->tail.load(std::memory_order_acquire);
+                if (head == rx_tail_)
+                {
+                    break;
+                }
+            }
+            uint64_t off = head % SHM_RING_SIZE;
+            uint32_t len = *(uint32_t *)(rx_->data + off);
+            if (len == shm_ring::SKIP)
+            {
+                head += SHM_RING_SIZE - off;
+                continue;
+            }
+            posted_recv r = recvs_.front();
+            recvs_.pop_front();
+            const bool fits = len <= r.len;
+            memcpy(r.data, rx_->data + off + 8, fits ? len : 0);
+            head += 8 + ((len + 7) & ~7ull);
+            out[n++] = {r.wr_id, fits, true, len};
+        }
+        rx_->head.store(head, std::memory_order_release);
+        return n;
+    }
+
+    const char *name() const override { return "shm"; }
+
+private:
+    struct posted_recv
+    {
+        char *data;
+        uint32_t len;
+        uint64_t wr_id;
+    };
+    std::string name_;
+    bool owner_;
+    shm_segment *seg_ = nullptr;
+    shm_ring *tx_ = nullptr;
+    shm_ring *rx_ = nullptr;
+    uint64_t tx_head_ = 0; // cached consumer index of tx
+    uint64_t rx_tail_ = 0; // cached producer index of rx
+    char *buf_ = nullptr;
+    std::deque<completion> done_;
+    std::deque<posted_recv> recvs_;
+};
+
+struct rdma_dev
+{
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    union ibv_gid gid;
+    struct ibv_port_attr port_attr;
+    port_path path;
+};
+
+wire_hello make_hello(rdma_dev &dev, rdma_transport &rt, uint32_t psn, bool allow_shm,
+                      uint32_t iters, uint32_t size)
+{
+    wire_hello h;
+    memset(&h, 0, sizeof(h));
+    h.magic = htobe32(HELLO_MAGIC);
+    read_host_id(h.host_id);
+    memcpy(h.gid, dev.gid.raw, sizeof(h.gid));
+    h.qpn = htobe32(rt.qp()->qp_num);
+    h.psn = htobe32(psn);
+    h.lid = htobe16(dev.port_attr.lid);
+    h.mtu = dev.path.mtu;
+    h.allow_shm = allow_shm;
+    h.iters = htobe32(iters);
+    h.size = htobe32(size);
+    return h;
+}
+
+bool same_host(const wire_hello &a, const wire_hello &b)
+{
+    static const uint8_t zero[16] = {0};
+    return memcmp(a.host_id, zero, 16) != 0 && memcmp(a.host_id, b.host_id, 16) == 0;
+}
+
+/**
+ * Exchange hellos and pick the transport. Both sides always create a qp
+ * first, so falling back needs no second round trip of qp metas. Returns
+ * the chosen transport, iters/size are taken from the client. Returns
+ * nullptr if the peer hangs up or sends a bad hello, or if the client's
+ * size does not fit buf_size.
+ */
+transport *connect_peer(int fd, rdma_dev &dev, size_t buf_size, bool is_client, bool allow_shm,
+                        uint32_t &iters, uint32_t &size)
+{
+    uint64_t t0 = now_ns();
+    rdma_transport *rt = new rdma_transport(dev.ctx, dev.pd, buf_size);
+    const uint32_t psn = lrand48() & 0xffffff;
+    wire_hello mine = make_hello(dev, *rt, psn, allow_shm, iters, size);
+    wire_hello peer;
+    shm_transport *st = nullptr;
+    // a misbehaving peer only costs this connection
+    auto fail = [&](const char *what) -> transport * {
+        printf("%s, errno=%d, peer dropped\n", what, errno);
+        delete rt;
+        delete st;
+        return nullptr;
+    };
+    if (!write_full(fd, &mine, sizeof(mine)) || !read_full(fd, &peer, sizeof(peer)))
+    {
+        return fail("hello exchange fail");
+    }
+    if (be32toh(peer.magic) != HELLO_MAGIC)
+    {
+        return fail("bad hello");
+    }
+    if (!is_client)
+    {
+        iters = be32toh(peer.iters);
+        size = be32toh(peer.size);
+        if (size == 0 || (size_t)2 * DEPTH * size > buf_size)
+        {
+            printf("client asked for size=%u, expect 1..%zu\n", size, buf_size / 2 / DEPTH);
+            return fail("bad size");
+        }
+    }
+
+    const bool same = same_host(mine, peer);
+    const bool same_gid = memcmp(mine.gid, peer.gid, 16) == 0;
+    bool use_shm = same && mine.allow_shm && peer.allow_shm;
+    printf("peer: same_host=%d, same_gid=%d, try_shm=%d\n", same, same_gid, use_shm);
+
+    if (use_shm)
+    {
+        wire_shm ws;
+        memset(&ws, 0, sizeof(ws));
+        if (is_client)
+        {
+            snprintf(ws.name, sizeof(ws.name), "/rdma_shm.%d.%lx", getpid(), lrand48());
+            st = new shm_transport(ws.name, true, true, buf_size);
+            if (!st->ok())
+            {
+                ws.name[0] = 0; // tell the server we could not create it
+            }
+            if (!write_full(fd, &ws, sizeof(ws)))
+            {
+                return fail("send shm name fail");
+            }
+        }
+        else
+        {
+            if (!read_full(fd, &ws, sizeof(ws)))
+            {
+                return fail("recv shm name fail");
+            }
+            ws.name[sizeof(ws.name) - 1] = 0;
+            if (ws.name[0])
+            {
+                st = new shm_transport(ws.name, false, false, buf_size);
+            }
+        }
+        // both must agree, one byte from each side
+        char ok = st && st->ok(), peer_ok = 0;
+        if (!write_full(fd, &ok, 1) || !read_full(fd, &peer_ok, 1))
+        {
+            return fail("shm barrier fail");
+        }
+        use_shm = ok && peer_ok;
+        if (!use_shm)
+        {
+            delete st;
+            st = nullptr;
+        }
+        else
+        {
+            st->unlink();
+        }
+    }
+
+    transport *t;
+    if (use_shm)
+    {
+        delete rt;
+        rt = nullptr;
+        t = st;
+    }
+    else
+    {
+        union ibv_gid r_gid;
+        memcpy(r_gid.raw, peer.gid, sizeof(r_gid.raw));
+        // the path mtu must fit both ports
+        port_path p = dev.path;
+        p.mtu = std::min(p.mtu, (enum ibv_mtu)peer.mtu);
+        rt->connect(p, be32toh(peer.qpn), be32toh(peer.psn), be16toh(peer.lid), r_gid, psn);
+        t = rt;
+    }
+    char ready = 1;
+    if (!write_full(fd, &ready, 1) || !read_full(fd, &ready, 1))
+    {
+        return fail("barrier fail");
+    }
+    printf("connected over %s in %lu us\n", t->name(), (now_ns() - t0) / 1000);
+    return t;
+}
+
+// layout of buf(): DEPTH send slots, then DEPTH recv slots
+static char *send_slot(transport *t, uint32_t size, uint64_t i) { return t->buf() + (i % DEPTH) * size; }
+static char *recv_slot(transport *t, uint32_t size, uint64_t i) { return t->buf() + (DEPTH + i) * size; }
+
+/**
+ * Echo server: the first iters messages are sent back, the next iters are
+ * only counted, then one ack is sent.
+ */
+void serve_client(int fd, rdma_dev &dev, uint32_t max_size)
+{
+    uint32_t iters = 0, size = 0;
+    transport *t = connect_peer(fd, dev, (size_t)2 * DEPTH * max_size, false, true, iters, size);
+    if (!t)
+    {
+        close(fd);
+        return;
+    }
+    for (int i = 0; i < DEPTH; i++)
+    {
+        t->post_recv(recv_slot(t, size, i), size, i);
+    }
+    completion c[DEPTH];
+    uint64_t received = 0, sent = 0;
+    bool alive = true;
+    while (alive && received < 2ull * iters)
+    {
+        int n = t->poll(c, DEPTH);
+        for (int i = 0; alive && i < n; i++)
+        {
+            if (!c[i].ok)
+            {
+                alive = false; // e.g. the client's qp is gone
+                break;
+            }
+            if (!c[i].is_recv)
+            {
+                continue;
+            }
+            const uint64_t slot = c[i].wr_id;
+            if (received < iters)
+            {
+                // echo from a send slot, the recv slot is reposted at once
+                char *s = send_slot(t, size, sent);
+                memcpy(s, recv_slot(t, size, slot), c[i].len);
+                while (alive && !t->post_send(s, c[i].len, sent))
+                {
+                    // the client waits for the echo, no recv can show up here
+                    completion tmp;
+                    if (t->poll(&tmp, 1) == 1)
+                    {
+                        alive = tmp.ok && !tmp.is_recv;
+                    }
+                }
+                sent++;
+            }
+            received++;
+            t->post_recv(recv_slot(t, size, slot), size, slot);
+        }
+    }
+    if (!alive)
+    {
+        printf("completion error, client dropped after %lu msgs\n", received);
+        close(fd);
+        delete t;
+        return;
+    }
+    char *s = send_slot(t, size, sent);
+    memset(s, 'a', size);
+    while (!t->post_send(s, size, sent))
+    {
+        t->poll(c, DEPTH);
+    }
+    char bye;
+    read_full(fd, &bye, 1); // the client hangs up when done
+    close(fd);
+    delete t;
+    printf("client done, %lu msgs received\n", received);
+}
+
+void run_server(rdma_dev &dev, int port)
+{
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(lfd >= 0, "socket fail");
+    int on = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    CHECK(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "bind fail");
+    CHECK(listen(lfd, 16) == 0, "listen fail");
+    printf("listening on port %d\n", port);
+    while (1)
+    {
+        int fd = accept(lfd, nullptr, nullptr);
+        if (fd < 0)
+        {
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        serve_client(fd, dev, 64 * 1024); // one client at a time
+    }
+}
+
+void run_client(rdma_dev &dev, const char *host, int port, uint32_t iters, uint32_t size, bool allow_shm)
+{
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port_str[16];
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    CHECK(getaddrinfo(host, port_str, &hints, &res) == 0, "getaddrinfo fail");
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    CHECK(fd >= 0, "socket fail");
+    CHECK(connect(fd, res->ai_addr, res->ai_addrlen) == 0, "connect fail");
+    freeaddrinfo(res);
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    transport *t = connect_peer(fd, dev, (size_t)2 * DEPTH * size, true, allow_shm, iters, size);
+    CHECK(t, "connect to server fail");
+    for (int i = 0; i < DEPTH; i++)
+    {
+        t->post_recv(recv_slot(t, size, i), size, i);
+    }
+    memset(t->buf(), 'c', (size_t)DEPTH * size);
+
+    // ping-pong, one message in flight, wait for the echo and our send
+    completion c[DEPTH];
+    std::vector<uint64_t> rtt(iters);
+    for (uint32_t i = 0; i < iters; i++)
+    {
+        const uint64_t start = now_ns();
+        CHECK(t->post_send(send_slot(t, size, i), size, i), "post_send fail");
+        bool echoed = false, sent = false;
+        while (!echoed || !sent)
+        {
+            int n = t->poll(c, DEPTH);
+            for (int k = 0; k < n; k++)
+            {
+                CHECK(c[k].ok, "completion error");
+                if (!c[k].is_recv)
+                {
+                    sent = true;
+                    continue;
+                }
+                rtt[i] = now_ns() - start;
+                echoed = true;
+                t->post_recv(recv_slot(t, size, c[k].wr_id), size, c[k].wr_id);
+            }
+        }
+    }
+    std::sort(rtt.begin(), rtt.end());
+
+    // stream, up to DEPTH sends in flight, then wait for the ack
+    const uint64_t start = now_ns();
+    uint64_t posted = 0, sent = 0;
+    bool acked = false;
+    while (!acked)
+    {
+        while (posted < iters && posted - sent < DEPTH &&
+               t->post_send(send_slot(t, size, posted), size, posted))
+        {
+            posted++;
+        }
+        int n = t->poll(c, DEPTH);
+        for (int i = 0; i < n; i++)
+        {
+            CHECK(c[i].ok, "completion error");
+            if (c[i].is_recv)
+            {
+                acked = true;
+            }
+            else
+            {
+                sent++;
+            }
+        }
+    }
+    const double secs = (now_ns() - start) / 1e9;
+    printf("%s: size=%u, ping-pong rtt p50=%.2f us p99=%.2f us, stream %.0f msgs/s %.2f MB/s\n",
+           t->name(), size, rtt[iters / 2] / 1e3, rtt[(uint64_t)iters * 99 / 100] / 1e3,
+           iters / secs, (double)iters * size / secs / 1e6);
+
+    close(fd);
+    delete t;
+}
+
+int main(int argc, char *argv[])
+{
+    bool server = false;
+    const char *host = nullptr;
+    int port = 18516;
+    uint32_t iters = 100000;
+    uint32_t size = 64;
+    bool allow_shm = true;
+    int opt;
+    while ((opt = getopt(argc, argv, "sc:p:n:S:R")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            server = true;
+            break;
+        case 'c':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        case 'S':
+            size = atoi(optarg);
+            break;
+        case 'R':
+            allow_shm = false;
+            break;
+        default:
+            printf("usage: %s -s | -c host [-p port] [-n iters] [-S size] [-R]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(server || host, "either -s or -c host is required");
+    CHECK(iters > 0 && size > 0 && size <= 64 * 1024, "invalid -n or -S");
+    srand48(getpid() ^ time(nullptr));
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    rdma_dev dev;
+    dev.ctx = ibv_open_device(devs[0]);
+    CHECK(dev.ctx, "ibv_open_device fail");
+    dev.pd = ibv_alloc_pd(dev.ctx);
+    CHECK(dev.pd, "ibv_alloc_pd fail");
+    dev.path = probe_path(dev.ctx, IB_PORT_NUM);
+    int ret = ibv_query_gid(dev.ctx, IB_PORT_NUM, dev.path.gid_index, &dev.gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    ret = ibv_query_port(dev.ctx, IB_PORT_NUM, &dev.port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    if (server)
+    {
+        run_server(dev, port);
+    }
+    else
+    {
+        run_client(dev, host, port, iters, size, allow_shm);
+    }
+
+    ibv_dealloc_pd(dev.pd);
+    ibv_close_device(dev.ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
@@ -0,0 +1,557 @@
+/**
+ * Example of Shared Receive Queue (SRQ). If you have no RDMA hardware,
+ * see https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * With a receive queue per RC qp (max_recv_wr = io_depth in create_qp),
+ * the posted receive buffers grow linearly with the number of connections.
+ * With an SRQ all qps consume from one pool of posted buffers. Consumed
+ * buffers are handed to a refill thread, which is woken up by the
+ * IBV_EVENT_SRQ_LIMIT_REACHED async event when the SRQ runs below its low
+ * watermark, posts them back in one chained ibv_post_srq_recv and re-arms
+ * the limit.
+ *
+ * The benchmark connects `conns` qp pairs back-to-back on one device,
+ * sends small messages round robin over them, and compares receive buffer
+ * memory and throughput of per-qp RQs against one SRQ.
+ *
+ * g++ -O2 srq.cpp -libverbs -lpthread -o srq
+ * ./srq [-c 1,64,1024] [-n msgs] [-q rq_depth] [-r srq_size] [-s msg_size]
+ *
+ * -c: connection counts to compare, default 1,64,1024
+ * -n: messages per run, default 200000
+ * -q: receive queue depth per qp in RQ mode, default 32
+ * -r: number of buffers posted to the SRQ, default 512
+ * -s: message size, default 64, receive buffers are 4KiB
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define SEND_DEPTH 16
+#define RECV_BUF_SIZE 4096
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, struct ibv_srq *srq, int rq_depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.srq = srq; // max_recv_wr/max_recv_sge are ignored with an srq
+    init_attr.cap.max_send_wr = SEND_DEPTH;
+    init_attr.cap.max_recv_wr = srq ? 0 : rq_depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = srq ? 0 : 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+struct rdma_dev
+{
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    union ibv_gid gid;
+    struct ibv_port_attr port_attr;
+    struct ibv_device_attr dev_attr;
+    port_path path;
+};
+
+/**
+ * SRQ with a low watermark refill thread. The poller calls release() for
+ * every consumed buffer, the refill thread posts released buffers back when
+ * the SRQ drops below `limit` posted WQEs, or every 10ms as a fallback in
+ * case the provider does not raise the limit event.
+ */
+class srq_pool
+{
+public:
+    srq_pool(rdma_dev &dev, int size, uint32_t buf_size)
+        : dev_(dev), size_(size), buf_size_(buf_size), limit_(std::max(1, size / 4))
+    {
+        struct ibv_srq_init_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.attr.max_wr = size;
+        attr.attr.max_sge = 1;
+        srq_ = ibv_create_srq(dev.pd, &attr);
+        CHECK(srq_, "ibv_create_srq fail");
+        bufs_ = (char *)aligned_alloc(4096, (uint64_t)size * buf_size);
+        CHECK(bufs_, "aligned_alloc fail");
+        mr_ = ibv_reg_mr(dev.pd, bufs_, (uint64_t)size * buf_size, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(mr_, "ibv_reg_mr fail");
+        for (int i = 0; i < size; i++)
+        {
+            released_.push_back(i);
+        }
+        refill();
+        arm();
+        // the async fd is shared by the device context, poll it non-blocking
+        int flags = fcntl(dev.ctx->async_fd, F_GETFL);
+        fcntl(dev.ctx->async_fd, F_SETFL, flags | O_NONBLOCK);
+        thread_ = std::thread(&srq_pool::refill_loop, this);
+    }
+    ~srq_pool()
+    {
+        stop_ = true;
+        thread_.join();
+        ibv_destroy_srq(srq_);
+        ibv_dereg_mr(mr_);
+        free(bufs_);
+    }
+
+    struct ibv_srq *srq() { return srq_; }
+    uint64_t memory() const { return (uint64_t)size_ * buf_size_; }
+    uint64_t limit_events() const { return limit_events_; }
+    uint64_t refills() const { return refills_; }
+    const char *buf(uint64_t wr_id) const { return bufs_ + wr_id * buf_size_; }
+
+    void release(uint64_t wr_id)
+    {
+        std::lock_guard<std::mutex> lk(mu_);
+        released_.push_back(wr_id);
+    }
+
+private:
+    void arm()
+    {
+        struct ibv_srq_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.srq_limit = limit_;
+        int ret = ibv_modify_srq(srq_, &attr, IBV_SRQ_LIMIT);
+        CHECK(ret == 0, "ibv_modify_srq limit fail");
+    }
+
+    void refill()
+    {
+        std::vector<uint64_t> ids;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            ids.swap(released_);
+        }
+        if (ids.empty())
+        {
+            return;
+        }
+        std::vector<struct ibv_sge> sges(ids.size());
+        std::vector<struct ibv_recv_wr> wrs(ids.size());
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            sges[i].addr = (uint64_t)buf(ids[i]);
+            sges[i].length = buf_size_;
+            sges[i].lkey = mr_->lkey;
+            memset(&wrs[i], 0, sizeof(wrs[i]));
+            wrs[i].wr_id = ids[i];
+            wrs[i].sg_list = &sges[i];
+            wrs[i].num_sge = 1;
+            wrs[i].next = i + 1 < ids.size() ? &wrs[i + 1] : nullptr;
+        }
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_srq_recv(srq_, wrs.data(), &bad_wr);
+        CHECK(ret == 0, "ibv_post_srq_recv fail");
+        refills_++;
+    }
+
+    void refill_loop()
+    {
+        struct pollfd pfd;
+        pfd.fd = dev_.ctx->async_fd;
+        pfd.events = POLLIN;
+        while (!stop_)
+        {
+            int n = poll(&pfd, 1, 10);
+            bool armed = false;
+            if (n > 0)
+            {
+                struct ibv_async_event ev;
+                while (ibv_get_async_event(dev_.ctx, &ev) == 0)
+                {
+                    if (ev.event_type == IBV_EVENT_SRQ_LIMIT_REACHED && ev.element.srq == srq_)
+                    {
+                        limit_events_++;
+                        armed = true;
+                    }
+                    else
+                    {
+                        printf("async event: %s\n", ibv_event_type_str(ev.event_type));
+                    }
+                    ibv_ack_async_event(&ev);
+                }
+            }
+            refill();
+            if (armed)
+            {
+                // the limit is one shot, arm it again after the refill
+                arm();
+            }
+        }
+    }
+
+    rdma_dev &dev_;
+    const int size_;
+    const uint32_t buf_size_;
+    const int limit_;
+    struct ibv_srq *srq_;
+    char *bufs_;
+    struct ibv_mr *mr_;
+    std::mutex mu_;
+    std::vector<uint64_t> released_;
+    std::thread thread_;
+    std::atomic<bool> stop_{false};
+    std::atomic<uint64_t> limit_events_{0};
+    std::atomic<uint64_t> refills_{0};
+};
+
+struct run_result
+{
+    uint64_t recv_mem;
+    uint64_t elapsed_ns;
+    uint64_t msgs;
+    uint64_t limit_events;
+    uint64_t refills;
+};
+
+/**
+ * Connect `conns` pairs (cqps[i] -> sqps[i]), send `msgs` messages round
+ * robin and reap everything on one cq. In RQ mode every server qp posts
+ * rq_depth buffers of its own and reposts them as they complete.
+ */
+run_result run(rdma_dev &dev, int conns, bool use_srq, int msgs, int rq_depth,
+               int srq_size, uint32_t msg_size)
+{
+    const int cqe = std::min(dev.dev_attr.max_cqe, conns * (SEND_DEPTH + rq_depth) + srq_size);
+    struct ibv_cq *cq = ibv_create_cq(dev.ctx, cqe, nullptr, nullptr, 0);
+    CHECK(cq, "ibv_create_cq fail");
+
+    srq_pool *pool = use_srq ? new srq_pool(dev, srq_size, RECV_BUF_SIZE) : nullptr;
+    std::vector<struct ibv_qp *> cqps(conns), sqps(conns);
+    for (int i = 0; i < conns; i++)
+    {
+        cqps[i] = create_qp(dev.pd, cq, nullptr, rq_depth);
+        sqps[i] = create_qp(dev.pd, cq, pool ? pool->srq() : nullptr, rq_depth);
+        init_qp(cqps[i]);
+        init_qp(sqps[i]);
+        modify_to_rtr(cqps[i], dev.path, sqps[i]->qp_num, 0, dev.port_attr.lid, dev.gid);
+        modify_to_rtr(sqps[i], dev.path, cqps[i]->qp_num, 0, dev.port_attr.lid, dev.gid);
+        modify_to_rts(cqps[i], 0);
+        modify_to_rts(sqps[i], 0);
+    }
+
+    // per qp receive buffers for RQ mode, wr_id = buffer index, owner = wr_id / rq_depth
+    char *rq_bufs = nullptr;
+    struct ibv_mr *rq_mr = nullptr;
+    uint64_t recv_mem = pool ? pool->memory() : 0;
+    auto post_rq = [&](uint64_t id) {
+        struct ibv_sge sge;
+        sge.addr = (uint64_t)(rq_bufs + id * RECV_BUF_SIZE);
+        sge.length = RECV_BUF_SIZE;
+        sge.lkey = rq_mr->lkey;
+        struct ibv_recv_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = id;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_recv(sqps[id / rq_depth], &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+    };
+    if (!pool)
+    {
+        recv_mem = (uint64_t)conns * rq_depth * RECV_BUF_SIZE;
+        rq_bufs = (char *)aligned_alloc(4096, recv_mem);
+        CHECK(rq_bufs, "aligned_alloc fail");
+        rq_mr = ibv_reg_mr(dev.pd, rq_bufs, recv_mem, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(rq_mr, "ibv_reg_mr fail");
+        for (uint64_t id = 0; id < (uint64_t)conns * rq_depth; id++)
+        {
+            post_rq(id);
+        }
+    }
+
+    char *send_buf = (char *)aligned_alloc(4096, 4096);
+    CHECK(send_buf, "aligned_alloc fail");
+    memset(send_buf, 'x', 4096);
+    struct ibv_mr *send_mr = ibv_reg_mr(dev.pd, send_buf, 4096, IBV_ACCESS_LOCAL_WRITE);
+    CHECK(send_mr, "ibv_reg_mr fail");
+
+    std::vector<int> outstanding(conns, 0);
+    std::vector<struct ibv_wc> wcs(64);
+    int posted = 0, sent = 0, received = 0, next = 0;
+    const uint64_t start = now_ns();
+    while (sent < msgs || received < msgs)
+    {
+        // one sweep over the connections, skip the ones with a full send queue
+        for (int k = 0; k < conns && posted < msgs; k++, next = (next + 1) % conns)
+        {
+            if (outstanding[next] >= SEND_DEPTH)
+            {
+                continue;
+            }
+            struct ibv_sge sge;
+            sge.addr = (uint64_t)send_buf;
+            sge.length = msg_size;
+            sge.lkey = send_mr->lkey;
+            struct ibv_send_wr wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = next;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_SEND;
+            wr.send_flags = IBV_SEND_SIGNALED;
+            struct ibv_send_wr *bad_wr = nullptr;
+            int ret = ibv_post_send(cqps[next], &wr, &bad_wr);
+            CHECK(ret == 0, "ibv_post_send fail");
+            outstanding[next]++;
+            posted++;
+        }
+        int n = ibv_poll_cq(cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs[i];
+            if (wc.status != IBV_WC_SUCCESS)
+            {
+                printf("bad wc, status=%s, wr_id=%lu\n", ibv_wc_status_str(wc.status), wc.wr_id);
+            }
+            CHECK(wc.status == IBV_WC_SUCCESS, "bad wc");
+            if (wc.opcode == IBV_WC_SEND)
+            {
+                outstanding[wc.wr_id]--;
+                sent++;
+            }
+            else if (wc.opcode == IBV_WC_RECV)
+            {
+                received++;
+                if (pool)
+                {
+                    pool->release(wc.wr_id);
+                }
+                else
+                {
+                    post_rq(wc.wr_id);
+                }
+            }
+        }
+    }
+    run_result r;
+    r.elapsed_ns = now_ns() - start;
+    r.recv_mem = recv_mem;
+    r.msgs = msgs;
+    r.limit_events = pool ? pool->limit_events() : 0;
+    r.refills = pool ? pool->refills() : 0;
+
+    for (int i = 0; i < conns; i++)
+    {
+        ibv_destroy_qp(cqps[i]);
+        ibv_destroy_qp(sqps[i]);
+    }
+    delete pool;
+    if (rq_mr)
+    {
+        ibv_dereg_mr(rq_mr);
+        free(rq_bufs);
+    }
+    ibv_dereg_mr(send_mr);
+    free(send_buf);
+    ibv_destroy_cq(cq);
+    return r;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<int> conn_counts = {1, 64, 1024};
+    int msgs = 200000;
+    int rq_depth = 32;
+    int srq_size = 512;
+    uint32_t msg_size = 64;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:q:r:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+        {
+            conn_counts.clear();
+            char *save = nullptr;
+            for (char *tok = strtok_r(optarg, ",", &save); tok; tok = strtok_r(nullptr, ",", &save))
+            {
+                conn_counts.push_back(atoi(tok));
+            }
+            break;
+        }
+        case 'n':
+            msgs = atoi(optarg);
+            break;
+        case 'q':
+            rq_depth = atoi(optarg);
+            break;
+        case 'r':
+            srq_size = atoi(optarg);
+            break;
+        case 's':
+            msg_size = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-c 1,64,1024] [-n msgs] [-q rq_depth] [-r srq_size] [-s msg_size]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(msg_size > 0 && msg_size <= RECV_BUF_SIZE, "msg_size must be in (0, 4096]");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    rdma_dev dev;
+    dev.ctx = ibv_open_device(devs[0]);
+    CHECK(dev.ctx, "ibv_open_device fail");
+    dev.pd = ibv_alloc_pd(dev.ctx);
+    CHECK(dev.pd, "ibv_alloc_pd fail");
+    dev.path = probe_path(dev.ctx, PORT_NUM);
+    int ret = ibv_query_gid(dev.ctx, PORT_NUM, dev.path.gid_index, &dev.gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    ret = ibv_query_port(dev.ctx, PORT_NUM, &dev.port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    ret = ibv_query_device(dev.ctx, &dev.dev_attr);
+    CHECK(ret == 0, "ibv_query_device fail");
+    CHECK(dev.dev_attr.max_srq > 0, "device does not support srq");
+
+    printf("%-6s %-5s %14s %12s %10s %12s %8s\n",
+           "conns", "mode", "recv_mem_KiB", "msgs/s", "MB/s", "limit_events", "refills");
+    for (int conns : conn_counts)
+    {
+        for (int use_srq = 0; use_srq < 2; use_srq++)
+        {
+            run_result r = run(dev, conns, use_srq, msgs, rq_depth, srq_size, msg_size);
+            const double secs = r.elapsed_ns / 1e9;
+            printf("%-6d %-5s %14lu %12.0f %10.2f %12lu %8lu\n",
+                   conns, use_srq ? "srq" : "rq", r.recv_mem / 1024, r.msgs / secs,
+                   r.msgs * msg_size / secs / 1e6, r.limit_events, r.refills);
+        }
+    }
+
+    ibv_dealloc_pd(dev.pd);
+    ibv_close_device(dev.ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}
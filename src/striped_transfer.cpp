@@ -0,0 +1,605 @@
+/**
+ * Example of a striped bulk transfer over several qps and devices. If you have
+ * no RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181 to config
+ * Soft-RoCE(RXE).
+ *
+ * One big RDMA WRITE keeps one qp, one port and one engine busy while the
+ * others idle. striper cuts a transfer into `chunk` sized RDMA WRITEs,
+ * keeps at most `io_depth` of them in flight and spreads them over every qp
+ * of every rail (a rail is one device/port with its own pd, cq and mrs):
+ * - round robin: chunks go to the qps in turn,
+ * - load: a chunk goes to the qp with the fewest bytes in flight, a faster
+ *   rail completes sooner and so gets more chunks.
+ * The qps have no ordering among each other, so only after every chunk is
+ * completed a zero length SEND_WITH_IMM carrying the transfer id goes out,
+ * its receive completion on the other side is the single "transfer landed"
+ * event.
+ *
+ * The benchmark opens every device with an active port (or those given with
+ * -d) and moves `-s` MiB from src to dst over loopback pairs on each rail:
+ * once as one WR on one qp (skipped if the transfer is over the port's
+ * max_msg_sz), then striped. dst is checked after each run.
+ *
+ * g++ -O2 striped_transfer.cpp -libverbs -o striped_transfer
+ * ./striped_transfer [-s MiB] [-c chunk_KiB] [-q qps_per_rail] [-o io_depth] [-d dev1,dev2]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define QP_DEPTH 64
+#define NOTIFY_WR_ID (~0ull)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = QP_DEPTH;
+    init_attr.cap.max_recv_wr = QP_DEPTH;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+/**
+ * One device/port. Both buffers are registered on every rail, the sending
+ * qps write into dst through the receiving qps of the same rail.
+ */
+struct rail
+{
+    std::string name;
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_mr *src_mr;
+    struct ibv_mr *dst_mr;
+    std::vector<struct ibv_qp *> send_qps;
+    std::vector<struct ibv_qp *> recv_qps;
+    uint64_t bytes = 0; // moved by the last transfer
+    uint32_t max_msg_sz = 0;
+
+    // false if the port is not active
+    bool open(struct ibv_device *dev, char *src, char *dst, size_t len, int qps)
+    {
+        name = ibv_get_device_name(dev);
+        ctx = ibv_open_device(dev);
+        CHECK(ctx, "ibv_open_device fail");
+        struct ibv_port_attr port_attr;
+        int ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+        CHECK(ret == 0, "ibv_query_port fail");
+        if (port_attr.state != IBV_PORT_ACTIVE)
+        {
+            printf("skip %s, port %d is not active\n", name.c_str(), PORT_NUM);
+            ibv_close_device(ctx);
+            return false;
+        }
+        max_msg_sz = port_attr.max_msg_sz;
+        union ibv_gid gid;
+        const port_path path = probe_path(ctx, PORT_NUM);
+        ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+        CHECK(ret == 0, "ibv_query_gid fail");
+        pd = ibv_alloc_pd(ctx);
+        CHECK(pd, "ibv_alloc_pd fail");
+        cq = ibv_create_cq(ctx, 4 * QP_DEPTH * qps, nullptr, nullptr, 0);
+        CHECK(cq, "ibv_create_cq fail");
+        src_mr = ibv_reg_mr(pd, src, len, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(src_mr, "ibv_reg_mr src fail");
+        dst_mr = ibv_reg_mr(pd, dst, len, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+        CHECK(dst_mr, "ibv_reg_mr dst fail");
+        for (int i = 0; i < qps; i++)
+        {
+            struct ibv_qp *s = create_qp(pd, cq);
+            struct ibv_qp *r = create_qp(pd, cq);
+            init_qp(s);
+            init_qp(r);
+            modify_to_rtr(s, path, r->qp_num, 0, port_attr.lid, gid);
+            modify_to_rtr(r, path, s->qp_num, 0, port_attr.lid, gid);
+            modify_to_rts(s, 0);
+            modify_to_rts(r, 0);
+            send_qps.push_back(s);
+            recv_qps.push_back(r);
+        }
+        printf("rail %s: %d qps, active_mtu=%d, speed=%d, width=%d\n", name.c_str(), qps,
+               128 << port_attr.active_mtu, port_attr.active_speed, port_attr.active_width);
+        return true;
+    }
+    void close()
+    {
+        for (size_t i = 0; i < send_qps.size(); i++)
+        {
+            ibv_destroy_qp(send_qps[i]);
+            ibv_destroy_qp(recv_qps[i]);
+        }
+        ibv_destroy_cq(cq);
+        ibv_dereg_mr(src_mr);
+        ibv_dereg_mr(dst_mr);
+        ibv_dealloc_pd(pd);
+        ibv_close_device(ctx);
+    }
+};
+
+enum stripe_policy
+{
+    STRIPE_ROUND_ROBIN,
+    STRIPE_LOAD,
+};
+
+/**
+ * Moves src[0, len) to dst[0, len) over all qps of all rails. Only one
+ * transfer is active at a time, call poll() until it returns true.
+ */
+class striper
+{
+public:
+    striper(std::vector<rail> &rails, char *src, char *dst) : rails_(rails), src_(src), dst_(dst)
+    {
+        for (size_t r = 0; r < rails_.size(); r++)
+        {
+            for (size_t q = 0; q < rails_[r].send_qps.size(); q++)
+            {
+                lanes_.push_back({(int)r, (int)q, 0, 0});
+            }
+        }
+    }
+
+    void start(uint32_t id, size_t len, size_t chunk, int io_depth, stripe_policy policy)
+    {
+        CHECK(!active_, "a transfer is active");
+        id_ = id;
+        len_ = len;
+        chunk_ = chunk;
+        io_depth_ = io_depth;
+        policy_ = policy;
+        next_off_ = 0;
+        done_bytes_ = 0;
+        inflight_ = 0;
+        rr_ = 0;
+        notified_ = false;
+        landed_ = false;
+        active_ = true;
+        for (rail &r : rails_)
+        {
+            r.bytes = 0;
+        }
+        // the landing notice needs a receive on the first lane's peer
+        post_notify_recv();
+        fill();
+    }
+
+    // true once the transfer landed at the receiver
+    bool poll()
+    {
+        struct ibv_wc wcs[32];
+        for (rail &r : rails_)
+        {
+            int n = ibv_poll_cq(r.cq, 32, wcs);
+            CHECK(n >= 0, "ibv_poll_cq fail");
+            for (int i = 0; i < n; i++)
+            {
+                struct ibv_wc &wc = wcs[i];
+                if (wc.status != IBV_WC_SUCCESS)
+                {
+                    printf("wr %lu on %s failed, %s\n", wc.wr_id, r.name.c_str(), ibv_wc_status_str(wc.status));
+                    CHECK(false, "bad wc");
+                }
+                if (wc.opcode == IBV_WC_RECV)
+                {
+                    CHECK((wc.wc_flags & IBV_WC_WITH_IMM) && ntohl(wc.imm_data) == id_, "unexpected notice");
+                    landed_ = true;
+                    continue;
+                }
+                if (wc.wr_id == NOTIFY_WR_ID)
+                {
+                    continue;
+                }
+                lane &l = lanes_[wc.wr_id >> 32];
+                const uint32_t bytes = wc.wr_id & 0xffffffff;
+                l.inflight--;
+                l.inflight_bytes -= bytes;
+                inflight_--;
+                done_bytes_ += bytes;
+                r.bytes += bytes;
+            }
+        }
+        fill();
+        if (done_bytes_ == len_ && !notified_)
+        {
+            notify();
+        }
+        if (landed_)
+        {
+            active_ = false;
+        }
+        return landed_;
+    }
+
+private:
+    struct lane
+    {
+        int rail;
+        int qp;
+        int inflight;
+        uint64_t inflight_bytes;
+    };
+
+    int pick()
+    {
+        if (policy_ == STRIPE_ROUND_ROBIN)
+        {
+            for (size_t i = 0; i < lanes_.size(); i++)
+            {
+                const int l = rr_;
+                rr_ = (rr_ + 1) % lanes_.size();
+                if (lanes_[l].inflight < QP_DEPTH)
+                {
+                    return l;
+                }
+            }
+            return -1;
+        }
+        int best = -1;
+        for (size_t i = 0; i < lanes_.size(); i++)
+        {
+            if (lanes_[i].inflight < QP_DEPTH &&
+                (best < 0 || lanes_[i].inflight_bytes < lanes_[best].inflight_bytes))
+            {
+                best = i;
+            }
+        }
+        return best;
+    }
+
+    void fill()
+    {
+        while (next_off_ < len_ && inflight_ < io_depth_)
+        {
+            const int l = pick();
+            if (l < 0)
+            {
+                return;
+            }
+            const uint32_t n = std::min(chunk_, len_ - next_off_);
+            post_write(l, next_off_, n);
+            next_off_ += n;
+        }
+    }
+
+    void post_write(int l, size_t off, uint32_t n)
+    {
+        lane &ln = lanes_[l];
+        rail &r = rails_[ln.rail];
+        struct ibv_sge sge = {(uint64_t)src_ + off, n, r.src_mr->lkey};
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = ((uint64_t)l << 32) | n;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr = (uint64_t)dst_ + off;
+        wr.wr.rdma.rkey = r.dst_mr->rkey;
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(r.send_qps[ln.qp], &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send fail");
+        ln.inflight++;
+        ln.inflight_bytes += n;
+        inflight_++;
+    }
+
+    void post_notify_recv()
+    {
+        struct ibv_recv_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = NOTIFY_WR_ID;
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = ibv_post_recv(rails_[0].recv_qps[0], &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+    }
+
+    // every write is complete, i.e. acked by the receiver, tell it
+    void notify()
+    {
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = NOTIFY_WR_ID;
+        wr.opcode = IBV_WR_SEND_WITH_IMM;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.imm_data = htonl(id_);
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(rails_[0].send_qps[0], &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send notify fail");
+        notified_ = true;
+    }
+
+    std::vector<rail> &rails_;
+    char *src_;
+    char *dst_;
+    std::vector<lane> lanes_;
+    uint32_t id_ = 0;
+    size_t len_ = 0;
+    size_t chunk_ = 0;
+    int io_depth_ = 0;
+    stripe_policy policy_ = STRIPE_ROUND_ROBIN;
+    size_t next_off_ = 0;
+    size_t done_bytes_ = 0;
+    int inflight_ = 0;
+    int rr_ = 0;
+    bool notified_ = false;
+    bool landed_ = false;
+    bool active_ = false;
+};
+
+std::vector<std::string> split(const char *s)
+{
+    std::vector<std::string> out;
+    std::string cur;
+    for (; *s; s++)
+    {
+        if (*s == ',')
+        {
+            out.push_back(cur);
+            cur.clear();
+            continue;
+        }
+        cur += *s;
+    }
+    if (!cur.empty())
+    {
+        out.push_back(cur);
+    }
+    return out;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t mib = 256;
+    size_t chunk_kib = 1024;
+    int qps = 2;
+    int io_depth = 16;
+    const char *dev_list = nullptr;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:q:o:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            mib = atol(optarg);
+            break;
+        case 'c':
+            chunk_kib = atol(optarg);
+            break;
+        case 'q':
+            qps = atoi(optarg);
+            break;
+        case 'o':
+            io_depth = atoi(optarg);
+            break;
+        case 'd':
+            dev_list = optarg;
+            break;
+        default:
+            printf("usage: %s [-s MiB] [-c chunk_KiB] [-q qps_per_rail] [-o io_depth] [-d dev1,dev2]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(mib > 0 && mib < 4096 && chunk_kib > 0 && qps > 0 && io_depth > 0, "invalid args");
+    const size_t len = mib << 20;
+    size_t chunk = std::min(chunk_kib << 10, len);
+
+    char *src = (char *)aligned_alloc(4096, len);
+    char *dst = (char *)aligned_alloc(4096, len);
+    CHECK(src && dst, "aligned_alloc fail");
+    for (size_t i = 0; i < len; i += sizeof(uint64_t))
+    {
+        *(uint64_t *)(src + i) = i * 0x9e3779b97f4a7c15ull;
+    }
+
+    int num_devices;
+    struct ibv_device **devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    std::vector<std::string> want = dev_list ? split(dev_list) : std::vector<std::string>();
+    std::vector<rail> rails;
+    for (int i = 0; i < num_devices; i++)
+    {
+        if (!want.empty() && std::find(want.begin(), want.end(), ibv_get_device_name(devs[i])) == want.end())
+        {
+            continue;
+        }
+        rail r;
+        if (r.open(devs[i], src, dst, len, qps))
+        {
+            rails.push_back(r);
+        }
+    }
+    CHECK(!rails.empty(), "no usable device");
+    // a WR longer than max_msg_sz (usually 2GiB) fails with a bad wc
+    size_t max_msg = SIZE_MAX;
+    for (const rail &r : rails)
+    {
+        max_msg = std::min(max_msg, (size_t)r.max_msg_sz);
+    }
+    if (chunk > max_msg)
+    {
+        printf("chunk capped at max_msg_sz %zu KiB\n", max_msg >> 10);
+        chunk = max_msg;
+    }
+
+    struct run_cfg
+    {
+        const char *name;
+        size_t rails;
+        size_t chunk;
+        int io_depth;
+        stripe_policy policy;
+    };
+    // the first run is poll_cq's way: the whole buffer as one WR on one qp
+    const run_cfg runs[] = {
+        {"one wr", 1, len, 1, STRIPE_ROUND_ROBIN},
+        {"1 rail rr", 1, chunk, io_depth, STRIPE_ROUND_ROBIN},
+        {"all rails rr", rails.size(), chunk, io_depth, STRIPE_ROUND_ROBIN},
+        {"all rails load", rails.size(), chunk, io_depth, STRIPE_LOAD},
+    };
+    uint32_t id = 0;
+    for (const run_cfg &cfg : runs)
+    {
+        if (cfg.chunk > max_msg)
+        {
+            printf("%-15s skipped, %zu MiB is over max_msg_sz\n", cfg.name, len >> 20);
+            continue;
+        }
+        std::vector<rail> used(rails.begin(), rails.begin() + cfg.rails);
+        if (cfg.chunk == len)
+        {
+            used[0].send_qps.resize(1);
+            used[0].recv_qps.resize(1);
+        }
+        striper s(used, src, dst);
+        memset(dst, 0, len);
+        const uint64_t start = now_ns();
+        s.start(++id, len, cfg.chunk, cfg.io_depth, cfg.policy);
+        while (!s.poll())
+        {
+        }
+        const double secs = (now_ns() - start) / 1e9;
+        CHECK(memcmp(src, dst, len) == 0, "dst differs from src");
+        printf("%-15s chunk=%7zu KiB, io_depth=%-3d %8.2f GB/s, per rail:", cfg.name, cfg.chunk >> 10,
+               cfg.io_depth, len / secs / 1e9);
+        for (rail &r : used)
+        {
+            printf(" %s=%.0f%%", r.name.c_str(), 100.0 * r.bytes / len);
+        }
+        printf("\n");
+    }
+
+    for (rail &r : rails)
+    {
+        r.close();
+    }
+    ibv_free_device_list(devs);
+    free(src);
+    free(dst);
+    return 0;
+}
@@ -0,0 +1,1240 @@
+/**
+ * Example of a datagram (UD) messaging transport. If you have no RDMA hardware, see
+ * https://zhuanlan.zhihu.com/p/653997181 to config Soft-RoCE(RXE).
+ *
+ * A full mesh over RC needs one qp per peer, at thousands of peers the NIC's
+ * qp context cache thrashes. ud_transport talks to any number of peers over
+ * one UD qp:
+ * - ah_cache: address handles keyed by gid/lid, every peer behind the same
+ *   port shares one, a peer itself is just ah + qpn + some state.
+ * - messages are cut into mtu sized fragments, each carries a ud_hdr, the
+ *   receiver reassembles them in order.
+ * - reliability is go-back-N per peer: every fragment has a psn, the receiver
+ *   only accepts the next psn and returns cumulative ACKs (every ack_every
+ *   fragments, after ack_delay, or at once on a gap), the sender keeps
+ *   fragments in registered slots until ACKed and resends all of them when
+ *   nothing was ACKed for rto.
+ *
+ * The benchmark forks `-S` sink processes emulating `-N` peers, each peer
+ * has its own qp in a sink, all qps of a sink share an srq and a cq. The
+ * parent is the node under test, it sends `-m` messages round robin to all
+ * peers, once over N RC qps and once over one UD qp, and reports setup time
+ * and messages/s. Run it with -N 16, 64, ..., 4096 to see the scaling.
+ * Every UD message carries the peer id and a sequence number, the sinks
+ * check both and the payload. `-l` drops that fraction of the datagrams
+ * each side receives, data and ACKs, to exercise retransmission.
+ *
+ * g++ -O2 ud_transport.cpp -libverbs -o ud_transport
+ * ./ud_transport [-N peers] [-S sinks] [-m msgs] [-s size] [-w window] [-l loss]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define QKEY 0x11111111
+#define GRH_SIZE 40
+#define SQ_DEPTH 512
+#define RC_DEPTH 16
+#define SRQ_DEPTH 4096
+#define SINK_SQ_DEPTH 16
+#define RC_CQE 4096
+#define ACK_WR_ID (~0ull)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int mtu_to_num(enum ibv_mtu mtu)
+{
+    return 128 << mtu;
+}
+
+struct ibv_qp *create_ud_qp(struct ibv_pd *pd, struct ibv_cq *cq, struct ibv_srq *srq, int depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.srq = srq;
+    init_attr.cap.max_send_wr = depth;
+    init_attr.cap.max_recv_wr = srq ? 0 : depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = 64;
+    init_attr.qp_type = IBV_QPT_UD;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp ud fail");
+    return qp;
+}
+// a UD qp needs no peer to get ready, INIT with a qkey, RTR and RTS
+bool ud_to_rts(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qkey = QKEY;
+    int ret = ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY);
+    CHECK(ret == 0, "ibv_modify_qp ud init fail");
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    ret = ibv_modify_qp(qp, &attr, IBV_QP_STATE);
+    CHECK(ret == 0, "ibv_modify_qp ud RTR fail");
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    ret = ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
+    CHECK(ret == 0, "ibv_modify_qp ud RTS fail");
+    return true;
+}
+
+struct ibv_qp *create_rc_qp(struct ibv_pd *pd, struct ibv_cq *cq, struct ibv_srq *srq, int depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.srq = srq;
+    init_attr.cap.max_send_wr = depth;
+    init_attr.cap.max_recv_wr = srq ? 0 : 1;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp rc fail");
+    return qp;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool rc_to_rts(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, union ibv_gid gid, uint16_t dlid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE;
+    int ret = ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = 0;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.port_num = PORT_NUM;
+    ret = ibv_modify_qp(qp, &attr,
+                        IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                            IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                            IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = 0;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7;
+    attr.max_rd_atomic = 1;
+    ret = ibv_modify_qp(qp, &attr,
+                        IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+                            IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN | IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+/**
+ * Address handles keyed by gid and lid. An ah only describes the path to a
+ * port, so all peers behind one port share an entry, no matter how many
+ * qps or processes they are.
+ */
+class ah_cache
+{
+public:
+    ah_cache(struct ibv_pd *pd, int sgid_index) : pd_(pd), sgid_index_(sgid_index) {}
+    ~ah_cache()
+    {
+        for (auto &kv : map_)
+        {
+            ibv_destroy_ah(kv.second);
+        }
+    }
+
+    struct ibv_ah *get(const union ibv_gid &gid, uint16_t lid)
+    {
+        std::string key((const char *)gid.raw, sizeof(gid.raw));
+        key.append((const char *)&lid, sizeof(lid));
+        auto it = map_.find(key);
+        if (it != map_.end())
+        {
+            hits_++;
+            return it->second;
+        }
+        misses_++;
+        struct ibv_ah_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.is_global = 1;
+        attr.grh.dgid = gid;
+        attr.grh.sgid_index = sgid_index_;
+        attr.grh.hop_limit = 64;
+        attr.dlid = lid;
+        attr.port_num = PORT_NUM;
+        struct ibv_ah *ah = ibv_create_ah(pd_, &attr);
+        CHECK(ah, "ibv_create_ah fail");
+        map_[key] = ah;
+        return ah;
+    }
+
+    size_t size() const { return map_.size(); }
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+
+private:
+    struct ibv_pd *pd_;
+    int sgid_index_;
+    std::unordered_map<std::string, struct ibv_ah *> map_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+// receive buffers of one mtu plus the GRH, posted to a qp or an srq
+class recv_ring
+{
+public:
+    recv_ring(struct ibv_pd *pd, int count, uint32_t buf_size)
+        : count_(count), buf_size_(buf_size)
+    {
+        buf_ = (char *)malloc((size_t)count * buf_size);
+        CHECK(buf_, "malloc fail");
+        mr_ = ibv_reg_mr(pd, buf_, (size_t)count * buf_size, IBV_ACCESS_LOCAL_WRITE);
+        CHECK(mr_, "ibv_reg_mr fail");
+    }
+    ~recv_ring()
+    {
+        ibv_dereg_mr(mr_);
+        free(buf_);
+    }
+
+    int count() const { return count_; }
+    char *buf(uint64_t i) { return buf_ + i * buf_size_; }
+
+    void post(uint64_t i, struct ibv_qp *qp, struct ibv_srq *srq)
+    {
+        struct ibv_sge sge = {(uint64_t)buf(i), buf_size_, mr_->lkey};
+        struct ibv_recv_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = i;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        struct ibv_recv_wr *bad_wr = nullptr;
+        int ret = srq ? ibv_post_srq_recv(srq, &wr, &bad_wr) : ibv_post_recv(qp, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_recv fail");
+    }
+
+private:
+    const int count_;
+    const uint32_t buf_size_;
+    char *buf_;
+    struct ibv_mr *mr_;
+};
+
+enum
+{
+    UD_DATA = 1,
+    UD_ACK = 2,
+};
+
+// host byte order, all peers are assumed to share it
+struct ud_hdr
+{
+    uint8_t type;
+    uint8_t rsvd;
+    uint16_t frag;
+    uint16_t nfrags;
+    uint16_t rsvd2;
+    uint32_t src; // the sender's id in the receiver's peer table
+    uint32_t psn; // UD_DATA: psn of this fragment
+    uint32_t ack; // UD_ACK: next psn expected
+    uint32_t msg_len;
+};
+
+struct ud_addr
+{
+    uint8_t gid[16];
+    uint32_t lid;
+    uint32_t qpn;
+    uint32_t id; // the owner's id in our peer table
+};
+
+class ud_transport
+{
+public:
+    struct options
+    {
+        uint32_t mtu = 1024;        // UD payload size, GRH not included
+        int slots = 4096;           // send slots shared by all peers
+        int window = 32;            // unacked fragments per peer
+        int sq_depth = SQ_DEPTH;    // max_send_wr of the qp
+        int ack_every = 16;         // fragments per ACK
+        uint64_t ack_delay_ns = 50000;
+        uint64_t rto_ns = 2000000;
+        double loss = 0;            // fraction of received datagrams dropped on purpose
+    };
+    typedef std::function<void(uint32_t peer, const char *data, uint32_t len)> deliver_fn;
+
+    ud_transport(struct ibv_pd *pd, struct ibv_qp *qp, ah_cache &ahs, const options &o, deliver_fn deliver)
+        : qp_(qp), ahs_(ahs), o_(o), deliver_(deliver), slot_state_(o.slots), rng_(qp->qp_num)
+    {
+        if (o_.slots > 0)
+        {
+            slot_buf_ = (char *)malloc((size_t)o_.slots * o_.mtu);
+            CHECK(slot_buf_, "malloc fail");
+            slot_mr_ = ibv_reg_mr(pd, slot_buf_, (size_t)o_.slots * o_.mtu, IBV_ACCESS_LOCAL_WRITE);
+            CHECK(slot_mr_, "ibv_reg_mr fail");
+        }
+        for (int i = o_.slots - 1; i >= 0; i--)
+        {
+            free_slots_.push_back(i);
+        }
+    }
+    ~ud_transport()
+    {
+        if (slot_mr_)
+        {
+            ibv_dereg_mr(slot_mr_);
+        }
+        free(slot_buf_);
+    }
+
+    uint32_t add_peer(const ud_addr &a)
+    {
+        union ibv_gid gid;
+        memcpy(gid.raw, a.gid, sizeof(gid.raw));
+        peer p;
+        p.ah = ahs_.get(gid, a.lid);
+        p.qpn = a.qpn;
+        p.remote_id = a.id;
+        peers_.push_back(std::move(p));
+        return peers_.size() - 1;
+    }
+
+    uint32_t max_payload() const { return o_.mtu - sizeof(ud_hdr); }
+
+    // false if the peer's window, the send slots or the sq are full, try again after poll
+    bool send(uint32_t id, const void *data, uint32_t len)
+    {
+        peer &p = peers_[id];
+        const uint32_t nfrags = len ? (len + max_payload() - 1) / max_payload() : 1;
+        CHECK(nfrags <= (uint32_t)o_.window, "message larger than the window");
+        if (p.unacked.size() + nfrags > (size_t)o_.window || free_slots_.size() < nfrags)
+        {
+            return false;
+        }
+        for (uint32_t f = 0; f < nfrags; f++)
+        {
+            const uint32_t off = f * max_payload();
+            const uint32_t n = std::min(len - off, max_payload());
+            const uint32_t slot = free_slots_.back();
+            free_slots_.pop_back();
+            slot_state_[slot].refs = 0;
+            slot_state_[slot].acked = false;
+            char *b = slot_buf_ + (size_t)slot * o_.mtu;
+            ud_hdr *h = (ud_hdr *)b;
+            memset(h, 0, sizeof(*h));
+            h->type = UD_DATA;
+            h->frag = f;
+            h->nfrags = nfrags;
+            h->src = p.remote_id;
+            h->psn = p.next_psn++;
+            h->msg_len = len;
+            memcpy(b + sizeof(*h), (const char *)data + off, n);
+            p.unacked.push_back({slot, h->psn, (uint32_t)sizeof(*h) + n, f == nfrags - 1});
+        }
+        if (p.unacked.size() == nfrags)
+        {
+            p.last_progress = now_ns();
+        }
+        activate(id);
+        flush(id);
+        return true;
+    }
+
+    void on_send_wc(const struct ibv_wc &wc)
+    {
+        CHECK(wc.status == IBV_WC_SUCCESS, "ud send fail");
+        sq_inflight_--;
+        if (wc.wr_id != ACK_WR_ID)
+        {
+            slot &s = slot_state_[wc.wr_id];
+            if (--s.refs == 0 && s.acked)
+            {
+                free_slots_.push_back(wc.wr_id);
+            }
+        }
+        // the sq has room again for peers that could not post everything
+        while (!blocked_.empty() && sq_inflight_ < o_.sq_depth)
+        {
+            uint32_t id = blocked_.back();
+            blocked_.pop_back();
+            peers_[id].blocked = false;
+            flush(id);
+        }
+    }
+
+    // payload points past the GRH, len excludes it
+    void on_recv(const char *payload, uint32_t len)
+    {
+        if (len < sizeof(ud_hdr))
+        {
+            return;
+        }
+        if (o_.loss > 0 && std::uniform_real_distribution<double>(0, 1)(rng_) < o_.loss)
+        {
+            lost_++;
+            return;
+        }
+        const ud_hdr *h = (const ud_hdr *)payload;
+        if (h->src >= peers_.size())
+        {
+            return;
+        }
+        peer &p = peers_[h->src];
+        if (h->type == UD_ACK)
+        {
+            on_ack(p, h->ack);
+            return;
+        }
+        if (h->psn != p.expect)
+        {
+            // a duplicate or a gap, tell the sender where we are
+            dropped_++;
+            send_ack(h->src);
+            return;
+        }
+        p.expect++;
+        if (h->frag == 0)
+        {
+            p.msg.clear();
+        }
+        p.msg.insert(p.msg.end(), payload + sizeof(*h), payload + len);
+        if (h->frag + 1 == h->nfrags)
+        {
+            deliver_(h->src, p.msg.data(), p.msg.size());
+        }
+        if (++p.since_ack >= (uint32_t)o_.ack_every)
+        {
+            send_ack(h->src);
+        }
+        activate(h->src);
+    }
+
+    // delayed ACKs and retransmits, call it every few microseconds
+    void tick(uint64_t now)
+    {
+        size_t keep = 0;
+        for (size_t i = 0; i < active_.size(); i++)
+        {
+            const uint32_t id = active_[i];
+            peer &p = peers_[id];
+            if (!p.unacked.empty() && now - p.last_progress > o_.rto_ns)
+            {
+                // go back N, resend everything not ACKed yet
+                retransmits_ += p.unacked.size();
+                p.next_post = 0;
+                p.last_progress = now;
+                flush(id);
+            }
+            if (p.since_ack > 0 && now - p.last_ack > o_.ack_delay_ns)
+            {
+                send_ack(id);
+            }
+            if (p.unacked.empty() && p.since_ack == 0)
+            {
+                p.active = false;
+                continue;
+            }
+            active_[keep++] = id;
+        }
+        active_.resize(keep);
+    }
+
+    size_t peers() const { return peers_.size(); }
+    uint64_t acked_msgs() const { return acked_msgs_; }
+    uint64_t retransmits() const { return retransmits_; }
+    uint64_t dropped() const { return dropped_; }
+    uint64_t lost() const { return lost_; }
+
+private:
+    struct tx_frag
+    {
+        uint32_t slot;
+        uint32_t psn;
+        uint32_t len;
+        bool last; // last fragment of its message
+    };
+    struct peer
+    {
+        struct ibv_ah *ah;
+        uint32_t qpn;
+        uint32_t remote_id;
+        bool active = false;
+        bool blocked = false;
+        // sender
+        uint32_t next_psn = 0;
+        std::deque<tx_frag> unacked;
+        size_t next_post = 0; // unacked[next_post..] still has to be posted
+        uint64_t last_progress = 0;
+        // receiver
+        uint32_t expect = 0;
+        uint32_t since_ack = 0;
+        uint64_t last_ack = 0;
+        std::vector<char> msg;
+    };
+    struct slot
+    {
+        uint32_t refs = 0; // posted and not completed yet
+        bool acked = false;
+    };
+
+    void activate(uint32_t id)
+    {
+        if (!peers_[id].active)
+        {
+            peers_[id].active = true;
+            active_.push_back(id);
+        }
+    }
+
+    void flush(uint32_t id)
+    {
+        peer &p = peers_[id];
+        while (p.next_post < p.unacked.size())
+        {
+            if (sq_inflight_ >= o_.sq_depth)
+            {
+                if (!p.blocked)
+                {
+                    p.blocked = true;
+                    blocked_.push_back(id);
+                }
+                return;
+            }
+            const tx_frag &f = p.unacked[p.next_post++];
+            struct ibv_sge sge = {(uint64_t)slot_buf_ + (uint64_t)f.slot * o_.mtu, f.len, slot_mr_->lkey};
+            struct ibv_send_wr wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = f.slot;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_SEND;
+            wr.send_flags = IBV_SEND_SIGNALED;
+            wr.wr.ud.ah = p.ah;
+            wr.wr.ud.remote_qpn = p.qpn;
+            wr.wr.ud.remote_qkey = QKEY;
+            struct ibv_send_wr *bad_wr = nullptr;
+            int ret = ibv_post_send(qp_, &wr, &bad_wr);
+            CHECK(ret == 0, "ibv_post_send ud fail");
+            slot_state_[f.slot].refs++;
+            sq_inflight_++;
+        }
+    }
+
+    void on_ack(peer &p, uint32_t ack)
+    {
+        bool progress = false;
+        while (!p.unacked.empty() && (int32_t)(ack - p.unacked.front().psn) > 0)
+        {
+            const tx_frag f = p.unacked.front();
+            p.unacked.pop_front();
+            if (p.next_post > 0)
+            {
+                p.next_post--;
+            }
+            slot &s = slot_state_[f.slot];
+            s.acked = true;
+            if (s.refs == 0)
+            {
+                free_slots_.push_back(f.slot);
+            }
+            if (f.last)
+            {
+                acked_msgs_++;
+            }
+            progress = true;
+        }
+        if (progress)
+        {
+            p.last_progress = now_ns();
+        }
+    }
+
+    void send_ack(uint32_t id)
+    {
+        peer &p = peers_[id];
+        if (sq_inflight_ >= o_.sq_depth)
+        {
+            return; // tick() tries again
+        }
+        ud_hdr h;
+        memset(&h, 0, sizeof(h));
+        h.type = UD_ACK;
+        h.src = p.remote_id;
+        h.ack = p.expect;
+        struct ibv_sge sge = {(uint64_t)&h, sizeof(h), 0};
+        struct ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = ACK_WR_ID;
+        wr.sg_list = &sge;
+        wr.num_sge = 1;
+        wr.opcode = IBV_WR_SEND;
+        wr.send_flags = IBV_SEND_SIGNALED | IBV_SEND_INLINE;
+        wr.wr.ud.ah = p.ah;
+        wr.wr.ud.remote_qpn = p.qpn;
+        wr.wr.ud.remote_qkey = QKEY;
+        struct ibv_send_wr *bad_wr = nullptr;
+        int ret = ibv_post_send(qp_, &wr, &bad_wr);
+        CHECK(ret == 0, "ibv_post_send ack fail");
+        sq_inflight_++;
+        p.since_ack = 0;
+        p.last_ack = now_ns();
+    }
+
+    struct ibv_qp *qp_;
+    ah_cache &ahs_;
+    const options o_;
+    deliver_fn deliver_;
+    std::vector<peer> peers_;
+    std::vector<uint32_t> active_;  // peers with unacked data or a pending ACK
+    std::vector<uint32_t> blocked_; // peers waiting for sq room
+    char *slot_buf_ = nullptr;
+    struct ibv_mr *slot_mr_ = nullptr;
+    std::vector<slot> slot_state_;
+    std::vector<uint32_t> free_slots_;
+    int sq_inflight_ = 0;
+    uint64_t acked_msgs_ = 0;
+    uint64_t retransmits_ = 0;
+    uint64_t dropped_ = 0;
+    std::minstd_rand rng_;
+    uint64_t lost_ = 0;
+};
+
+/* benchmark: the parent is the node, forked sinks host the peers */
+
+struct options
+{
+    int peers = 256;
+    int sinks = 4;
+    int msgs = 200000;
+    uint32_t size = 4096;
+    int window = 32;
+    double loss = 0;
+};
+
+// head of every UD benchmark message, the rest is filled with fill_byte()
+struct msg_stamp
+{
+    uint32_t peer;
+    uint32_t seq;
+};
+
+static inline char fill_byte(const msg_stamp &m)
+{
+    return (char)(m.peer * 31 + m.seq);
+}
+
+struct dev
+{
+    struct ibv_context *ctx;
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    union ibv_gid gid;
+    struct ibv_port_attr port_attr;
+    port_path path;
+
+    void open(int cqe)
+    {
+        int num_devices;
+        struct ibv_device **devs = ibv_get_device_list(&num_devices);
+        CHECK(devs && num_devices, "ibv_get_device_list fail");
+        ctx = ibv_open_device(devs[0]);
+        CHECK(ctx, "ibv_open_device fail");
+        ibv_free_device_list(devs);
+        pd = ibv_alloc_pd(ctx);
+        CHECK(pd, "ibv_alloc_pd fail");
+        cq = ibv_create_cq(ctx, cqe, nullptr, nullptr, 0);
+        CHECK(cq, "ibv_create_cq fail");
+        path = probe_path(ctx, PORT_NUM);
+        int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+        CHECK(ret == 0, "ibv_query_gid fail");
+        ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+        CHECK(ret == 0, "ibv_query_port fail");
+    }
+    void close()
+    {
+        ibv_destroy_cq(cq);
+        ibv_dealloc_pd(pd);
+        ibv_close_device(ctx);
+    }
+    ud_addr addr(struct ibv_qp *qp, uint32_t id)
+    {
+        ud_addr a;
+        memcpy(a.gid, gid.raw, sizeof(a.gid));
+        a.lid = port_attr.lid;
+        a.qpn = qp->qp_num;
+        a.id = id;
+        return a;
+    }
+};
+
+void write_all(int fd, const void *buf, size_t n)
+{
+    const char *p = (const char *)buf;
+    while (n > 0)
+    {
+        ssize_t r = write(fd, p, n);
+        CHECK(r > 0 || errno == EINTR, "pipe write fail");
+        if (r > 0)
+        {
+            p += r;
+            n -= r;
+        }
+    }
+}
+void read_all(int fd, void *buf, size_t n)
+{
+    char *p = (char *)buf;
+    while (n > 0)
+    {
+        ssize_t r = read(fd, p, n);
+        CHECK(r > 0 || errno == EINTR || errno == EAGAIN, "pipe read fail");
+        if (r > 0)
+        {
+            p += r;
+            n -= r;
+        }
+    }
+}
+
+struct sink_result
+{
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t dropped;
+    uint64_t lost;
+    uint64_t bad; // wrong length, peer, order or payload
+};
+
+/**
+ * A sink hosts peers [first, first + count) of the node, one qp each on a
+ * shared srq and cq. Protocol on the pipes: the sink sends its addresses,
+ * gets the node's, answers with one byte once ready, runs until the node
+ * writes one byte and finally sends a sink_result.
+ */
+void run_sink(bool ud, int first, int count, const options &opts, int rfd, int wfd)
+{
+    dev d;
+    d.open(SRQ_DEPTH + count * SINK_SQ_DEPTH);
+    struct ibv_srq_init_attr srq_attr;
+    memset(&srq_attr, 0, sizeof(srq_attr));
+    srq_attr.attr.max_wr = SRQ_DEPTH;
+    srq_attr.attr.max_sge = 1;
+    struct ibv_srq *srq = ibv_create_srq(d.pd, &srq_attr);
+    CHECK(srq, "ibv_create_srq fail");
+    const uint32_t mtu = mtu_to_num(d.port_attr.active_mtu);
+    recv_ring *ring = new recv_ring(d.pd, SRQ_DEPTH, ud ? mtu + GRH_SIZE : opts.size);
+    for (int i = 0; i < ring->count(); i++)
+    {
+        ring->post(i, nullptr, srq);
+    }
+
+    std::vector<struct ibv_qp *> qps(count);
+    std::vector<ud_addr> mine(count), node(count);
+    for (int i = 0; i < count; i++)
+    {
+        qps[i] = ud ? create_ud_qp(d.pd, d.cq, srq, SINK_SQ_DEPTH) : create_rc_qp(d.pd, d.cq, srq, 1);
+        if (ud)
+        {
+            ud_to_rts(qps[i]);
+        }
+        mine[i] = d.addr(qps[i], 0); // the node is peer 0 of every sink transport
+    }
+    write_all(wfd, mine.data(), sizeof(ud_addr) * count);
+    read_all(rfd, node.data(), sizeof(ud_addr) * count);
+
+    sink_result res = {0, 0, 0, 0, 0};
+    std::vector<uint32_t> next_seq(count, 0);
+    ah_cache *ahs = new ah_cache(d.pd, d.path.gid_index);
+    std::vector<ud_transport *> ts;
+    std::unordered_map<uint32_t, ud_transport *> by_qpn;
+    ud_transport::options o;
+    o.mtu = mtu;
+    o.slots = 0; // sinks only send ACKs
+    o.sq_depth = SINK_SQ_DEPTH;
+    o.loss = opts.loss;
+    for (int i = 0; i < count; i++)
+    {
+        if (!ud)
+        {
+            union ibv_gid gid;
+            memcpy(gid.raw, node[i].gid, sizeof(gid.raw));
+            rc_to_rts(qps[i], d.path, node[i].qpn, gid, node[i].lid);
+            continue;
+        }
+        ud_transport *t = new ud_transport(d.pd, qps[i], *ahs, o, [&, i](uint32_t, const char *data, uint32_t len) {
+            res.msgs++;
+            res.bytes += len;
+            msg_stamp m;
+            if (len != opts.size)
+            {
+                res.bad++;
+                return;
+            }
+            memcpy(&m, data, sizeof(m));
+            const char fill = fill_byte(m);
+            bool ok = m.peer == (uint32_t)(first + i) && m.seq == next_seq[i];
+            for (uint32_t k = sizeof(m); ok && k < len; k++)
+            {
+                ok = data[k] == fill;
+            }
+            res.bad += !ok;
+            next_seq[i] = m.seq + 1;
+        });
+        t->add_peer(node[i]);
+        ts.push_back(t);
+        by_qpn[qps[i]->qp_num] = t;
+    }
+    char c = 1;
+    write_all(wfd, &c, 1);
+
+    fcntl(rfd, F_SETFL, O_NONBLOCK);
+    struct ibv_wc wcs[64];
+    uint64_t last_tick = 0;
+    while (true)
+    {
+        int n = ibv_poll_cq(d.cq, 64, wcs);
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs[i];
+            if (!ud)
+            {
+                CHECK(wc.status == IBV_WC_SUCCESS, "rc recv fail");
+                res.msgs++;
+                res.bytes += wc.byte_len;
+                ring->post(wc.wr_id, nullptr, srq);
+                continue;
+            }
+            ud_transport *t = by_qpn[wc.qp_num];
+            if (wc.opcode & IBV_WC_RECV)
+            {
+                CHECK(wc.status == IBV_WC_SUCCESS, "ud recv fail");
+                t->on_recv(ring->buf(wc.wr_id) + GRH_SIZE, wc.byte_len - GRH_SIZE);
+                ring->post(wc.wr_id, nullptr, srq);
+            }
+            else
+            {
+                t->on_send_wc(wc);
+            }
+        }
+        const uint64_t now = now_ns();
+        if (now - last_tick > 20000)
+        {
+            last_tick = now;
+            for (ud_transport *t : ts)
+            {
+                t->tick(now);
+            }
+            if (read(rfd, &c, 1) == 1)
+            {
+                break;
+            }
+        }
+    }
+    for (ud_transport *t : ts)
+    {
+        res.dropped += t->dropped();
+        res.lost += t->lost();
+        delete t;
+    }
+    write_all(wfd, &res, sizeof(res));
+
+    delete ahs;
+    for (struct ibv_qp *qp : qps)
+    {
+        ibv_destroy_qp(qp);
+    }
+    ibv_destroy_srq(srq);
+    delete ring;
+    d.close();
+}
+
+struct sink_proc
+{
+    pid_t pid;
+    int rfd; // from the sink
+    int wfd; // to the sink
+    int first;
+    int count;
+};
+
+std::vector<sink_proc> fork_sinks(const options &o, bool ud)
+{
+    std::vector<sink_proc> sinks;
+    for (int s = 0; s < o.sinks; s++)
+    {
+        sink_proc sp;
+        sp.first = (long)o.peers * s / o.sinks;
+        sp.count = (long)o.peers * (s + 1) / o.sinks - sp.first;
+        int to_sink[2], from_sink[2];
+        CHECK(pipe(to_sink) == 0 && pipe(from_sink) == 0, "pipe fail");
+        sp.pid = fork();
+        CHECK(sp.pid >= 0, "fork fail");
+        if (sp.pid == 0)
+        {
+            close(to_sink[1]);
+            close(from_sink[0]);
+            run_sink(ud, sp.first, sp.count, o, to_sink[0], from_sink[1]);
+            _exit(0);
+        }
+        close(to_sink[0]);
+        close(from_sink[1]);
+        sp.rfd = from_sink[0];
+        sp.wfd = to_sink[1];
+        sinks.push_back(sp);
+    }
+    return sinks;
+}
+
+void stop_sinks(std::vector<sink_proc> &sinks, sink_result &total)
+{
+    total = {0, 0, 0, 0, 0};
+    for (sink_proc &sp : sinks)
+    {
+        char c = 1;
+        write_all(sp.wfd, &c, 1);
+        sink_result r;
+        read_all(sp.rfd, &r, sizeof(r));
+        total.msgs += r.msgs;
+        total.bytes += r.bytes;
+        total.dropped += r.dropped;
+        total.lost += r.lost;
+        total.bad += r.bad;
+        waitpid(sp.pid, nullptr, 0);
+        close(sp.rfd);
+        close(sp.wfd);
+    }
+}
+
+void report(const char *name, const options &o, int qps, double setup_s, double run_s,
+            const sink_result &r)
+{
+    printf("%-3s peers=%-5d node qps=%-5d setup=%7.1f ms, %9.0f msgs/s, %7.1f MB/s, sinks got %lu/%d msgs",
+           name, o.peers, qps, setup_s * 1e3, o.msgs / run_s, (double)o.msgs * o.size / run_s / 1e6,
+           r.msgs, o.msgs);
+    CHECK(r.msgs == (uint64_t)o.msgs && r.bytes == (uint64_t)o.msgs * o.size, "messages lost");
+    CHECK(r.bad == 0, "messages corrupt or out of order");
+}
+
+void bench_rc(const options &o)
+{
+    std::vector<sink_proc> sinks = fork_sinks(o, false);
+    const uint64_t t0 = now_ns();
+    dev d;
+    d.open(RC_CQE);
+    char *buf = (char *)malloc(o.size);
+    CHECK(buf, "malloc fail");
+    memset(buf, 'r', o.size);
+    struct ibv_mr *mr = ibv_reg_mr(d.pd, buf, o.size, IBV_ACCESS_LOCAL_WRITE);
+    CHECK(mr, "ibv_reg_mr fail");
+    std::vector<struct ibv_qp *> qps(o.peers);
+    for (sink_proc &sp : sinks)
+    {
+        std::vector<ud_addr> theirs(sp.count), mine(sp.count);
+        read_all(sp.rfd, theirs.data(), sizeof(ud_addr) * sp.count);
+        for (int i = 0; i < sp.count; i++)
+        {
+            struct ibv_qp *qp = create_rc_qp(d.pd, d.cq, nullptr, RC_DEPTH);
+            union ibv_gid gid;
+            memcpy(gid.raw, theirs[i].gid, sizeof(gid.raw));
+            rc_to_rts(qp, d.path, theirs[i].qpn, gid, theirs[i].lid);
+            qps[sp.first + i] = qp;
+            mine[i] = d.addr(qp, sp.first + i);
+        }
+        write_all(sp.wfd, mine.data(), sizeof(ud_addr) * sp.count);
+    }
+    for (sink_proc &sp : sinks)
+    {
+        char c;
+        read_all(sp.rfd, &c, 1);
+    }
+    const double setup = (now_ns() - t0) / 1e9;
+
+    std::vector<int> inflight(o.peers, 0);
+    std::vector<struct ibv_wc> wcs(64);
+    int sent = 0, done = 0, peer = 0;
+    const uint64_t start = now_ns();
+    while (done < o.msgs)
+    {
+        // round robin, skip peers whose sq is full, never more than the cq holds
+        for (int tries = 0; sent < o.msgs && sent - done < RC_CQE && tries < o.peers; tries++, peer = (peer + 1) % o.peers)
+        {
+            if (inflight[peer] >= RC_DEPTH)
+            {
+                continue;
+            }
+            struct ibv_sge sge = {(uint64_t)buf, o.size, mr->lkey};
+            struct ibv_send_wr wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = peer;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_SEND;
+            wr.send_flags = IBV_SEND_SIGNALED;
+            struct ibv_send_wr *bad_wr = nullptr;
+            int ret = ibv_post_send(qps[peer], &wr, &bad_wr);
+            CHECK(ret == 0, "ibv_post_send fail");
+            inflight[peer]++;
+            sent++;
+            peer = (peer + 1) % o.peers;
+            break;
+        }
+        int n = ibv_poll_cq(d.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            CHECK(wcs[i].status == IBV_WC_SUCCESS, "rc send fail");
+            inflight[wcs[i].wr_id]--;
+            done++;
+        }
+    }
+    const double secs = (now_ns() - start) / 1e9;
+    sink_result r;
+    stop_sinks(sinks, r);
+    report("rc", o, o.peers, setup, secs, r);
+    printf("\n");
+
+    for (struct ibv_qp *qp : qps)
+    {
+        ibv_destroy_qp(qp);
+    }
+    ibv_dereg_mr(mr);
+    free(buf);
+    d.close();
+}
+
+void bench_ud(const options &o)
+{
+    std::vector<sink_proc> sinks = fork_sinks(o, true);
+    const uint64_t t0 = now_ns();
+    dev d;
+    d.open(2 * SQ_DEPTH + 1024);
+    const uint32_t mtu = mtu_to_num(d.port_attr.active_mtu);
+    struct ibv_qp *qp = create_ud_qp(d.pd, d.cq, nullptr, SQ_DEPTH);
+    ud_to_rts(qp);
+    recv_ring *ring = new recv_ring(d.pd, 1024, mtu + GRH_SIZE);
+    for (int i = 0; i < ring->count(); i++)
+    {
+        ring->post(i, qp, nullptr);
+    }
+    ah_cache *ahs = new ah_cache(d.pd, d.path.gid_index);
+    ud_transport::options to;
+    to.mtu = mtu;
+    to.window = o.window;
+    to.ack_every = std::max(1, o.window / 2);
+    to.loss = o.loss;
+    ud_transport *t = new ud_transport(d.pd, qp, *ahs, to, [](uint32_t, const char *, uint32_t) {});
+    for (sink_proc &sp : sinks)
+    {
+        std::vector<ud_addr> theirs(sp.count), mine(sp.count);
+        read_all(sp.rfd, theirs.data(), sizeof(ud_addr) * sp.count);
+        for (int i = 0; i < sp.count; i++)
+        {
+            const uint32_t id = t->add_peer(theirs[i]);
+            mine[i] = d.addr(qp, id);
+        }
+        write_all(sp.wfd, mine.data(), sizeof(ud_addr) * sp.count);
+    }
+    for (sink_proc &sp : sinks)
+    {
+        char c;
+        read_all(sp.rfd, &c, 1);
+    }
+    const double setup = (now_ns() - t0) / 1e9;
+
+    char *buf = (char *)malloc(o.size);
+    CHECK(buf, "malloc fail");
+    std::vector<uint32_t> seq(o.peers, 0);
+    std::vector<struct ibv_wc> wcs(64);
+    int sent = 0, peer = 0;
+    uint64_t last_tick = 0;
+    const uint64_t start = now_ns();
+    while (t->acked_msgs() < (uint64_t)o.msgs)
+    {
+        for (int tries = 0; sent < o.msgs && tries < o.peers; tries++)
+        {
+            const msg_stamp m = {(uint32_t)peer, seq[peer]};
+            memcpy(buf, &m, sizeof(m));
+            memset(buf + sizeof(m), fill_byte(m), o.size - sizeof(m));
+            const bool ok = t->send(peer, buf, o.size);
+            if (ok)
+            {
+                seq[peer]++;
+            }
+            peer = (peer + 1) % o.peers;
+            if (ok)
+            {
+                sent++;
+                break;
+            }
+        }
+        int n = ibv_poll_cq(d.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs[i];
+            if (wc.opcode & IBV_WC_RECV)
+            {
+                CHECK(wc.status == IBV_WC_SUCCESS, "ud recv fail");
+                t->on_recv(ring->buf(wc.wr_id) + GRH_SIZE, wc.byte_len - GRH_SIZE);
+                ring->post(wc.wr_id, qp, nullptr);
+            }
+            else
+            {
+                t->on_send_wc(wc);
+            }
+        }
+        const uint64_t now = now_ns();
+        if (now - last_tick > 20000)
+        {
+            last_tick = now;
+            t->tick(now);
+        }
+    }
+    const double secs = (now_ns() - start) / 1e9;
+    sink_result r;
+    stop_sinks(sinks, r);
+    report("ud", o, 1, setup, secs, r);
+    printf(", mtu=%u, ah cache %zu entries for %zu peers, retransmits=%lu, sink drops=%lu, lost=%lu\n",
+           mtu, ahs->size(), t->peers(), t->retransmits(), r.dropped, r.lost + t->lost());
+
+    free(buf);
+    delete t;
+    delete ahs;
+    ibv_destroy_qp(qp);
+    delete ring;
+    d.close();
+}
+
+int main(int argc, char *argv[])
+{
+    options o;
+    int opt;
+    while ((opt = getopt(argc, argv, "N:S:m:s:w:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'N':
+            o.peers = atoi(optarg);
+            break;
+        case 'S':
+            o.sinks = atoi(optarg);
+            break;
+        case 'm':
+            o.msgs = atoi(optarg);
+            break;
+        case 's':
+            o.size = atoi(optarg);
+            break;
+        case 'w':
+            o.window = atoi(optarg);
+            break;
+        case 'l':
+            o.loss = atof(optarg);
+            break;
+        default:
+            printf("usage: %s [-N peers] [-S sinks] [-m msgs] [-s size] [-w window] [-l loss]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(o.peers > 0 && o.sinks > 0 && o.sinks <= o.peers && o.msgs > 0 &&
+              o.size >= sizeof(msg_stamp) && o.window > 0 && o.loss >= 0 && o.loss < 1,
+          "invalid args");
+    // a message must fit the window, check it before any sink is forked
+    {
+        dev d;
+        d.open(1);
+        const uint32_t max_payload = mtu_to_num(d.port_attr.active_mtu) - sizeof(ud_hdr);
+        d.close();
+        const uint32_t nfrags = (o.size + max_payload - 1) / max_payload;
+        if (nfrags > (uint32_t)o.window)
+        {
+            printf("a %u byte message takes %u fragments of %u bytes, more than -w %d\n", o.size, nfrags,
+                   max_payload, o.window);
+        }
+        CHECK(nfrags <= (uint32_t)o.window, "invalid args");
+    }
+
+    bench_rc(o);
+    bench_ud(o);
+    return 0;
+}
@@ -0,0 +1,611 @@
+/**
+ * Example of a one-sided message channel built on RDMA WRITE with immediate.
+ * If you have no RDMA hardware, see https://zhuanlan.zhihu.com/p/653997181
+ * to config Soft-RoCE(RXE).
+ *
+ * The sender RDMA-WRITEs every record straight into a circular buffer on the
+ * receiver and signals it with IBV_WR_RDMA_WRITE_WITH_IMM. The immediate data
+ * carries the record length, so there is no header and no receive buffer
+ * matching: the receive wrs have no sge at all, the record is consumed in
+ * place in the ring.
+ *
+ * Records have variable length, the demo mixes sizes from 8 bytes up to
+ * msg_size. Ring layout: records are 8 bytes aligned and never wrap, when
+ * a record does not fit before the end of the ring it is written at offset
+ * 0 and the WRAP bit is set in the immediate data.
+ *
+ * Flow control: the receiver lazily RDMA-WRITEs two counters into the
+ * sender, the bytes it consumed (head) and the number of records it
+ * consumed (recv wrs reposted), every quarter ring, half the recv depth,
+ * or when it runs idle. The sender never writes past head + ring size and
+ * never has more records in flight than posted receive wrs.
+ *
+ * The example runs sender and receiver on two threads over a loopback qp
+ * pair and compares it with plain SEND/RECV of the same messages, where
+ * every receive buffer has to be msg_size long.
+ *
+ * g++ -O2 write_imm_ring.cpp -libverbs -lpthread -o write_imm_ring
+ * ./write_imm_ring [-s msg_size] [-n msgs] [-r ring_kb] [-d depth]
+ *
+ * author: lihao <hooleeucas@163.com>
+ *
+ * Under Apache License 2.0
+ */
+#include <stdio.h>
+#include <endian.h>
+#include <infiniband/verbs.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#define CHECK(c, fmt, ...)                                               \
+    do                                                                   \
+    {                                                                    \
+        if (!(c))                                                        \
+        {                                                                \
+            printf("%s:%d, %s, errno=%d, %s\n", __FILE__, __LINE__, fmt, \
+                   ##__VA_ARGS__, errno, strerror(errno));               \
+            exit(-1);                                                    \
+        }                                                                \
+    } while (0)
+
+#define PORT_NUM 1
+#define IMM_WRAP 0x80000000u
+#define ALIGN8(x) (((x) + 7) & ~7ull)
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct ibv_qp *create_qp(struct ibv_pd *pd, struct ibv_cq *cq, int io_depth)
+{
+    struct ibv_qp_init_attr init_attr;
+    memset(&init_attr, 0, sizeof(init_attr));
+    init_attr.send_cq = cq;
+    init_attr.recv_cq = cq;
+    init_attr.cap.max_send_wr = io_depth;
+    init_attr.cap.max_recv_wr = io_depth;
+    init_attr.cap.max_send_sge = 1;
+    init_attr.cap.max_recv_sge = 1;
+    init_attr.cap.max_inline_data = 64; // for the head updates
+    init_attr.qp_type = IBV_QPT_RC;
+    struct ibv_qp *qp = ibv_create_qp(pd, &init_attr);
+    CHECK(qp, "ibv_create_qp fail");
+    return qp;
+}
+bool init_qp(struct ibv_qp *qp)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_INIT;
+    attr.pkey_index = 0;
+    attr.port_num = PORT_NUM;
+    attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE |
+                           IBV_ACCESS_REMOTE_READ |
+                           IBV_ACCESS_REMOTE_WRITE;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_PKEY_INDEX |
+                                IBV_QP_PORT |
+                                IBV_QP_ACCESS_FLAGS);
+    CHECK(ret == 0, "ibv_modify_qp init fail");
+    return true;
+}
+// mtu and sgid of the port, a short form of probe_qp_params in modify_qp_simple.cpp
+struct port_path
+{
+    enum ibv_mtu mtu; // active mtu, a larger path mtu fails RTR or drops full packets
+    int gid_index;    // first RoCEv2 gid, 0 if there is none or on IB
+};
+
+port_path probe_path(struct ibv_context *ctx, int port)
+{
+    struct ibv_port_attr port_attr;
+    int ret = ibv_query_port(ctx, port, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+    port_path p = {port_attr.active_mtu, 0};
+    for (int i = 0; port_attr.link_layer != IBV_LINK_LAYER_INFINIBAND && i < port_attr.gid_tbl_len; i++)
+    {
+        struct ibv_gid_entry entry;
+        if (ibv_query_gid_ex(ctx, port, i, &entry, 0) == 0 && entry.gid_type == IBV_GID_TYPE_ROCE_V2)
+        {
+            p.gid_index = i;
+            break;
+        }
+    }
+    return p;
+}
+bool modify_to_rtr(struct ibv_qp *qp, const port_path &p, uint32_t r_qpn, uint32_t r_psn, uint16_t dlid, union ibv_gid gid)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTR;
+    attr.path_mtu = p.mtu;
+    attr.dest_qp_num = r_qpn;
+    attr.rq_psn = r_psn;
+    attr.max_dest_rd_atomic = 1;
+    attr.min_rnr_timer = 12;
+    attr.ah_attr.is_global = 1;
+    attr.ah_attr.grh.hop_limit = 64;
+    attr.ah_attr.grh.dgid = gid;
+    attr.ah_attr.grh.sgid_index = p.gid_index;
+    attr.ah_attr.dlid = dlid;
+    attr.ah_attr.sl = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num = PORT_NUM;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU |
+                                IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+                                IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER);
+    CHECK(ret == 0, "ibv_modify_qp RTR fail");
+    return true;
+}
+bool modify_to_rts(struct ibv_qp *qp, uint32_t my_psn)
+{
+    struct ibv_qp_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state = IBV_QPS_RTS;
+    attr.sq_psn = my_psn;
+    attr.timeout = 14;
+    attr.retry_cnt = 7;
+    attr.rnr_retry = 7; /* infinite */
+    attr.max_rd_atomic = 1;
+    int ret = ibv_modify_qp(qp, &attr,
+                            IBV_QP_STATE |
+                                IBV_QP_TIMEOUT |
+                                IBV_QP_RETRY_CNT |
+                                IBV_QP_RNR_RETRY |
+                                IBV_QP_SQ_PSN |
+                                IBV_QP_MAX_QP_RD_ATOMIC);
+    CHECK(ret == 0, "ibv_modify_qp RTS fail");
+    return true;
+}
+
+// written by the receiver into the sender with RDMA WRITE
+struct ring_ack
+{
+    volatile uint64_t head; // bytes consumed, including the skipped tail on wrap
+    volatile uint64_t msgs; // records consumed, i.e. recv wrs reposted
+};
+
+struct endpoint
+{
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    char *buf;
+    struct ibv_mr *mr;
+    uint64_t size;
+};
+
+struct config
+{
+    uint32_t msg_size = 64;
+    int msgs = 1000000;
+    uint64_t ring_size = 1024 * 1024;
+    int depth = 128;
+};
+
+void post_recvs(struct ibv_qp *qp, int n, struct ibv_sge *sge)
+{
+    std::vector<struct ibv_recv_wr> wrs(n);
+    for (int i = 0; i < n; i++)
+    {
+        memset(&wrs[i], 0, sizeof(wrs[i]));
+        wrs[i].sg_list = sge;
+        wrs[i].num_sge = sge ? 1 : 0;
+        wrs[i].next = i + 1 < n ? &wrs[i + 1] : nullptr;
+    }
+    struct ibv_recv_wr *bad_wr = nullptr;
+    int ret = ibv_post_recv(qp, wrs.data(), &bad_wr);
+    CHECK(ret == 0, "ibv_post_recv fail");
+}
+
+// length of record seq, spread over [8, msg_size] so both paths see mixed sizes
+static inline uint32_t record_len(uint64_t seq, const config &cfg)
+{
+    return 8 + (uint32_t)(seq * 2654435761u % (cfg.msg_size - 7));
+}
+
+// the first 8 bytes of every message is its sequence number, the last byte its low byte
+static inline void fill_msg(char *p, uint64_t seq, uint32_t len)
+{
+    memcpy(p, &seq, sizeof(seq));
+    p[len - 1] = (char)seq;
+}
+
+static inline void check_msg(const char *p, uint64_t expect, uint32_t len, const config &cfg)
+{
+    uint64_t seq;
+    memcpy(&seq, p, sizeof(seq));
+    if (seq != expect || len != record_len(expect, cfg) || p[len - 1] != (char)expect)
+    {
+        printf("corrupted message, expect seq=%lu len=%u, got seq=%lu len=%u\n",
+               expect, record_len(expect, cfg), seq, len);
+        exit(-1);
+    }
+}
+
+/**
+ * Sender of the ring channel. s.buf holds depth staging slots of msg_size,
+ * slot seq % depth is reused only after the write is complete. The imm
+ * carries the record length, the ring space taken is that length aligned.
+ */
+void ring_sender(endpoint &s, const config &cfg, uint64_t ring_addr, uint32_t ring_rkey,
+                 ring_ack *ack)
+{
+    const int signal_every = std::max(1, cfg.depth / 4);
+    uint64_t tail = 0; // bytes written into the ring, monotonic
+    uint64_t seq = 0, completed = 0;
+    std::vector<struct ibv_wc> wcs(16);
+    while (completed < (uint64_t)cfg.msgs)
+    {
+        int n = ibv_poll_cq(s.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            CHECK(wcs[i].status == IBV_WC_SUCCESS, "bad send wc");
+            completed = wcs[i].wr_id + 1;
+        }
+        while (seq < (uint64_t)cfg.msgs && seq - completed < (uint64_t)cfg.depth)
+        {
+            // the receiver has cfg.depth recv wrs, msgs - ack->msgs of them are used
+            if (seq - ack->msgs >= (uint64_t)cfg.depth)
+            {
+                break;
+            }
+            const uint32_t len = record_len(seq, cfg);
+            const uint64_t rec = ALIGN8(len);
+            uint64_t pos = tail % cfg.ring_size;
+            uint64_t skip = pos + rec > cfg.ring_size ? cfg.ring_size - pos : 0;
+            if (tail + skip + rec - ack->head > cfg.ring_size)
+            {
+                break; // ring full
+            }
+            tail += skip;
+            pos = tail % cfg.ring_size;
+
+            char *slot = s.buf + (seq % cfg.depth) * cfg.msg_size;
+            fill_msg(slot, seq, len);
+            struct ibv_sge sge;
+            sge.addr = (uint64_t)slot;
+            sge.length = len;
+            sge.lkey = s.mr->lkey;
+            struct ibv_send_wr wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = seq;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+            wr.imm_data = htonl(len | (skip ? IMM_WRAP : 0));
+            wr.wr.rdma.remote_addr = ring_addr + pos;
+            wr.wr.rdma.rkey = ring_rkey;
+            if ((seq + 1) % signal_every == 0 || seq + 1 == (uint64_t)cfg.msgs)
+            {
+                wr.send_flags = IBV_SEND_SIGNALED;
+            }
+            struct ibv_send_wr *bad_wr = nullptr;
+            int ret = ibv_post_send(s.qp, &wr, &bad_wr);
+            CHECK(ret == 0, "ibv_post_send fail");
+            tail += rec;
+            seq++;
+        }
+    }
+}
+
+/**
+ * Receiver of the ring channel. Records are consumed in place, recv wrs
+ * (without sge) are reposted in batches, and the counters are pushed to
+ * the sender every quarter ring, half the recv depth, or on an empty poll.
+ */
+void ring_receiver(endpoint &r, const config &cfg, uint64_t ack_addr, uint32_t ack_rkey,
+                   uint64_t *checksum)
+{
+    uint64_t head = 0, msgs = 0;
+    uint64_t acked_head = 0, acked_msgs = 0;
+    int to_repost = 0;
+    uint64_t sum = 0;
+    uint64_t acks_posted = 0, acks_done = 0;
+    std::vector<struct ibv_wc> wcs(64);
+    while (msgs < (uint64_t)cfg.msgs)
+    {
+        int n = ibv_poll_cq(r.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs[i];
+            CHECK(wc.status == IBV_WC_SUCCESS, "bad recv wc");
+            if (wc.opcode != IBV_WC_RECV_RDMA_WITH_IMM)
+            {
+                acks_done++; // completion of an ack write
+                continue;
+            }
+            const uint32_t imm = ntohl(wc.imm_data);
+            const uint32_t len = imm & ~IMM_WRAP;
+            if (imm & IMM_WRAP)
+            {
+                head += cfg.ring_size - head % cfg.ring_size;
+            }
+            const char *p = r.buf + head % cfg.ring_size;
+            check_msg(p, msgs, len, cfg);
+            sum += (uint8_t)p[len - 1];
+            head += ALIGN8(len);
+            msgs++;
+            to_repost++;
+        }
+        if (to_repost > 0)
+        {
+            post_recvs(r.qp, to_repost, nullptr);
+            to_repost = 0;
+        }
+        // the ack does not have to be sent now, so skip it if the send queue is full.
+        // An idle poll acks whatever is left, else a sender stalled below both
+        // thresholds would wait forever.
+        const bool idle = n == 0 && (head != acked_head || msgs != acked_msgs);
+        const bool want_ack = idle || head - acked_head >= cfg.ring_size / 4 ||
+                              msgs - acked_msgs >= (uint64_t)cfg.depth / 2;
+        if (want_ack && acks_posted - acks_done < (uint64_t)cfg.depth)
+        {
+            ring_ack a;
+            a.head = head;
+            a.msgs = msgs;
+            struct ibv_sge sge;
+            sge.addr = (uint64_t)&a;
+            sge.length = sizeof(a);
+            sge.lkey = 0; // ignored for inline data
+            struct ibv_send_wr wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = acks_posted++;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_RDMA_WRITE;
+            wr.send_flags = IBV_SEND_INLINE | IBV_SEND_SIGNALED;
+            wr.wr.rdma.remote_addr = ack_addr;
+            wr.wr.rdma.rkey = ack_rkey;
+            struct ibv_send_wr *bad_wr = nullptr;
+            int ret = ibv_post_send(r.qp, &wr, &bad_wr);
+            CHECK(ret == 0, "ibv_post_send ack fail");
+            acked_head = head;
+            acked_msgs = msgs;
+        }
+    }
+    *checksum = sum;
+}
+
+// baseline: SEND into posted receive buffers, one buffer per message
+void send_sender(endpoint &s, const config &cfg)
+{
+    const int signal_every = std::max(1, cfg.depth / 4);
+    uint64_t seq = 0, completed = 0;
+    std::vector<struct ibv_wc> wcs(16);
+    while (completed < (uint64_t)cfg.msgs)
+    {
+        int n = ibv_poll_cq(s.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            CHECK(wcs[i].status == IBV_WC_SUCCESS, "bad send wc");
+            completed = wcs[i].wr_id + 1;
+        }
+        while (seq < (uint64_t)cfg.msgs && seq - completed < (uint64_t)cfg.depth)
+        {
+            const uint32_t len = record_len(seq, cfg);
+            char *slot = s.buf + (seq % cfg.depth) * cfg.msg_size;
+            fill_msg(slot, seq, len);
+            struct ibv_sge sge;
+            sge.addr = (uint64_t)slot;
+            sge.length = len;
+            sge.lkey = s.mr->lkey;
+            struct ibv_send_wr wr;
+            memset(&wr, 0, sizeof(wr));
+            wr.wr_id = seq;
+            wr.sg_list = &sge;
+            wr.num_sge = 1;
+            wr.opcode = IBV_WR_SEND;
+            if ((seq + 1) % signal_every == 0 || seq + 1 == (uint64_t)cfg.msgs)
+            {
+                wr.send_flags = IBV_SEND_SIGNALED;
+            }
+            struct ibv_send_wr *bad_wr = nullptr;
+            int ret = ibv_post_send(s.qp, &wr, &bad_wr);
+            CHECK(ret == 0, "ibv_post_send fail");
+            seq++;
+        }
+    }
+}
+
+void send_receiver(endpoint &r, const config &cfg, uint64_t *checksum)
+{
+    uint64_t msgs = 0, sum = 0;
+    std::vector<struct ibv_wc> wcs(64);
+    std::vector<struct ibv_sge> sges(64);
+    std::vector<struct ibv_recv_wr> wrs(64);
+    while (msgs < (uint64_t)cfg.msgs)
+    {
+        int n = ibv_poll_cq(r.cq, wcs.size(), wcs.data());
+        CHECK(n >= 0, "ibv_poll_cq fail");
+        for (int i = 0; i < n; i++)
+        {
+            struct ibv_wc &wc = wcs[i];
+            CHECK(wc.status == IBV_WC_SUCCESS, "bad recv wc");
+            const char *p = (const char *)wc.wr_id;
+            check_msg(p, msgs, wc.byte_len, cfg);
+            sum += (uint8_t)p[wc.byte_len - 1];
+            msgs++;
+            sges[i].addr = wc.wr_id;
+            sges[i].length = cfg.msg_size;
+            sges[i].lkey = r.mr->lkey;
+            memset(&wrs[i], 0, sizeof(wrs[i]));
+            wrs[i].wr_id = wc.wr_id;
+            wrs[i].sg_list = &sges[i];
+            wrs[i].num_sge = 1;
+            wrs[i].next = i + 1 < n ? &wrs[i + 1] : nullptr;
+        }
+        if (n > 0)
+        {
+            struct ibv_recv_wr *bad_wr = nullptr;
+            int ret = ibv_post_recv(r.qp, wrs.data(), &bad_wr);
+            CHECK(ret == 0, "ibv_post_recv fail");
+        }
+    }
+    *checksum = sum;
+}
+
+endpoint make_endpoint(struct ibv_context *ctx, struct ibv_pd *pd, int depth, uint64_t size)
+{
+    endpoint e;
+    e.cq = ibv_create_cq(ctx, depth * 2, nullptr, nullptr, 0);
+    CHECK(e.cq, "ibv_create_cq fail");
+    e.qp = create_qp(pd, e.cq, depth);
+    e.size = (size + 4095) / 4096 * 4096;
+    e.buf = (char *)aligned_alloc(4096, e.size);
+    CHECK(e.buf, "aligned_alloc fail");
+    memset(e.buf, 0, e.size);
+    e.mr = ibv_reg_mr(pd, e.buf, e.size,
+                      IBV_ACCESS_LOCAL_WRITE |
+                          IBV_ACCESS_REMOTE_WRITE |
+                          IBV_ACCESS_REMOTE_READ);
+    CHECK(e.mr, "ibv_reg_mr fail");
+    return e;
+}
+
+void destroy_endpoint(endpoint &e)
+{
+    ibv_destroy_qp(e.qp);
+    ibv_destroy_cq(e.cq);
+    ibv_dereg_mr(e.mr);
+    free(e.buf);
+}
+
+int main(int argc, char *argv[])
+{
+    config cfg;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:n:r:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            cfg.msg_size = atoi(optarg);
+            break;
+        case 'n':
+            cfg.msgs = atoi(optarg);
+            break;
+        case 'r':
+            cfg.ring_size = strtoull(optarg, nullptr, 10) * 1024;
+            break;
+        case 'd':
+            cfg.depth = atoi(optarg);
+            break;
+        default:
+            printf("usage: %s [-s msg_size] [-n msgs] [-r ring_kb] [-d depth]\n", argv[0]);
+            return -1;
+        }
+    }
+    CHECK(cfg.msg_size >= 8 && cfg.msg_size < IMM_WRAP, "msg_size must be at least 8");
+    CHECK(ALIGN8(cfg.msg_size) * 2 <= cfg.ring_size, "ring too small");
+    CHECK(cfg.depth >= 2 && cfg.msgs > 0, "invalid args");
+
+    struct ibv_device **devs;
+    int num_devices;
+    devs = ibv_get_device_list(&num_devices);
+    CHECK(devs && num_devices, "ibv_get_device_list fail");
+    struct ibv_context *ctx = ibv_open_device(devs[0]);
+    CHECK(ctx, "ibv_open_device fail");
+    struct ibv_pd *pd = ibv_alloc_pd(ctx);
+    CHECK(pd, "ibv_alloc_pd fail");
+    union ibv_gid gid;
+    const port_path path = probe_path(ctx, PORT_NUM);
+    int ret = ibv_query_gid(ctx, PORT_NUM, path.gid_index, &gid);
+    CHECK(ret == 0, "ibv_query_gid fail");
+    struct ibv_port_attr port_attr;
+    ret = ibv_query_port(ctx, PORT_NUM, &port_attr);
+    CHECK(ret == 0, "ibv_query_port fail");
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        const bool use_ring = mode == 1;
+        // sender: staging slots, followed by the ring_ack the receiver writes into
+        endpoint s = make_endpoint(ctx, pd, cfg.depth, (uint64_t)cfg.depth * cfg.msg_size + sizeof(ring_ack));
+        ring_ack *ack = (ring_ack *)(s.buf + s.size - sizeof(ring_ack));
+        // receiver: the ring, or depth receive buffers
+        endpoint r = make_endpoint(ctx, pd, cfg.depth,
+                                   use_ring ? cfg.ring_size : (uint64_t)cfg.depth * cfg.msg_size);
+        init_qp(s.qp);
+        init_qp(r.qp);
+        modify_to_rtr(s.qp, path, r.qp->qp_num, 0, port_attr.lid, gid);
+        modify_to_rtr(r.qp, path, s.qp->qp_num, 0, port_attr.lid, gid);
+        modify_to_rts(s.qp, 0);
+        modify_to_rts(r.qp, 0);
+
+        if (use_ring)
+        {
+            post_recvs(r.qp, cfg.depth, nullptr);
+        }
+        else
+        {
+            for (int i = 0; i < cfg.depth; i++)
+            {
+                struct ibv_sge sge;
+                sge.addr = (uint64_t)r.buf + (uint64_t)i * cfg.msg_size;
+                sge.length = cfg.msg_size;
+                sge.lkey = r.mr->lkey;
+                struct ibv_recv_wr wr;
+                memset(&wr, 0, sizeof(wr));
+                wr.wr_id = sge.addr;
+                wr.sg_list = &sge;
+                wr.num_sge = 1;
+                struct ibv_recv_wr *bad_wr = nullptr;
+                ret = ibv_post_recv(r.qp, &wr, &bad_wr);
+                CHECK(ret == 0, "ibv_post_recv fail");
+            }
+        }
+
+        uint64_t checksum = 0;
+        const uint64_t start = now_ns();
+        std::thread receiver([&]() {
+            if (use_ring)
+            {
+                ring_receiver(r, cfg, (uint64_t)ack, s.mr->rkey, &checksum);
+            }
+            else
+            {
+                send_receiver(r, cfg, &checksum);
+            }
+        });
+        if (use_ring)
+        {
+            ring_sender(s, cfg, (uint64_t)r.buf, r.mr->rkey, ack);
+        }
+        else
+        {
+            send_sender(s, cfg);
+        }
+        receiver.join();
+        const double secs = (now_ns() - start) / 1e9;
+        uint64_t bytes = 0;
+        for (int i = 0; i < cfg.msgs; i++)
+        {
+            bytes += record_len(i, cfg);
+        }
+        printf("%-10s msg_size=8..%u, msgs=%d, %.0f msgs/s, %.2f MB/s, checksum=%lu\n",
+               use_ring ? "write_imm" : "send", cfg.msg_size, cfg.msgs,
+               cfg.msgs / secs, bytes / secs / 1e6, checksum);
+
+        destroy_endpoint(s);
+        destroy_endpoint(r);
+    }
+
+    ibv_dealloc_pd(pd);
+    ibv_close_device(ctx);
+    ibv_free_device_list(devs);
+    return 0;
+}